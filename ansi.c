@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ansi.h"
+
+
+/* Alternate screen, cursor hidden, plain style, cleared. */
+#define ANSI_START  "\033[?1049h\033[?25l\033[m\033(B\033[H\033[2J"
+#define ANSI_END    "\033[m\033(B\033[?25h\033[?1049l"
+
+/* Enough for a cursor move, a change of style and the glyph. */
+#define CELL_MAX_SIZE   32
+#define MOVE_MAX_SIZE   32
+
+/* No style has every bit set, so a cell shown with it always differs. */
+#define STYLE_UNKNOWN   0xff
+/* Plain style and characters, from any style. */
+#define STYLE_RESET     "\033[m\033(B"
+
+
+static void moveCursor(AnsiScreen *screen, int y, int x);
+static int putStep(char *buffer, int count, char direction);
+static int putColumn(const AnsiScreen *screen, char *buffer, int y, int from,
+                     int to);
+static void setStyle(AnsiScreen *screen, int style);
+static void append(AnsiScreen *screen, const char *bytes, size_t size);
+static int writeAll(int fd, const unsigned char *bytes, size_t size);
+
+
+int ansiOpen(AnsiScreen *screen, int fd, int height, int width)
+{
+    size_t count = (size_t)height*(size_t)width;
+
+    screen->fd = fd;
+    screen->cells = malloc(count*sizeof(*screen->cells));
+    screen->shown = malloc(count*sizeof(*screen->shown));
+    screen->buffer = malloc(count*CELL_MAX_SIZE);
+    if (screen->cells == NULL || screen->shown == NULL ||
+        screen->buffer == NULL) {
+        ansiClose(screen);
+        return 0;
+    }
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        screen->cells[i].glyph = ' ';
+        screen->cells[i].style = 0;
+    }
+    memcpy(screen->shown, screen->cells, count*sizeof(*screen->shown));
+
+    screen->height = height;
+    screen->width = width;
+    screen->cursorY = 0;
+    screen->cursorX = 0;
+    screen->style = 0;
+    screen->length = 0;
+    screen->frames = 0;
+    screen->bytes = 0;
+    screen->maxBytes = 0;
+
+    return writeAll(fd, (const unsigned char *)ANSI_START,
+                    sizeof(ANSI_START) - 1);
+}
+
+void ansiPut(AnsiScreen *screen, int y, int x, unsigned char glyph,
+             int style)
+{
+    if (y < 0 || y >= screen->height || x < 0 || x >= screen->width) {
+        return;
+    }
+
+    AnsiCell *cell = &screen->cells[y*screen->width + x];
+    cell->glyph = glyph;
+    cell->style = (unsigned char)style;
+}
+
+void ansiText(AnsiScreen *screen, int y, int x, const char *text, int style)
+{
+    for (; *text; text++, x++) {
+        ansiPut(screen, y, x, (unsigned char)*text, style);
+    }
+}
+
+void ansiBox(AnsiScreen *screen, int y, int x, int height, int width)
+{
+    int row;
+    int column;
+    for (row = 0; row < height; row++) {
+        for (column = 0; column < width; column++) {
+            int top = row == 0;
+            int bottom = row == height-1;
+            int left = column == 0;
+            int right = column == width-1;
+            unsigned char glyph = ' ';
+
+            if ((top || bottom) && (left || right)) {
+                glyph = top ? (left ? 'l' : 'k') : (left ? 'm' : 'j');
+            }
+            else if (top || bottom) {
+                glyph = 'q';
+            }
+            else if (left || right) {
+                glyph = 'x';
+            }
+
+            ansiPut(screen, y + row, x + column, glyph,
+                    glyph == ' ' ? 0 : ANSI_LINES);
+        }
+    }
+}
+
+/* Cells are visited row by row, so everything before the one being drawn
+ * is already what the terminal shows; runs of one style share the escape
+ * that set it. */
+size_t ansiFlush(AnsiScreen *screen)
+{
+    screen->length = 0;
+
+    int y;
+    int x;
+    for (y = 0; y < screen->height; y++) {
+        for (x = 0; x < screen->width; x++) {
+            int i = y*screen->width + x;
+            if (screen->cells[i].glyph == screen->shown[i].glyph &&
+                screen->cells[i].style == screen->shown[i].style) {
+                continue;
+            }
+
+            moveCursor(screen, y, x);
+            setStyle(screen, screen->cells[i].style);
+            screen->buffer[screen->length++] = screen->cells[i].glyph;
+            screen->shown[i] = screen->cells[i];
+
+            /* Terminals differ in where the last column leaves it. */
+            if (x == screen->width-1) {
+                screen->cursorY = -1;
+            }
+            else {
+                screen->cursorX = x+1;
+            }
+        }
+    }
+
+    if (!screen->length) {
+        return 0;
+    }
+    /* Any part of the frame may be missing, so the next one draws every
+     * cell from a style it sets in full. */
+    if (!writeAll(screen->fd, screen->buffer, screen->length)) {
+        int i;
+        for (i = 0; i < screen->height*screen->width; i++) {
+            screen->shown[i].style = STYLE_UNKNOWN;
+        }
+        screen->cursorY = -1;
+        screen->style = -1;
+    }
+
+    screen->frames++;
+    screen->bytes += screen->length;
+    if (screen->length > screen->maxBytes) {
+        screen->maxBytes = screen->length;
+    }
+
+    return screen->length;
+}
+
+void ansiClose(AnsiScreen *screen)
+{
+    if (screen->buffer != NULL) {
+        writeAll(screen->fd, (const unsigned char *)ANSI_END,
+                 sizeof(ANSI_END) - 1);
+    }
+
+    free(screen->cells);
+    free(screen->shown);
+    free(screen->buffer);
+    screen->cells = NULL;
+    screen->shown = NULL;
+    screen->buffer = NULL;
+}
+
+/* The shortest of an absolute move, a relative one, and a carriage return
+ * and line feeds followed by a move along the row. */
+static void moveCursor(AnsiScreen *screen, int y, int x)
+{
+    if (screen->cursorY == y && screen->cursorX == x) {
+        return;
+    }
+
+    char best[MOVE_MAX_SIZE];
+    int bestSize = snprintf(best, sizeof(best), "\033[%d;%dH", y+1, x+1);
+
+    if (screen->cursorY >= 0) {
+        char move[MOVE_MAX_SIZE];
+        int dy = y - screen->cursorY;
+        int size = 0;
+
+        if (dy > 0) {
+            size = putStep(move, dy, 'B');
+        }
+        else if (dy < 0) {
+            size = putStep(move, -dy, 'A');
+        }
+        size += putColumn(screen, move + size, y, screen->cursorX, x);
+        if (size < bestSize) {
+            memcpy(best, move, (size_t)size);
+            bestSize = size;
+        }
+
+        if (dy >= 0 && 1 + dy < bestSize) {
+            size = 0;
+            move[size++] = '\r';
+            memset(move + size, '\n', (size_t)dy);
+            size += dy;
+            size += putColumn(screen, move + size, y, 0, x);
+            if (size < bestSize) {
+                memcpy(best, move, (size_t)size);
+                bestSize = size;
+            }
+        }
+    }
+
+    append(screen, best, (size_t)bestSize);
+    screen->cursorY = y;
+    screen->cursorX = x;
+}
+
+static int putStep(char *buffer, int count, char direction)
+{
+    if (count == 1) {
+        return sprintf(buffer, "\033[%c", direction);
+    }
+
+    return sprintf(buffer, "\033[%d%c", count, direction);
+}
+
+/* A short way right is to print again what is already there, when it is
+ * all in the style currently set. */
+static int putColumn(const AnsiScreen *screen, char *buffer, int y, int from,
+                     int to)
+{
+    if (to == from) {
+        return 0;
+    }
+
+    if (to < from) {
+        int size = putStep(buffer, from - to, 'D');
+
+        char forward[MOVE_MAX_SIZE];
+        forward[0] = '\r';
+        int forwardSize = 1 + putColumn(screen, forward + 1, y, 0, to);
+        if (forwardSize < size) {
+            memcpy(buffer, forward, (size_t)forwardSize);
+            return forwardSize;
+        }
+        return size;
+    }
+
+    int size = putStep(buffer, to - from, 'C');
+    if (to - from > size) {
+        return size;
+    }
+
+    const AnsiCell *row = &screen->shown[y*screen->width];
+    int x;
+    for (x = from; x < to; x++) {
+        if (row[x].style != screen->style) {
+            return size;
+        }
+    }
+    for (x = from; x < to; x++) {
+        buffer[x - from] = (char)row[x].glyph;
+    }
+
+    return to - from;
+}
+
+/* Only what changed is sent; dropping reverse takes a reset. */
+static void setStyle(AnsiScreen *screen, int style)
+{
+    int old = screen->style;
+    if (style == old) {
+        return;
+    }
+    screen->style = style;
+
+    if (old < 0) {
+        append(screen, STYLE_RESET, sizeof(STYLE_RESET) - 1);
+        old = 0;
+        if (style == old) {
+            return;
+        }
+    }
+
+    if ((style ^ old) & ANSI_LINES) {
+        append(screen, style & ANSI_LINES ? "\033(0" : "\033(B", 3);
+    }
+    if (!((style ^ old) & ~ANSI_LINES)) {
+        return;
+    }
+
+    char sgr[16];
+    int size = sprintf(sgr, "\033[");
+    int color = style & ANSI_COLOR_MASK;
+    int reset = (old & ANSI_REVERSE) && !(style & ANSI_REVERSE);
+
+    if (reset) {
+        if (color) {
+            size += sprintf(sgr + size, "0;4%d", color - 1);
+        }
+    }
+    else {
+        if (style & ANSI_REVERSE && !(old & ANSI_REVERSE)) {
+            size += sprintf(sgr + size, "7");
+        }
+        if (color != (old & ANSI_COLOR_MASK)) {
+            size += sprintf(sgr + size, size > 2 ? ";4%d" : "4%d",
+                            color ? color - 1 : 9);
+        }
+    }
+    sgr[size++] = 'm';
+
+    append(screen, sgr, (size_t)size);
+}
+
+static void append(AnsiScreen *screen, const char *bytes, size_t size)
+{
+    memcpy(screen->buffer + screen->length, bytes, size);
+    screen->length += size;
+}
+
+static int writeAll(int fd, const unsigned char *bytes, size_t size)
+{
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+
+        bytes += written;
+        size -= (size_t)written;
+    }
+
+    return 1;
+}
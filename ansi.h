@@ -0,0 +1,71 @@
+#ifndef ANSI_H
+#define ANSI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* The eight colours every ANSI terminal has. */
+#define ANSI_BLACK      0
+#define ANSI_RED        1
+#define ANSI_GREEN      2
+#define ANSI_YELLOW     3
+#define ANSI_BLUE       4
+#define ANSI_MAGENTA    5
+#define ANSI_CYAN       6
+#define ANSI_WHITE      7
+
+/* A style is a background colour, or none, and the flags below. */
+#define ANSI_BACKGROUND(color)  ((color) + 1)
+#define ANSI_COLOR_MASK         0x0f
+#define ANSI_REVERSE            0x10
+/* The glyph is from the DEC line drawing set: 'q' and 'x' for lines, 'l',
+ * 'k', 'm' and 'j' for corners clockwise from the top left. */
+#define ANSI_LINES              0x20
+
+
+typedef struct {
+    unsigned char glyph;
+    unsigned char style;
+} AnsiCell;
+
+/* A model of the whole terminal. Frames are drawn into cells, and
+ * ansiFlush() sends only what differs from what the terminal shows. */
+typedef struct {
+    int fd;
+    int height;
+    int width;
+    AnsiCell *cells;
+    AnsiCell *shown;
+
+    /* Where the terminal's cursor is, y -1 when that is not known, and
+     * its style, -1 when that is not known. */
+    int cursorY;
+    int cursorX;
+    int style;
+
+    unsigned char *buffer;
+    size_t length;
+
+    /* Per flushed frame that changed anything. */
+    uint64_t frames;
+    uint64_t bytes;
+    size_t maxBytes;
+} AnsiScreen;
+
+
+/* Switches the terminal on fd to its alternate screen and clears it. */
+int ansiOpen(AnsiScreen *screen, int fd, int height, int width);
+/* Anything outside the screen is left out. */
+void ansiPut(AnsiScreen *screen, int y, int x, unsigned char glyph,
+             int style);
+void ansiText(AnsiScreen *screen, int y, int x, const char *text, int style);
+/* A box drawn with lines and cleared inside, as curses' werase() and
+ * box() leave a window. */
+void ansiBox(AnsiScreen *screen, int y, int x, int height, int width);
+/* Sends the frame in one write(); returns the bytes that took. */
+size_t ansiFlush(AnsiScreen *screen);
+/* Leaves the alternate screen the way the terminal was. */
+void ansiClose(AnsiScreen *screen);
+
+#endif
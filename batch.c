@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "engine.h"
+#include "profile.h"
+#include "bot.h"
+#include "search.h"
+
+
+#define DEFAULT_GAMES   1000L
+#define DEFAULT_SEED    1
+/* The lookahead bot rarely loses, so every game is cut off somewhere. */
+#define DEFAULT_PIECES  100000L
+
+#define CACHE_LINE      64
+
+
+typedef struct {
+    unsigned int seed;
+    int score;
+    int lines;
+    int level;
+    long pieces;
+    int lost;
+} GameResult;
+
+/* Written only by the thread that owns them and read once every thread
+ * has been joined, so the hot loop shares no cache lines. */
+typedef struct {
+    pthread_t thread;
+    long games;
+    long long pieces;
+    long long lines;
+    long long score;
+    long lost;
+    long levels[SPEEDS_COUNT];
+    TableStats table;
+} __attribute__((aligned(CACHE_LINE))) Counters;
+
+
+void parseArguments(int argc, char **argv);
+void usage(const char *name);
+
+void *runGames(void *argument);
+void playGame(GameResult *result, Planner *planner);
+int playMove(GameState *state, Planner *planner);
+int speedLevel(const GameState *state);
+
+void printSummary(const Counters *total, double seconds);
+void printDistribution(const char *name, long *values);
+int compareLongs(const void *a, const void *b);
+int writeCsv(const char *path);
+
+
+long gameCount = DEFAULT_GAMES;
+long pieceLimit = DEFAULT_PIECES;
+unsigned int baseSeed = DEFAULT_SEED;
+int threadCount;
+int lookahead;
+const char *csvPath;
+int fieldWidth = DEFAULT_FIELD_WIDTH;
+int fieldHeight = DEFAULT_FIELD_HEIGHT;
+
+GameResult *results;
+long nextGame;
+
+
+int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+    if (!threadCount) {
+        threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    results = calloc((size_t)gameCount, sizeof(*results));
+    Counters *counters;
+    if (results == NULL ||
+        posix_memalign((void **)&counters, CACHE_LINE,
+                       sizeof(*counters)*(size_t)threadCount) != 0) {
+        fprintf(stderr, "cannot allocate %ld games\n", gameCount);
+        return 1;
+    }
+    memset(counters, 0, sizeof(*counters)*(size_t)threadCount);
+
+    uint64_t start = profileClock();
+    int i;
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&counters[i].thread, NULL, runGames,
+                           &counters[i]) != 0) {
+            fprintf(stderr, "cannot start thread %d\n", i);
+            return 1;
+        }
+    }
+    runGames(&counters[0]);
+    for (i = 1; i < threadCount; i++) {
+        pthread_join(counters[i].thread, NULL);
+    }
+    double seconds = (double)(profileClock() - start)/1e9;
+
+    Counters total;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < threadCount; i++) {
+        total.games += counters[i].games;
+        total.pieces += counters[i].pieces;
+        total.lines += counters[i].lines;
+        total.score += counters[i].score;
+        total.lost += counters[i].lost;
+        int level;
+        for (level = 0; level < SPEEDS_COUNT; level++) {
+            total.levels[level] += counters[i].levels[level];
+        }
+        total.table.probes += counters[i].table.probes;
+        total.table.hits += counters[i].table.hits;
+        total.table.stores += counters[i].table.stores;
+    }
+
+    printSummary(&total, seconds);
+    if (csvPath != NULL && !writeCsv(csvPath)) {
+        perror(csvPath);
+        return 1;
+    }
+
+    return 0;
+}
+
+void parseArguments(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"games", required_argument, NULL, 'g'},
+        {"pieces", required_argument, NULL, 'n'},
+        {"seed", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 't'},
+        {"lookahead", no_argument, NULL, 'l'},
+        {"csv", required_argument, NULL, 'c'},
+        {"size", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 'g':
+                gameCount = strtol(optarg, NULL, 0);
+                break;
+            case 'n':
+                pieceLimit = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                baseSeed = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                threadCount = (int)strtol(optarg, NULL, 0);
+                if (threadCount <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'l':
+                lookahead = 1;
+                break;
+            case 'c':
+                csvPath = optarg;
+                break;
+            case 'S':
+                if (!parseFieldSize(optarg, &fieldWidth, &fieldHeight)) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (optind < argc || gameCount <= 0 || pieceLimit <= 0) {
+        usage(argv[0]);
+    }
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--games n] [--pieces n] [--seed n] "
+                    "[--threads n] [--lookahead] [--size WxH] "
+                    "[--csv file]\n", name);
+    exit(1);
+}
+
+/* Game i is played with seed baseSeed + i whichever thread picks it up, so
+ * a batch gives the same results on any number of threads. */
+void *runGames(void *argument)
+{
+    Counters *counters = argument;
+
+    /* One search thread each: the batch is already spread over the cores. */
+    Planner *planner = NULL;
+    if (lookahead) {
+        planner = plannerCreate(1);
+        if (planner == NULL) {
+            fprintf(stderr, "cannot create a planner\n");
+            exit(1);
+        }
+    }
+
+    long index;
+    while ((index = __atomic_fetch_add(&nextGame, 1, __ATOMIC_RELAXED)) <
+           gameCount) {
+        GameResult *result = &results[index];
+        result->seed = baseSeed + (unsigned int)index;
+        playGame(result, planner);
+
+        counters->games++;
+        counters->pieces += result->pieces;
+        counters->lines += result->lines;
+        counters->score += result->score;
+        counters->lost += result->lost;
+        counters->levels[result->level]++;
+    }
+
+    if (planner != NULL) {
+        plannerTableStats(planner, &counters->table);
+    }
+    plannerDestroy(planner);
+
+    return NULL;
+}
+
+void playGame(GameResult *result, Planner *planner)
+{
+    GameState state;
+    newGame(&state, result->seed, fieldWidth, fieldHeight);
+
+    long pieces = 0;
+    while (pieces < pieceLimit && !state.isGameOver &&
+           playMove(&state, planner)) {
+        pieces++;
+    }
+
+    result->score = state.score;
+    result->lines = state.lines;
+    result->level = speedLevel(&state);
+    result->pieces = pieces;
+    result->lost = state.isGameOver || pieces < pieceLimit;
+}
+
+/* Carries the bot's pick out through applyInputs(), as keys would. */
+int playMove(GameState *state, Planner *planner)
+{
+    Input list[PLACEMENT_INPUT_COUNT + 1];
+    int count;
+    if (planner != NULL) {
+        Plan plan;
+        if (!plannerFindMove(planner, state, &plan)) {
+            return 0;
+        }
+        count = planInputs(&plan, list);
+    }
+    else {
+        Placement placement;
+        if (!findBestPlacement(state, &placement)) {
+            return 0;
+        }
+        count = placementInputs(&placement, list);
+    }
+
+    Inputs inputs;
+    inputs.count = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        inputs.list[inputs.count++] = list[i];
+        if (inputs.count == MAX_INPUT_COUNT || i == count-1) {
+            applyInputs(state, &inputs);
+            inputs.count = 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Index into speedList of the speed updateSpeed() last picked. */
+int speedLevel(const GameState *state)
+{
+    int i;
+    for (i = SPEEDS_COUNT-1; i > 0; i--) {
+        if (state->speed == speedList[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+void printSummary(const Counters *total, double seconds)
+{
+    printf("%ld games of %dx%d on %d threads in %.3f s, %.0f games/s, "
+           "%.0f pieces/s\n", total->games, fieldWidth - 2, fieldHeight - 1,
+           threadCount, seconds,
+           seconds > 0 ? (double)total->games/seconds : 0.0,
+           seconds > 0 ? (double)total->pieces/seconds : 0.0);
+    printf("%ld lost, %ld cut off at %ld pieces\n", total->lost,
+           total->games - total->lost, pieceLimit);
+    if (lookahead) {
+        printf("board table: %llu probes, %.1f%% hits, %llu stores\n",
+               (unsigned long long)total->table.probes,
+               total->table.probes ?
+               100.0*(double)total->table.hits/(double)total->table.probes :
+               0.0, (unsigned long long)total->table.stores);
+    }
+
+    long *values = malloc(sizeof(long)*(size_t)gameCount);
+    if (values == NULL) {
+        return;
+    }
+
+    printf("\n%-8s %12s %12s %10s %10s %10s %10s %10s %10s\n", "", "mean",
+           "stddev", "min", "p10", "p50", "p90", "p99", "max");
+
+    long i;
+    for (i = 0; i < gameCount; i++) {
+        values[i] = results[i].score;
+    }
+    printDistribution("score", values);
+    for (i = 0; i < gameCount; i++) {
+        values[i] = results[i].lines;
+    }
+    printDistribution("lines", values);
+    for (i = 0; i < gameCount; i++) {
+        values[i] = results[i].pieces;
+    }
+    printDistribution("pieces", values);
+
+    free(values);
+
+    printf("\nlevel  %8s %8s %10s %8s\n", "ms/cell", "score >", "games",
+           "share");
+    int level;
+    for (level = 0; level < SPEEDS_COUNT; level++) {
+        printf("%5d  %8d %8d %10ld %7.2f%%\n", level,
+               (int)(GRAVITY_ONE/(uint32_t)speedList[level]),
+               scoreList[level], total->levels[level],
+               100.0*(double)total->levels[level]/(double)total->games);
+    }
+}
+
+/* Sorts values in place. */
+void printDistribution(const char *name, long *values)
+{
+    double sum = 0.0;
+    double squares = 0.0;
+    long i;
+    for (i = 0; i < gameCount; i++) {
+        sum += (double)values[i];
+        squares += (double)values[i]*(double)values[i];
+    }
+    double mean = sum/(double)gameCount;
+    double variance = squares/(double)gameCount - mean*mean;
+
+    qsort(values, (size_t)gameCount, sizeof(*values), compareLongs);
+
+    printf("%-8s %12.2f %12.2f %10ld %10ld %10ld %10ld %10ld %10ld\n", name,
+           mean, variance > 0 ? sqrt(variance) : 0.0, values[0],
+           values[gameCount/10], values[gameCount/2],
+           values[gameCount*9/10], values[gameCount*99/100],
+           values[gameCount-1]);
+}
+
+int compareLongs(const void *a, const void *b)
+{
+    long first = *(const long *)a;
+    long second = *(const long *)b;
+
+    return (first > second) - (first < second);
+}
+
+int writeCsv(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return 0;
+    }
+
+    fprintf(file, "seed,score,lines,pieces,level,lost\n");
+    long i;
+    for (i = 0; i < gameCount; i++) {
+        fprintf(file, "%u,%d,%d,%ld,%d,%d\n", results[i].seed,
+                results[i].score, results[i].lines, results[i].pieces,
+                results[i].level, results[i].lost);
+    }
+
+    int failed = ferror(file);
+    failed |= fclose(file) != 0;
+
+    return !failed;
+}
@@ -0,0 +1,884 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "engine.h"
+#include "profile.h"
+#include "bot.h"
+#include "search.h"
+#include "features.h"
+#include "zobrist.h"
+
+
+#define POOL_SIZE 64
+
+#define DEFAULT_SEED        1
+#define DEFAULT_ITERATIONS  1000000L
+#define DEFAULT_RUNS        5
+
+/* One-sided normal quantile for p = 0.001. */
+#define CHECK_Z_LIMIT       3.09
+
+
+typedef struct {
+    const char *name;
+    /* Runs the operation the given number of times and returns the time it
+     * took in nanoseconds; set-up work is kept out of the measurement. */
+    uint64_t (*run)(long iterations);
+    /* Operations this much slower than the rest run this many times
+     * fewer iterations. */
+    long divisor;
+} Benchmark;
+
+
+void parseArguments(int argc, char **argv);
+
+void buildPool(void);
+int randomInt(int bound);
+void randomFieldSize(int *width, int *height);
+void randomPosition(GameState *state);
+void fillStack(GameState *state, int top, int well);
+void lineClearBoard(GameState *state, int top);
+uint64_t restoreCost(const GameState *source, long iterations);
+
+uint64_t benchCanBeMovedDown(long iterations);
+uint64_t benchCanBeMovedLeft(long iterations);
+uint64_t benchCanBeMovedRight(long iterations);
+uint64_t benchRotateClockwise(long iterations);
+uint64_t benchUpdateShadowPosition(long iterations);
+uint64_t benchLinesEmpty(long iterations);
+uint64_t benchLinesHalf(long iterations);
+uint64_t benchLinesNearTop(long iterations);
+uint64_t benchRandomTetromino(long iterations);
+uint64_t benchDeployFigure(long iterations);
+uint64_t benchFindBestPlacement(long iterations);
+uint64_t benchPlannerFindMove(long iterations);
+uint64_t benchFeaturesScalar(long iterations);
+uint64_t benchFeatures(long iterations);
+
+uint64_t benchLines(int top, long iterations);
+uint64_t benchKernel(int scalar, long iterations);
+void poolBatch(BoardBatch *batch, int first);
+
+int checkRandomizer(long long draws);
+Tetromino referenceTetromino(int *chances, Random *random);
+double chiSquareZ(double chiSquare, int freedom);
+int checkFeatures(long boards);
+int checkZobrist(long steps);
+int checkTable(void);
+
+
+static const Benchmark benchmarks[] = {
+    {"canBeMovedDown", benchCanBeMovedDown, 1},
+    {"canBeMovedLeft", benchCanBeMovedLeft, 1},
+    {"canBeMovedRight", benchCanBeMovedRight, 1},
+    {"rotateClockwise", benchRotateClockwise, 1},
+    {"updateShadowPosition", benchUpdateShadowPosition, 1},
+    {"checkForFilledLines/empty", benchLinesEmpty, 1},
+    {"checkForFilledLines/half", benchLinesHalf, 1},
+    {"checkForFilledLines/nearTop", benchLinesNearTop, 1},
+    {"randomTetromino", benchRandomTetromino, 1},
+    {"deployFigure", benchDeployFigure, 1},
+    {"findBestPlacement", benchFindBestPlacement, 100},
+    {"plannerFindMove", benchPlannerFindMove, 10000},
+    {"boardFeatures/scalar", benchFeaturesScalar, 10},
+    {"boardFeatures", benchFeatures, 10},
+};
+
+#define BENCHMARK_COUNT ((int)(sizeof(benchmarks)/sizeof(benchmarks[0])))
+
+
+unsigned int seed = DEFAULT_SEED;
+long iterationCount = DEFAULT_ITERATIONS;
+int runCount = DEFAULT_RUNS;
+const char *filter = NULL;
+long long checkDraws = 0;
+long checkBoards = 0;
+long checkSteps = 0;
+int fieldWidth = DEFAULT_FIELD_WIDTH;
+int fieldHeight = DEFAULT_FIELD_HEIGHT;
+
+Random generator;
+
+GameState pool[POOL_SIZE];
+GameState work;
+
+volatile int sink;
+
+
+int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+    if (checkDraws > 0) {
+        return checkRandomizer(checkDraws);
+    }
+    if (checkBoards > 0) {
+        return checkFeatures(checkBoards);
+    }
+    if (checkSteps > 0) {
+        return checkZobrist(checkSteps);
+    }
+
+    printf("# seed=%u iterations=%ld runs=%d size=%dx%d features=%s\n",
+           seed, iterationCount, runCount, fieldWidth - 2, fieldHeight - 1,
+           featureKernelName(bestFeatureKernel()));
+    printf("benchmark\tns/op\tops/sec\n");
+
+    int i;
+    for (i = 0; i < BENCHMARK_COUNT; i++) {
+        if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL) {
+            continue;
+        }
+
+        /* Every benchmark starts from the same seed, so its inputs do not
+         * depend on which other benchmarks ran before it. */
+        seedRandom(&generator, seed);
+        buildPool();
+        long iterations = iterationCount/benchmarks[i].divisor;
+        if (iterations < 1) {
+            iterations = 1;
+        }
+        benchmarks[i].run(iterations/10 + 1);
+
+        uint64_t best = UINT64_MAX;
+        int r;
+        for (r = 0; r < runCount; r++) {
+            seedRandom(&generator, seed);
+            buildPool();
+            uint64_t nsec = benchmarks[i].run(iterations);
+            if (nsec < best) {
+                best = nsec;
+            }
+        }
+
+        double nsPerOp = (double)best/(double)iterations;
+        printf("%s\t%.2f\t%.0f\n", benchmarks[i].name, nsPerOp,
+               nsPerOp > 0 ? 1e9/nsPerOp : 0.0);
+    }
+
+    return 0;
+}
+
+void parseArguments(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"seed", required_argument, NULL, 's'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"runs", required_argument, NULL, 'r'},
+        {"filter", required_argument, NULL, 'f'},
+        {"check-randomizer", required_argument, NULL, 'c'},
+        {"check-features", required_argument, NULL, 'F'},
+        {"check-zobrist", required_argument, NULL, 'z'},
+        {"size", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 's':
+                seed = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iterationCount = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                runCount = atoi(optarg);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'c':
+                checkDraws = strtoll(optarg, NULL, 0);
+                break;
+            case 'F':
+                checkBoards = strtol(optarg, NULL, 0);
+                break;
+            case 'z':
+                checkSteps = strtol(optarg, NULL, 0);
+                break;
+            case 'S':
+                if (!parseFieldSize(optarg, &fieldWidth, &fieldHeight)) {
+                    iterationCount = 0;
+                }
+                break;
+            default:
+                iterationCount = 0;
+                break;
+        }
+    }
+
+    if (optind < argc || iterationCount <= 0 || runCount <= 0) {
+        fprintf(stderr, "usage: %s [--seed n] [--iterations n] [--runs n] "
+                        "[--filter name] [--size WxH]\n"
+                        "       %s [--seed n] --check-randomizer draws\n"
+                        "       %s [--seed n] --check-features boards\n"
+                        "       %s [--seed n] --check-zobrist steps\n",
+                argv[0], argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+}
+
+int randomInt(int bound)
+{
+    return (int)randomBelow(&generator, (uint32_t)bound);
+}
+
+/* Half the time one of the sizes with kernels of their own, otherwise
+ * any size at all. */
+void randomFieldSize(int *width, int *height)
+{
+    static const int sizes[][2] = {
+        {DEFAULT_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT},
+        {DEFAULT_FIELD_WIDTH, TALL_FIELD_HEIGHT},
+        {MAX_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT},
+    };
+    int count = (int)(sizeof(sizes)/sizeof(sizes[0]));
+
+    if (randomInt(2)) {
+        int i = randomInt(count);
+        *width = sizes[i][0];
+        *height = sizes[i][1];
+    }
+    else {
+        *width = MIN_FIELD_WIDTH +
+                 randomInt(MAX_FIELD_WIDTH - MIN_FIELD_WIDTH + 1);
+        *height = MIN_FIELD_HEIGHT +
+                  randomInt(MAX_FIELD_HEIGHT - MIN_FIELD_HEIGHT + 1);
+    }
+}
+
+/* Figures at random spots over random stacks, as they are met in play. */
+void buildPool(void)
+{
+    int i;
+    for (i = 0; i < POOL_SIZE; i++) {
+        newGame(&pool[i], nextRandom(&generator), fieldWidth, fieldHeight);
+        fillStack(&pool[i], 6 + randomInt(fieldHeight-7), -1);
+        updateShadowPosition(&pool[i]);
+        randomPosition(&pool[i]);
+    }
+}
+
+void randomPosition(GameState *state)
+{
+    int i;
+    int count = randomInt(ROTATION_COUNT);
+    for (i = 0; i < count; i++) {
+        rotateClockwise(state);
+    }
+
+    count = randomInt(state->width-2);
+    for (i = 0; i < count; i++) {
+        if (!(count & 1 ? moveLeft(state) : moveRight(state))) {
+            break;
+        }
+    }
+
+    count = randomInt(dropDistance(state, &state->figureMask) + 1);
+    for (i = 0; i < count; i++) {
+        moveDown(state);
+    }
+    updateShadowPosition(state);
+}
+
+/* Rows from top down to the floor, each with a random hole or two so none
+ * is full; the column well, if any, is left empty all the way down. */
+void fillStack(GameState *state, int top, int well)
+{
+    int y;
+    for (y = top; y < state->height-1; y++) {
+        int x;
+        for (x = 1; x < state->width-1; x++) {
+            if (x != well && randomInt(8)) {
+                setCellFilling(state, x, y,
+                               TetrominoI + randomInt(TETROMINO_COUNT));
+            }
+        }
+        if (well < 0 && state->rows[y] == FULL_ROW(state->width)) {
+            setCellFilling(state, 1 + randomInt(state->width-2), y, 0);
+        }
+    }
+}
+
+/* A vertical I hanging over a well that completes the four bottom rows,
+ * which is the most work a single line clear can do. */
+void lineClearBoard(GameState *state, int top)
+{
+    newGame(state, nextRandom(&generator), fieldWidth, fieldHeight);
+    state->figure = TetrominoI;
+    moveFigureToDefaultPosition(state);
+    rotateClockwise(state);
+    while (moveLeft(state));
+
+    int well = state->figureCellsPos[0].x;
+    int y;
+    int x;
+    int floor = state->height-1;
+    for (y = floor-4; top < floor && y < floor; y++) {
+        for (x = 1; x < state->width-1; x++) {
+            if (x != well) {
+                setCellFilling(state, x, y,
+                               TetrominoI + randomInt(TETROMINO_COUNT));
+            }
+        }
+    }
+    if (top < floor-4) {
+        fillStack(state, top, well);
+    }
+
+    while (moveDown(state));
+    updateShadowPosition(state);
+}
+
+/* Time spent copying the start state back in before every operation, which
+ * the benchmarks that modify the board take off their own figures. */
+uint64_t restoreCost(const GameState *source, long iterations)
+{
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        memcpy(&work, source, sizeof(work));
+        sink += work.score;
+    }
+
+    return profileClock() - start;
+}
+
+uint64_t benchCanBeMovedDown(long iterations)
+{
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += canBeMovedDown(&pool[i%POOL_SIZE]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+uint64_t benchCanBeMovedLeft(long iterations)
+{
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += canBeMovedLeft(&pool[i%POOL_SIZE]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+uint64_t benchCanBeMovedRight(long iterations)
+{
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += canBeMovedRight(&pool[i%POOL_SIZE]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+/* Figures keep turning where they are; those resting on the stack or
+ * against a wall only turn by way of a kick. */
+uint64_t benchRotateClockwise(long iterations)
+{
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        rotateClockwise(&pool[i%POOL_SIZE]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += pool[0].figureRotation;
+    return nsec;
+}
+
+uint64_t benchUpdateShadowPosition(long iterations)
+{
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        updateShadowPosition(&pool[i%POOL_SIZE]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += pool[0].shadowCellsPos[0].y;
+    return nsec;
+}
+
+uint64_t benchLinesEmpty(long iterations)
+{
+    return benchLines(fieldHeight-1, iterations);
+}
+
+uint64_t benchLinesHalf(long iterations)
+{
+    return benchLines(fieldHeight/2, iterations);
+}
+
+uint64_t benchLinesNearTop(long iterations)
+{
+    return benchLines(6, iterations);
+}
+
+/* The empty board has nothing to clear and only pays for the scan. */
+uint64_t benchLines(int top, long iterations)
+{
+    GameState source;
+    lineClearBoard(&source, top);
+    int i;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        setCellFilling(&source, source.figureCellsPos[i].x,
+                       source.figureCellsPos[i].y, source.figure);
+    }
+
+    uint64_t copy = restoreCost(&source, iterations);
+
+    uint64_t start = profileClock();
+    long n;
+    for (n = 0; n < iterations; n++) {
+        memcpy(&work, &source, sizeof(work));
+        checkForFilledLines(&work);
+        sink += work.score;
+    }
+    uint64_t nsec = profileClock() - start;
+
+    return nsec > copy ? nsec - copy : 0;
+}
+
+uint64_t benchRandomTetromino(long iterations)
+{
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += randomTetromino(&pool[0]);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+/* A figure landing on a half-full board and taking four rows with it,
+ * followed by spawning the next one. */
+uint64_t benchDeployFigure(long iterations)
+{
+    GameState source;
+    lineClearBoard(&source, fieldHeight/2);
+
+    uint64_t copy = restoreCost(&source, iterations);
+
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        memcpy(&work, &source, sizeof(work));
+        deployFigure(&work);
+        sink += work.score;
+    }
+    uint64_t nsec = profileClock() - start;
+
+    return nsec > copy ? nsec - copy : 0;
+}
+
+uint64_t benchFindBestPlacement(long iterations)
+{
+    Placement placement;
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += findBestPlacement(&pool[i%POOL_SIZE], &placement);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+/* A whole beam search on one thread, so the figure does not depend on the
+ * machine the bench runs on. */
+uint64_t benchPlannerFindMove(long iterations)
+{
+    Planner *planner = plannerCreate(1);
+    if (planner == NULL) {
+        return 0;
+    }
+
+    Plan plan;
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        result += plannerFindMove(planner, &pool[i%POOL_SIZE], &plan);
+    }
+    uint64_t nsec = profileClock() - start;
+
+    plannerDestroy(planner);
+    sink += result;
+    return nsec;
+}
+
+/* Eight pool boards per call, as the bot hands them over. */
+uint64_t benchFeaturesScalar(long iterations)
+{
+    return benchKernel(1, iterations);
+}
+
+uint64_t benchFeatures(long iterations)
+{
+    return benchKernel(0, iterations);
+}
+
+uint64_t benchKernel(int scalar, long iterations)
+{
+    BoardBatch batches[POOL_SIZE/FEATURE_LANES];
+    int b;
+    for (b = 0; b < POOL_SIZE/FEATURE_LANES; b++) {
+        poolBatch(&batches[b], b*FEATURE_LANES);
+    }
+
+    FeatureKernel kernel = scalar ? FeatureKernelScalar : bestFeatureKernel();
+    FeatureBatch features;
+    int result = 0;
+    uint64_t start = profileClock();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        boardFeaturesWith(kernel, &batches[i%(POOL_SIZE/FEATURE_LANES)],
+                          &features);
+        result += features.holes[i%FEATURE_LANES];
+    }
+    uint64_t nsec = profileClock() - start;
+
+    sink += result;
+    return nsec;
+}
+
+void poolBatch(BoardBatch *batch, int first)
+{
+    batch->width = fieldWidth;
+    batch->height = fieldHeight;
+    int y;
+    for (y = 0; y < fieldHeight; y++) {
+        int lane;
+        for (lane = 0; lane < FEATURE_LANES; lane++) {
+            batch->rows[y][lane] = pool[first + lane].rows[y];
+        }
+    }
+}
+
+/* Runs every kernel this CPU supports over random stacks on fields of
+ * random sizes, empty and full boards included, and compares each lane
+ * with referenceFeatures(). */
+int checkFeatures(long boards)
+{
+    seedRandom(&generator, seed);
+
+    long mismatches = 0;
+    long done;
+    for (done = 0; done < boards; done += FEATURE_LANES) {
+        GameState states[FEATURE_LANES];
+        BoardBatch batch;
+        FeatureBatch expected;
+
+        randomFieldSize(&batch.width, &batch.height);
+        int lane;
+        for (lane = 0; lane < FEATURE_LANES; lane++) {
+            newGame(&states[lane], nextRandom(&generator), batch.width,
+                    batch.height);
+            fillStack(&states[lane], randomInt(batch.height), -1);
+            int y;
+            for (y = 0; y < batch.height; y++) {
+                batch.rows[y][lane] = states[lane].rows[y];
+            }
+            referenceFeatures(states[lane].rows, batch.width, batch.height,
+                              &expected, lane);
+        }
+
+        int kernel;
+        for (kernel = 0; kernel < FEATURE_KERNEL_COUNT; kernel++) {
+            if (!featureKernelSupported((FeatureKernel)kernel)) {
+                continue;
+            }
+
+            FeatureBatch features;
+            boardFeaturesWith((FeatureKernel)kernel, &batch, &features);
+            if (memcmp(&features, &expected, sizeof(features)) == 0) {
+                continue;
+            }
+            if (!mismatches) {
+                for (lane = 0; lane < FEATURE_LANES; lane++) {
+                    fprintf(stderr, "%s %dx%d lane %d: height %d/%d "
+                            "holes %d/%d bumpiness %d/%d rows %d/%d "
+                            "columns %d/%d wells %d/%d\n",
+                            featureKernelName((FeatureKernel)kernel),
+                            batch.width - 2, batch.height - 1, lane,
+                            features.height[lane], expected.height[lane],
+                            features.holes[lane], expected.holes[lane],
+                            features.bumpiness[lane],
+                            expected.bumpiness[lane],
+                            features.rowTransitions[lane],
+                            expected.rowTransitions[lane],
+                            features.columnTransitions[lane],
+                            expected.columnTransitions[lane],
+                            features.wells[lane], expected.wells[lane]);
+                }
+            }
+            mismatches++;
+        }
+    }
+
+    int kernel;
+    for (kernel = 0; kernel < FEATURE_KERNEL_COUNT; kernel++) {
+        printf("%s\t%s\n", featureKernelName((FeatureKernel)kernel),
+               featureKernelSupported((FeatureKernel)kernel) ?
+               "checked" : "not supported");
+    }
+    printf("%ld boards, %ld mismatching batches: %s\n", done, mismatches,
+           mismatches ? "FAIL" : "PASS");
+
+    return mismatches ? 1 : 0;
+}
+
+/* Alternates the bot's placements, which clear lines, with random
+ * inputs on fields of random sizes, and checks after every one that the
+ * board key kept up by the engine matches one worked out from scratch. */
+int checkZobrist(long steps)
+{
+    static const Input moves[] = {
+        InputDrop, InputLeft, InputRight, InputRotateClockwise,
+        InputStorage, InputDown,
+    };
+
+    seedRandom(&generator, seed);
+    int width;
+    int height;
+    randomFieldSize(&width, &height);
+    newGame(&work, nextRandom(&generator), width, height);
+
+    long games = 1;
+    long clears = 0;
+    long i;
+    for (i = 0; i < steps; i++) {
+        Input list[PLACEMENT_INPUT_COUNT];
+        int count = 0;
+        Placement placement;
+        if (randomInt(2) && findBestPlacement(&work, &placement)) {
+            count = placementInputs(&placement, list);
+        }
+        else {
+            list[count++] = moves[randomInt(sizeof(moves)/sizeof(moves[0]))];
+        }
+
+        int lines = work.lines;
+        Inputs inputs;
+        inputs.count = 1;
+        int k;
+        for (k = 0; k < count; k++) {
+            inputs.list[0] = list[k];
+            applyInputs(&work, &inputs);
+        }
+        clears += work.lines != lines;
+
+        if (work.boardKey != zobristBoardKey(&work)) {
+            printf("step %ld: board key %016llx, expected %016llx: FAIL\n", i,
+                   (unsigned long long)work.boardKey,
+                   (unsigned long long)zobristBoardKey(&work));
+            return 1;
+        }
+        if (work.isGameOver) {
+            randomFieldSize(&width, &height);
+            newGame(&work, nextRandom(&generator), width, height);
+            games++;
+        }
+    }
+
+    printf("%ld steps, %ld games, %ld line clears: PASS\n", steps, games,
+           clears);
+
+    return checkTable();
+}
+
+/* The empty board has key 0, as after a perfect clear; an empty table
+ * must not take that for a hit, and a score stored for it must come back
+ * unchanged. */
+int checkTable(void)
+{
+    GameState empty;
+    newGame(&empty, seed, fieldWidth, fieldHeight);
+
+    TranspositionTable table;
+    if (!tableCreate(&table, 4)) {
+        printf("cannot create a table: FAIL\n");
+        return 1;
+    }
+
+    TableStats stats = {0, 0, 0};
+    double score = 0.0;
+    int hitEmpty = tableProbe(&table, empty.boardKey, &score, &stats);
+    tableStore(&table, empty.boardKey, -1.5, &stats);
+    int hitStored = tableProbe(&table, empty.boardKey, &score, &stats);
+    tableDestroy(&table);
+
+    if (hitEmpty || !hitStored || score != -1.5 || stats.hits != 1) {
+        printf("empty board key %016llx: %s: FAIL\n",
+               (unsigned long long)empty.boardKey,
+               hitEmpty ? "hit in an empty table" : "stored score lost");
+        return 1;
+    }
+    printf("empty board key %016llx in the table: PASS\n",
+           (unsigned long long)empty.boardKey);
+
+    return 0;
+}
+
+/* Deals draws pieces from randomTetromino() and as many from the loop it
+ * replaced, each from its own stream, and compares how often every piece
+ * and every pair of consecutive pieces came up with a two-sample
+ * chi-square test. */
+int checkRandomizer(long long draws)
+{
+    static long long counts[2][TETROMINO_COUNT];
+    static long long pairs[2][TETROMINO_COUNT][TETROMINO_COUNT];
+
+    GameState state;
+    newGame(&state, seed, DEFAULT_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT);
+    Random reference;
+    seedRandom(&reference, (uint64_t)seed + 1);
+    int chances[TETROMINO_COUNT] = {0};
+
+    int previous[2] = {-1, -1};
+    long long n;
+    for (n = 0; n < draws; n++) {
+        int piece[2];
+        piece[0] = randomTetromino(&state) - TetrominoI;
+        piece[1] = referenceTetromino(chances, &reference) - TetrominoI;
+
+        int s;
+        for (s = 0; s < 2; s++) {
+            counts[s][piece[s]]++;
+            if (previous[s] >= 0) {
+                pairs[s][previous[s]][piece[s]]++;
+            }
+            previous[s] = piece[s];
+        }
+    }
+
+    double pieceChi = 0.0;
+    int pieceCells = 0;
+    double pairChi = 0.0;
+    int pairCells = 0;
+    int i;
+    int j;
+    printf("# seed=%u draws=%lld\n", seed, draws);
+    printf("piece\tnew\treference\n");
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        double a = (double)counts[0][i];
+        double b = (double)counts[1][i];
+        printf("%c\t%.6f\t%.6f\n", "IOTJLSZ"[i], a/(double)draws,
+               b/(double)draws);
+        if (a + b > 0) {
+            pieceChi += (a - b)*(a - b)/(a + b);
+            pieceCells++;
+        }
+        for (j = 0; j < TETROMINO_COUNT; j++) {
+            a = (double)pairs[0][i][j];
+            b = (double)pairs[1][i][j];
+            if (a + b > 0) {
+                pairChi += (a - b)*(a - b)/(a + b);
+                pairCells++;
+            }
+        }
+    }
+
+    double pieceZ = chiSquareZ(pieceChi, pieceCells - 1);
+    double pairZ = chiSquareZ(pairChi, pairCells - 1);
+    int passed = pieceZ < CHECK_Z_LIMIT && pairZ < CHECK_Z_LIMIT;
+    printf("pieces\tchi2=%.2f\tdf=%d\tz=%.2f\n", pieceChi, pieceCells - 1,
+           pieceZ);
+    printf("pairs\tchi2=%.2f\tdf=%d\tz=%.2f\n", pairChi, pairCells - 1,
+           pairZ);
+    printf("%s\n", passed ? "PASS" : "FAIL");
+
+    return passed ? 0 : 1;
+}
+
+/* randomTetromino() as it was before it got a bounded running time. */
+Tetromino referenceTetromino(int *chances, Random *random)
+{
+    Tetromino tetramino = TetrominoNone;
+    int total = 0;
+    int i;
+
+    do {
+        total = 0;
+        for (i = 0; i < TETROMINO_COUNT; i++) {
+            total += chances[i];
+        }
+        if (total == 0) {
+            for (i = 0; i < TETROMINO_COUNT; i++) {
+                chances[i] = 15;
+            }
+        }
+    } while (total == 0);
+
+    int value = (int)randomBelow(random, (uint32_t)total);
+
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        chances[i] += 2;
+    }
+
+    int dChance = 0;
+    int *pChance = NULL;
+    int sum = 0;
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        sum += chances[i];
+        if (value < sum) {
+            tetramino = (Tetromino)(TetrominoI + i);
+            pChance = &chances[i];
+            break;
+        }
+    }
+
+    if (pChance != NULL) {
+        *pChance -= 14;
+        if (*pChance < 0)  {
+            dChance = -*pChance;
+            *pChance = 0;
+        }
+    }
+
+    while (dChance) {
+        i = (int)randomBelow(random, 7);
+
+        if (chances[i] > 0) {
+            chances[i]--;
+            dChance--;
+        }
+    }
+
+    return tetramino;
+}
+
+/* Wilson-Hilferty: the cube root of chi-square over its degrees of freedom
+ * is close to normal. */
+double chiSquareZ(double chiSquare, int freedom)
+{
+    if (freedom <= 0) {
+        return 0.0;
+    }
+
+    double k = (double)freedom;
+    return (cbrt(chiSquare/k) - (1.0 - 2.0/(9.0*k)))/sqrt(2.0/(9.0*k));
+}
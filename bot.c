@@ -0,0 +1,262 @@
+#include <string.h>
+
+#include "bot.h"
+
+
+/* Placements wait in batch until it is full, then are scored together. */
+typedef struct {
+    Placement *best;
+    int found;
+    BoardBatch batch;
+    Placement pending[FEATURE_LANES];
+    int count;
+} BestSearch;
+
+
+static void tryColumns(const GameState *state, const FigureMask *mask,
+                       int rotation, PlacementVisitor visit, void *context);
+static void keepBest(void *context, const GameState *state,
+                     const FigureMask *mask, int rotation, int shift);
+static void scorePending(BestSearch *search);
+static void offerPlacement(BestSearch *search, const Placement *placement);
+static void shiftMask(FigureMask *mask, int dx);
+
+
+int forEachPlacement(const GameState *state, PlacementVisitor visit,
+                     void *context)
+{
+    if (state->isGameOver || state->isPaused ||
+        state->figure <= TetrominoNone) {
+        return 0;
+    }
+
+    int turns = state->figure == TetrominoO ? 1 : ROTATION_COUNT;
+    int rotation;
+    for (rotation = 0; rotation < turns; rotation++) {
+        if (!rotation) {
+            tryColumns(state, &state->figureMask, 0, visit, context);
+            continue;
+        }
+
+        GameState probe = *state;
+        int i;
+        for (i = 0; i < rotation; i++) {
+            rotateClockwise(&probe);
+        }
+        if (probe.figureRotation !=
+            (state->figureRotation + rotation) % ROTATION_COUNT) {
+            continue;
+        }
+        tryColumns(&probe, &probe.figureMask, rotation, visit, context);
+    }
+
+    return 1;
+}
+
+int findBestPlacement(const GameState *state, Placement *placement)
+{
+    BestSearch search;
+    search.best = placement;
+    search.found = 0;
+    search.count = 0;
+
+    forEachPlacement(state, keepBest, &search);
+    scorePending(&search);
+
+    return search.found;
+}
+
+int placementInputs(const Placement *placement, Input *list)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < placement->rotation; i++) {
+        list[count++] = InputRotateClockwise;
+    }
+    for (i = 0; i < placement->shift; i++) {
+        list[count++] = InputRight;
+    }
+    for (i = 0; i > placement->shift; i--) {
+        list[count++] = InputLeft;
+    }
+    list[count++] = InputDrop;
+
+    return count;
+}
+
+/* Sweeps the figure left and right from where it is, as far as it fits. */
+static void tryColumns(const GameState *state, const FigureMask *mask,
+                       int rotation, PlacementVisitor visit, void *context)
+{
+    int direction;
+    for (direction = -1; direction <= 1; direction += 2) {
+        FigureMask moved = *mask;
+        int shift = 0;
+        if (direction > 0) {
+            if (!figureFits(state, &moved, 1, 0)) {
+                continue;
+            }
+            shiftMask(&moved, 1);
+            shift = 1;
+        }
+
+        while (1) {
+            visit(context, state, &moved, rotation, shift);
+
+            if (!figureFits(state, &moved, direction, 0)) {
+                break;
+            }
+            shiftMask(&moved, direction);
+            shift += direction;
+        }
+    }
+}
+
+static void keepBest(void *context, const GameState *state,
+                     const FigureMask *mask, int rotation, int shift)
+{
+    BestSearch *search = context;
+    Placement *placement = &search->pending[search->count];
+    placement->rotation = rotation;
+    placement->shift = shift;
+
+    placement->lines = dropIntoBatch(state, mask, &search->batch,
+                                     search->count);
+    if (placement->lines < 0) {
+        /* Scored right away; nothing else scores that low, so the order
+         * it is offered in does not matter. */
+        placement->lines = 0;
+        placement->score = SCORE_LOST;
+        offerPlacement(search, placement);
+        return;
+    }
+
+    if (++search->count == FEATURE_LANES) {
+        scorePending(search);
+    }
+}
+
+static void scorePending(BestSearch *search)
+{
+    if (!search->count) {
+        return;
+    }
+
+    FeatureBatch features;
+    padBatch(&search->batch, search->count);
+    boardFeatures(&search->batch, &features);
+
+    int lane;
+    for (lane = 0; lane < search->count; lane++) {
+        Placement *placement = &search->pending[lane];
+        placement->score = featureScore(&features, lane, placement->lines);
+        offerPlacement(search, placement);
+    }
+    search->count = 0;
+}
+
+static void offerPlacement(BestSearch *search, const Placement *placement)
+{
+    if (!search->found || placement->score > search->best->score) {
+        *search->best = *placement;
+        search->found = 1;
+    }
+}
+
+double evaluateDrop(const GameState *state, const FigureMask *mask,
+                    int *lines)
+{
+    BoardBatch batch;
+    *lines = dropIntoBatch(state, mask, &batch, 0);
+    if (*lines < 0) {
+        *lines = 0;
+        return SCORE_LOST;
+    }
+
+    FeatureBatch features;
+    boardFeaturesScalar(&batch, 1, &features);
+
+    return featureScore(&features, 0, *lines);
+}
+
+/* Works on a copy of the row masks only, clearing rows the way
+ * checkForFilledLines() does. */
+int dropIntoBatch(const GameState *state, const FigureMask *mask,
+                  BoardBatch *batch, int lane)
+{
+    int height = state->height;
+    Row full = FULL_ROW(state->width);
+    Row rows[MAX_FIELD_HEIGHT];
+    memcpy(rows, state->rows, (size_t)height*sizeof(*rows));
+
+    int top = mask->top + dropDistance(state, mask);
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        if (!mask->rows[r]) {
+            continue;
+        }
+        if (top + r < 0) {
+            return -1;
+        }
+        rows[top + r] |= mask->rows[r];
+    }
+
+    /* Only the rows the figure covers are tested and cleared, as in
+     * clearFilledRows(). */
+    int first = top < 1 ? 1 : top;
+    int last = top + FIGURE_CELL_COUNT - 1;
+    if (last > height-2) {
+        last = height-2;
+    }
+
+    int cleared = 0;
+    int y;
+    for (y = first; y <= last; y++) {
+        if (rows[y] == full) {
+            cleared++;
+        }
+    }
+
+    batch->width = state->width;
+    batch->height = height;
+    int dst = height-1;
+    for (y = height-1; y >= 0; y--) {
+        if (y < first || y > last || rows[y] != full) {
+            batch->rows[dst--][lane] = rows[y];
+        }
+    }
+    for (; dst >= 0; dst--) {
+        batch->rows[dst][lane] = WALL_ROW(state->width);
+    }
+
+    return cleared;
+}
+
+void padBatch(BoardBatch *batch, int count)
+{
+    int y;
+    for (y = 0; y < batch->height; y++) {
+        int lane;
+        for (lane = count; lane < FEATURE_LANES; lane++) {
+            batch->rows[y][lane] = batch->rows[y][count-1];
+        }
+    }
+}
+
+double featureScore(const FeatureBatch *features, int lane, int lines)
+{
+    return WEIGHT_HEIGHT*features->height[lane] + WEIGHT_LINES*lines +
+           WEIGHT_HOLES*features->holes[lane] +
+           WEIGHT_BUMPINESS*features->bumpiness[lane];
+}
+
+static void shiftMask(FigureMask *mask, int dx)
+{
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        mask->rows[r] = dx < 0 ? (Row)(mask->rows[r] >> -dx) :
+                                 (Row)(mask->rows[r] << dx);
+    }
+    mask->left += dx;
+}
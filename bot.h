@@ -0,0 +1,63 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "engine.h"
+#include "features.h"
+
+
+/* Turns, shifts and the final drop: the most inputs a placement takes on
+ * the widest field. */
+#define PLACEMENT_INPUT_COUNT (ROTATION_COUNT - 1 + MAX_FIELD_WIDTH - 2 + 1)
+
+/* Board weights after Yiyuan Lee's tuned four-feature player. */
+#define WEIGHT_HEIGHT       -0.510066
+#define WEIGHT_LINES         0.760666
+#define WEIGHT_HOLES        -0.35663
+#define WEIGHT_BUMPINESS    -0.184483
+
+/* Given to figures that would stick out over the top. */
+#define SCORE_LOST          -1e9
+
+
+typedef struct {
+    /* Clockwise turns from where the figure is now. */
+    int rotation;
+    /* Columns to move after turning, negative to the left. */
+    int shift;
+    int lines;
+    double score;
+} Placement;
+
+
+/* Called with the figure turned and shifted but not yet dropped. */
+typedef void (*PlacementVisitor)(void *context, const GameState *state,
+                                 const FigureMask *mask, int rotation,
+                                 int shift);
+
+
+/* Every turn and column the figure can reach by the game's own rules;
+ * turning happens on a copy of state so kicks apply as in play.
+ * Returns 0 when the figure cannot move at all. */
+int forEachPlacement(const GameState *state, PlacementVisitor visit,
+                     void *context);
+/* Scores the board left after dropping mask and clearing what it fills;
+ * lines gets the number of rows cleared. */
+double evaluateDrop(const GameState *state, const FigureMask *mask,
+                    int *lines);
+/* Writes that board into lane of batch instead, for boardFeatures() to
+ * score many at once. Returns the rows cleared, or -1 when the figure
+ * would stick out over the top. */
+int dropIntoBatch(const GameState *state, const FigureMask *mask,
+                  BoardBatch *batch, int lane);
+/* Copies the last filled lane over the ones after it. */
+void padBatch(BoardBatch *batch, int count);
+double featureScore(const FeatureBatch *features, int lane, int lines);
+
+/* Tries every turn and column the figure can reach by the game's own
+ * rules and keeps the drop that leaves the best board. Returns 0 when the
+ * figure cannot move at all. Nothing is allocated. */
+int findBestPlacement(const GameState *state, Placement *placement);
+/* The inputs that carry a placement out, ending with the drop. */
+int placementInputs(const Placement *placement, Input *list);
+
+#endif
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ncurses.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "engine.h"
+#include "protocol.h"
+
+
+#define COLOR_PAIR_I        1
+#define COLOR_PAIR_O        2
+#define COLOR_PAIR_T        3
+#define COLOR_PAIR_J        4
+#define COLOR_PAIR_L        5
+#define COLOR_PAIR_S        6
+#define COLOR_PAIR_Z        7
+#define COLOR_PAIR_SHADOW   8
+#define COLOR_PAIR_SPEED    9
+
+#define CBUTTON_DROP        KEY_UP
+#define CBUTTON_RIGHT       KEY_RIGHT
+#define CBUTTON_DOWN        KEY_DOWN
+#define CBUTTON_LEFT        KEY_LEFT
+#define CBUTTON_ROTCW       'x'
+#define CBUTTON_ROTCCW      'z'
+#define CBUTTON_NEWGAME     'g'
+#define CBUTTON_STORAGE     ' '
+#define CBUTTON_EXIT        KEY_F(10)
+#define CBUTTON_PAUSE       'p'
+
+#define RECEIVE_BUFFER_SIZE (MAX_MESSAGE_SIZE + VARINT_MAX_SIZE)
+
+
+void parseArguments(int argc, char **argv);
+void usage(const char *name);
+int connectSocket(const char *path);
+void init(void);
+void kbin(void);
+int keyInput(int key);
+void receive(void);
+int handleMessage(const unsigned char *message, int size);
+int handleHello(const unsigned char *body, int size);
+int handleUpdate(const unsigned char *body, int size);
+void drawCell(int index, int look);
+void drawStatus(void);
+void drawPreview(WINDOW *window, int figure);
+chtype blockLook(int colorPair);
+void closeClient(const char *message);
+
+
+WINDOW *wField;
+WINDOW *wScore;
+WINDOW *wSpeed;
+WINDOW *wNextFigure;
+WINDOW *wStoredFigure;
+WINDOW *wSeed;
+
+int hasColors;
+
+const char *socketPath = DEFAULT_SOCKET_PATH;
+int socketFd;
+
+/* What the server says each cell inside the walls shows. */
+unsigned char looks[(MAX_FIELD_WIDTH - 2)*(MAX_FIELD_HEIGHT - 1)];
+
+unsigned char received[RECEIVE_BUFFER_SIZE];
+int receivedSize;
+
+/* Zero until the hello comes. */
+int fieldWidth;
+int fieldHeight;
+
+int flags = -1;
+int speedBars;
+int nextFigure;
+int storedFigure;
+int score;
+int lines;
+unsigned int seed;
+
+
+int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+
+    socketFd = connectSocket(socketPath);
+    if (socketFd < 0) {
+        perror(socketPath);
+        return 1;
+    }
+
+    init();
+
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = socketFd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & (POLLHUP | POLLERR)) {
+            closeClient(NULL);
+        }
+        if (fds[0].revents & POLLIN) {
+            kbin();
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            receive();
+        }
+
+        doupdate();
+    }
+
+    return 0;
+}
+
+void parseArguments(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"socket", required_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 'S':
+                socketPath = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+    }
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--socket path]\n", name);
+    exit(1);
+}
+
+int connectSocket(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* The windows wait for the hello, which tells the field size. */
+void init(void)
+{
+    initscr();
+    nodelay(stdscr, TRUE);
+    cbreak();
+    curs_set(FALSE);
+    keypad(stdscr, TRUE);
+    noecho();
+    refresh();
+
+    hasColors = has_colors() == TRUE;
+
+    if (hasColors) {
+        start_color();
+        init_pair(COLOR_PAIR_I, COLOR_CYAN, COLOR_CYAN);
+        init_pair(COLOR_PAIR_O, COLOR_YELLOW, COLOR_YELLOW);
+        init_pair(COLOR_PAIR_T, COLOR_MAGENTA, COLOR_MAGENTA);
+        init_pair(COLOR_PAIR_J, COLOR_BLUE, COLOR_BLUE);
+        init_pair(COLOR_PAIR_L, COLOR_WHITE, COLOR_WHITE);
+        init_pair(COLOR_PAIR_S, COLOR_GREEN, COLOR_GREEN);
+        init_pair(COLOR_PAIR_Z, COLOR_RED, COLOR_RED);
+        init_pair(COLOR_PAIR_SHADOW, COLOR_BLACK, COLOR_BLACK);
+        init_pair(COLOR_PAIR_SPEED, COLOR_RED, COLOR_RED);
+    }
+}
+
+/* Every key goes to the server as the Input it stands for; the game
+ * itself only runs there. */
+void kbin(void)
+{
+    unsigned char inputs[MAX_INPUT_COUNT];
+    int count = 0;
+
+    int key;
+    while ((key = getch()) != ERR) {
+        if (key == CBUTTON_EXIT) {
+            closeClient(NULL);
+        }
+        int input = keyInput(key);
+        if (input != InputNone && count < MAX_INPUT_COUNT) {
+            inputs[count++] = (unsigned char)input;
+        }
+    }
+
+    if (count && send(socketFd, inputs, (size_t)count, MSG_NOSIGNAL) < 0) {
+        closeClient("lost the server");
+    }
+}
+
+int keyInput(int key)
+{
+    switch (key) {
+        case CBUTTON_DROP:
+            return InputDrop;
+        case CBUTTON_RIGHT:
+            return InputRight;
+        case CBUTTON_DOWN:
+            return InputDown;
+        case CBUTTON_LEFT:
+            return InputLeft;
+        case CBUTTON_ROTCW:
+            return InputRotateClockwise;
+        case CBUTTON_ROTCCW:
+            return InputRotateCounterclockwise;
+        case CBUTTON_NEWGAME:
+            return InputNewGame;
+        case CBUTTON_STORAGE:
+            return InputStorage;
+        case CBUTTON_PAUSE:
+            return InputPause;
+    }
+
+    return InputNone;
+}
+
+void receive(void)
+{
+    ssize_t size = read(socketFd, received + receivedSize,
+                        (size_t)(RECEIVE_BUFFER_SIZE - receivedSize));
+    if (size < 0 && errno == EINTR) {
+        return;
+    }
+    if (size <= 0) {
+        closeClient("the server closed the game");
+    }
+    receivedSize += (int)size;
+
+    int start = 0;
+    while (start < receivedSize) {
+        uint64_t length;
+        int lengthSize = getVarint(received + start, receivedSize - start,
+                                   &length);
+        if (!lengthSize && receivedSize - start >= VARINT_MAX_SIZE) {
+            closeClient("the server sent garbage");
+        }
+        if (!lengthSize) {
+            break;
+        }
+        if (length > MAX_MESSAGE_SIZE) {
+            closeClient("the server sent garbage");
+        }
+        if (receivedSize - start - lengthSize < (int)length) {
+            break;
+        }
+
+        if (!handleMessage(received + start + lengthSize, (int)length)) {
+            closeClient("the server sent garbage");
+        }
+        start += lengthSize + (int)length;
+    }
+
+    memmove(received, received + start, (size_t)(receivedSize - start));
+    receivedSize -= start;
+}
+
+/* Returns 0 for anything this client does not understand. */
+int handleMessage(const unsigned char *message, int size)
+{
+    if (size < 1) {
+        return 0;
+    }
+
+    switch (message[0]) {
+        case MessageHello:
+            return handleHello(message + 1, size - 1);
+        case MessageUpdate:
+            return fieldWidth && handleUpdate(message + 1, size - 1);
+    }
+
+    return 0;
+}
+
+/* Lays the windows out around the field as the terminal game does. */
+int handleHello(const unsigned char *body, int size)
+{
+    uint64_t values[3];
+    int i;
+    for (i = 0; i < 3; i++) {
+        int used = getVarint(body, size, &values[i]);
+        if (!used) {
+            return 0;
+        }
+        body += used;
+        size -= used;
+    }
+
+    if (values[0] != PROTOCOL_VERSION) {
+        closeClient("the server speaks another protocol version");
+    }
+    if (fieldWidth || values[1] > MAX_FIELD_WIDTH ||
+        values[2] > MAX_FIELD_HEIGHT ||
+        !fieldSizeValid((int)values[1], (int)values[2])) {
+        return 0;
+    }
+    fieldWidth = (int)values[1];
+    fieldHeight = (int)values[2];
+
+    int mainWidth = getmaxx(stdscr);
+    wField = newwin(fieldHeight, fieldWidth, 1, mainWidth/2 - fieldWidth/2);
+    if (wField == NULL) {
+        closeClient("the terminal is too small for the field");
+    }
+    box(wField, ACS_VLINE, ACS_HLINE);
+    wnoutrefresh(wField);
+
+    wScore = newwin(3, 8, 1, mainWidth/2 - 4 + fieldWidth);
+    wSpeed = newwin(3, 8, 1, mainWidth/2 - 4 - fieldWidth);
+    wNextFigure = newwin(6, 8, 4, mainWidth/2 - 4 + fieldWidth);
+    wStoredFigure = newwin(6, 8, 4, mainWidth/2 - 4 - fieldWidth);
+    wSeed = newwin(1, 16, fieldHeight + 1, mainWidth/2 - 8);
+
+    return 1;
+}
+
+int handleUpdate(const unsigned char *body, int size)
+{
+    uint64_t values[8];
+    int i;
+    for (i = 0; i < 8; i++) {
+        int used = getVarint(body, size, &values[i]);
+        if (!used) {
+            return 0;
+        }
+        body += used;
+        size -= used;
+    }
+
+    flags = (int)values[0];
+    speedBars = (int)values[1];
+    nextFigure = (int)values[2] - 1;
+    storedFigure = (int)values[3] - 1;
+    score = (int)values[4];
+    lines = (int)values[5];
+    seed = (unsigned int)values[6];
+
+    int cells = (fieldWidth - 2)*(fieldHeight - 1);
+    int index = -1;
+    uint64_t changed;
+    for (changed = values[7]; changed; changed--) {
+        uint64_t skip;
+        int used = getVarint(body, size, &skip);
+        if (!used || used >= size || skip >= (uint64_t)cells) {
+            return 0;
+        }
+        index += (int)skip + 1;
+        if (index >= cells) {
+            return 0;
+        }
+        looks[index] = body[used];
+        drawCell(index, looks[index]);
+        body += used + 1;
+        size -= used + 1;
+    }
+
+    drawStatus();
+
+    return 1;
+}
+
+void drawCell(int index, int look)
+{
+    int width = fieldWidth - 2;
+    chtype shown = '.';
+    if (look == CellShadow) {
+        shown = blockLook(COLOR_PAIR_SHADOW);
+    }
+    else if (look > CellEmpty && look <= TETROMINO_COUNT) {
+        shown = blockLook(look);
+    }
+
+    mvwaddch(wField, index/width, index%width + 1, shown);
+}
+
+/* Small enough to redraw whole on every update. The top row comes back
+ * from looks, so text from a game that has since gone leaves nothing. */
+void drawStatus(void)
+{
+    int i;
+    for (i = 0; i < fieldWidth-2; i++) {
+        drawCell(i, looks[i]);
+    }
+    if (flags & UpdateGameOver) {
+        mvwprintw(wField, 0, 2, "GAME OVER");
+    }
+    else if (flags & UpdatePaused) {
+        mvwprintw(wField, 0, 3, "PAUSED");
+    }
+    wnoutrefresh(wField);
+
+    werase(wScore);
+    box(wScore, ACS_VLINE, ACS_HLINE);
+    mvwprintw(wScore, 1, 1, "%6d", score);
+    mvwprintw(wScore, 0, 2, "SCORE");
+    wnoutrefresh(wScore);
+
+    werase(wSpeed);
+    box(wSpeed, ACS_VLINE, ACS_HLINE);
+    if (hasColors) {
+        wattron(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
+    }
+    for (i = 0; i < speedBars && i < SPEEDS_COUNT; i++) {
+        mvwaddch(wSpeed, 1, 1+i, ACS_BLOCK);
+    }
+    if (hasColors) {
+        wattroff(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
+    }
+    mvwprintw(wSpeed, 0, 2, "SPEED");
+    wnoutrefresh(wSpeed);
+
+    drawPreview(wNextFigure, nextFigure);
+    mvwprintw(wNextFigure, 0, 2, "NEXT");
+    wnoutrefresh(wNextFigure);
+
+    drawPreview(wStoredFigure, storedFigure);
+    mvwprintw(wStoredFigure, 0, 1, "STORED");
+    wnoutrefresh(wStoredFigure);
+
+    werase(wSeed);
+    mvwprintw(wSeed, 0, 0, "SEED %u", seed);
+    wnoutrefresh(wSeed);
+}
+
+void drawPreview(WINDOW *window, int figure)
+{
+    werase(window);
+    box(window, ACS_VLINE, ACS_HLINE);
+
+    if (figure >= TetrominoI && figure <= TetrominoZ) {
+        const Point *shape = figureShape((Tetromino)figure, 0);
+        Point pivot = figureSpawnPosition((Tetromino)figure,
+                                          DEFAULT_FIELD_WIDTH);
+        pivot.x -= 2;
+        pivot.y = 3;
+
+        /* Colour pairs are numbered as the figures are. */
+        if (hasColors) {
+            wattron(window, COLOR_PAIR(figure));
+        }
+        int i;
+        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+            mvwaddch(window, pivot.y + shape[i].y, pivot.x + shape[i].x,
+                     ACS_BLOCK);
+        }
+        if (hasColors) {
+            wattroff(window, COLOR_PAIR(figure));
+        }
+    }
+}
+
+chtype blockLook(int colorPair)
+{
+    if (hasColors) {
+        return ACS_BLOCK | COLOR_PAIR(colorPair);
+    }
+
+    return ACS_BLOCK;
+}
+
+void closeClient(const char *message)
+{
+    endwin();
+    close(socketFd);
+
+    if (message != NULL) {
+        fprintf(stderr, "%s\n", message);
+        exit(1);
+    }
+    exit(0);
+}
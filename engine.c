@@ -0,0 +1,1156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+#include "profile.h"
+#include "zobrist.h"
+
+
+#define CHANCE_START    15
+#define CHANCE_GAIN     2
+#define CHANCE_COST     14
+#define CHANCE_TOTAL    (CHANCE_START*TETROMINO_COUNT)
+
+
+const int speedList[SPEEDS_COUNT] = {
+    MS_PER_CELL(1250), MS_PER_CELL(1000), MS_PER_CELL(750),
+    MS_PER_CELL(500),  MS_PER_CELL(250),  MS_PER_CELL(50),
+};
+const int scoreList[SPEEDS_COUNT] = { 0, 10, 100, 250, 500, 1000};
+
+/* Cell offsets from the pivot cell for every orientation, index 0 being
+ * the spawn orientation and each next one a clockwise turn. */
+static const Point figureShapes[TETROMINO_COUNT+1][ROTATION_COUNT]
+                                 [FIGURE_CELL_COUNT] = {
+    [TetrominoNone] = {{{0, 0}}},
+    [TetrominoI] = {
+        {{ 0,  0}, {-1,  0}, { 1,  0}, { 2,  0}},
+        {{ 0,  0}, { 0, -1}, { 0,  1}, { 0,  2}},
+        {{ 0,  0}, { 1,  0}, {-1,  0}, {-2,  0}},
+        {{ 0,  0}, { 0,  1}, { 0, -1}, { 0, -2}},
+    },
+    [TetrominoO] = {
+        {{ 0,  0}, { 1,  0}, { 0, -1}, { 1, -1}},
+        {{ 0,  0}, { 1,  0}, { 0, -1}, { 1, -1}},
+        {{ 0,  0}, { 1,  0}, { 0, -1}, { 1, -1}},
+        {{ 0,  0}, { 1,  0}, { 0, -1}, { 1, -1}},
+    },
+    [TetrominoT] = {
+        {{ 0,  0}, {-1,  0}, { 1,  0}, { 0, -1}},
+        {{ 0,  0}, { 0, -1}, { 0,  1}, { 1,  0}},
+        {{ 0,  0}, { 1,  0}, {-1,  0}, { 0,  1}},
+        {{ 0,  0}, { 0,  1}, { 0, -1}, {-1,  0}},
+    },
+    [TetrominoJ] = {
+        {{ 0,  0}, {-1,  0}, { 1,  0}, {-1, -1}},
+        {{ 0,  0}, { 0, -1}, { 0,  1}, { 1, -1}},
+        {{ 0,  0}, { 1,  0}, {-1,  0}, { 1,  1}},
+        {{ 0,  0}, { 0,  1}, { 0, -1}, {-1,  1}},
+    },
+    [TetrominoL] = {
+        {{ 0,  0}, {-1,  0}, { 1,  0}, { 1, -1}},
+        {{ 0,  0}, { 0, -1}, { 0,  1}, { 1,  1}},
+        {{ 0,  0}, { 1,  0}, {-1,  0}, {-1,  1}},
+        {{ 0,  0}, { 0,  1}, { 0, -1}, {-1, -1}},
+    },
+    [TetrominoS] = {
+        {{ 0,  0}, {-1,  0}, { 0, -1}, { 1, -1}},
+        {{ 0,  0}, { 0, -1}, { 1,  0}, { 1,  1}},
+        {{ 0,  0}, { 1,  0}, { 0,  1}, {-1,  1}},
+        {{ 0,  0}, { 0,  1}, {-1,  0}, {-1, -1}},
+    },
+    [TetrominoZ] = {
+        {{ 0,  0}, { 1,  0}, { 0, -1}, {-1, -1}},
+        {{ 0,  0}, { 0,  1}, { 1,  0}, { 1, -1}},
+        {{ 0,  0}, {-1,  0}, { 0,  1}, { 1,  1}},
+        {{ 0,  0}, { 0, -1}, {-1,  0}, {-1,  1}},
+    },
+};
+
+/* The same orientations as row masks with the pivot at column
+ * FIGURE_MASK_ORIGIN of row 0; top and left are relative to the pivot. */
+static const FigureMask figureMasks[TETROMINO_COUNT+1][ROTATION_COUNT] = {
+    [TetrominoI] = {
+        {{0x1e, 0x00, 0x00, 0x00}, 0, -1, 4, {0, 0, 0, 0}},
+        {{0x04, 0x04, 0x04, 0x04}, -1, 0, 1, {3, -1, -1, -1}},
+        {{0x0f, 0x00, 0x00, 0x00}, 0, -2, 4, {0, 0, 0, 0}},
+        {{0x04, 0x04, 0x04, 0x04}, -2, 0, 1, {3, -1, -1, -1}},
+    },
+    [TetrominoO] = {
+        {{0x0c, 0x0c, 0x00, 0x00}, -1, 0, 2, {1, 1, -1, -1}},
+        {{0x0c, 0x0c, 0x00, 0x00}, -1, 0, 2, {1, 1, -1, -1}},
+        {{0x0c, 0x0c, 0x00, 0x00}, -1, 0, 2, {1, 1, -1, -1}},
+        {{0x0c, 0x0c, 0x00, 0x00}, -1, 0, 2, {1, 1, -1, -1}},
+    },
+    [TetrominoT] = {
+        {{0x04, 0x0e, 0x00, 0x00}, -1, -1, 3, {1, 1, 1, -1}},
+        {{0x04, 0x0c, 0x04, 0x00}, -1, 0, 2, {2, 1, -1, -1}},
+        {{0x0e, 0x04, 0x00, 0x00}, 0, -1, 3, {0, 1, 0, -1}},
+        {{0x04, 0x06, 0x04, 0x00}, -1, -1, 2, {1, 2, -1, -1}},
+    },
+    [TetrominoJ] = {
+        {{0x02, 0x0e, 0x00, 0x00}, -1, -1, 3, {1, 1, 1, -1}},
+        {{0x0c, 0x04, 0x04, 0x00}, -1, 0, 2, {2, 0, -1, -1}},
+        {{0x0e, 0x08, 0x00, 0x00}, 0, -1, 3, {0, 0, 1, -1}},
+        {{0x04, 0x04, 0x06, 0x00}, -1, -1, 2, {2, 2, -1, -1}},
+    },
+    [TetrominoL] = {
+        {{0x08, 0x0e, 0x00, 0x00}, -1, -1, 3, {1, 1, 1, -1}},
+        {{0x04, 0x04, 0x0c, 0x00}, -1, 0, 2, {2, 2, -1, -1}},
+        {{0x0e, 0x02, 0x00, 0x00}, 0, -1, 3, {1, 0, 0, -1}},
+        {{0x06, 0x04, 0x04, 0x00}, -1, -1, 2, {0, 2, -1, -1}},
+    },
+    [TetrominoS] = {
+        {{0x0c, 0x06, 0x00, 0x00}, -1, -1, 3, {1, 1, 0, -1}},
+        {{0x04, 0x0c, 0x08, 0x00}, -1, 0, 2, {1, 2, -1, -1}},
+        {{0x0c, 0x06, 0x00, 0x00}, 0, -1, 3, {1, 1, 0, -1}},
+        {{0x02, 0x06, 0x04, 0x00}, -1, -1, 2, {1, 2, -1, -1}},
+    },
+    [TetrominoZ] = {
+        {{0x06, 0x0c, 0x00, 0x00}, -1, -1, 3, {0, 1, 1, -1}},
+        {{0x08, 0x0c, 0x04, 0x00}, -1, 0, 2, {2, 1, -1, -1}},
+        {{0x06, 0x0c, 0x00, 0x00}, 0, -1, 3, {0, 1, 1, -1}},
+        {{0x04, 0x06, 0x02, 0x00}, -1, -1, 2, {2, 1, -1, -1}},
+    },
+};
+
+static const int inputProfileSections[] = {
+    [InputNone] = -1,
+    [InputDrop] = ProfileMove,
+    [InputRight] = ProfileMove,
+    [InputDown] = ProfileMove,
+    [InputLeft] = ProfileMove,
+    [InputRotateClockwise] = ProfileRotation,
+    [InputRotateCounterclockwise] = ProfileRotation,
+    [InputNewGame] = -1,
+    [InputStorage] = -1,
+    [InputPause] = -1,
+};
+
+/* Tried in order until the turned figure fits. */
+static const Point kickOffsets[KICK_COUNT] = {{0, 0}, {-1, 0}, {1, 0}, {0, -1}};
+
+
+static void placeFigure(GameState *state, int rotation, Point pos);
+static void moveFigure(GameState *state, int dx, int dy);
+static void rotateFigure(GameState *state, Rotation direction);
+static void clearRow(GameState *state, int y);
+static int clearFilledRows(GameState *state);
+static void updateSkyline(GameState *state, int from);
+
+
+void step(GameState *state, const Inputs *inputs)
+{
+    applyInputs(state, inputs);
+    tick(state);
+}
+
+void applyInputs(GameState *state, const Inputs *inputs)
+{
+    int i;
+    for (i = 0; inputs != NULL && i < inputs->count; i++) {
+        PROFILE_BEGIN(start);
+
+        switch (inputs->list[i]) {
+            case InputRotateCounterclockwise:
+                rotateCounterclockwise(state);
+                break;
+            case InputRotateClockwise:
+                rotateClockwise(state);
+                break;
+            case InputDrop:
+                dropDown(state);
+                break;
+            case InputLeft:
+                moveLeft(state);
+                break;
+            case InputDown:
+                moveDown(state);
+                break;
+            case InputRight:
+                moveRight(state);
+                break;
+            case InputPause:
+                pauseGame(state);
+                break;
+            case InputNewGame:
+                newGame(state, nextRandom(&state->random), state->width,
+                        state->height);
+                break;
+            case InputStorage:
+                storageFigure(state);
+                break;
+            case InputNone:
+                break;
+        }
+
+        if (inputProfileSections[inputs->list[i]] >= 0) {
+            PROFILE_END(inputProfileSections[inputs->list[i]], start);
+        }
+    }
+}
+
+void tick(GameState *state)
+{
+    if (!state->isGameOver && !state->isPaused) {
+        state->gravityProgress += (uint32_t)state->speed;
+        while (state->gravityProgress >= GRAVITY_ONE) {
+            state->gravityProgress -= GRAVITY_ONE;
+
+            PROFILE_BEGIN(start);
+            int moved = moveDown(state);
+            PROFILE_END(ProfileMove, start);
+
+            if (!moved) {
+                if (!state->lockDelay) {
+                    deployFigure(state);
+                }
+                break;
+            }
+        }
+    }
+
+    if (state->lockDelay > 0) {
+        state->lockDelay--;
+    }
+}
+
+int ticksUntilGravity(const GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return -1;
+    }
+
+    uint32_t missing = GRAVITY_ONE - state->gravityProgress;
+
+    return (int)((missing + (uint32_t)state->speed - 1)/(uint32_t)state->speed);
+}
+
+/* The ticks before the one gravity acts on only add to the progress and
+ * count the lock delay down, so they are taken all at once. */
+long long runTicks(GameState *state, long long ticks)
+{
+    long long done = 0;
+    while (done < ticks) {
+        int quiet = ticksUntilGravity(state) - 1;
+        if (quiet < 0) {
+            break;
+        }
+        if (quiet > ticks - done - 1) {
+            quiet = (int)(ticks - done - 1);
+        }
+
+        state->gravityProgress += (uint32_t)quiet*(uint32_t)state->speed;
+        state->lockDelay = state->lockDelay > quiet ?
+                           state->lockDelay - quiet : 0;
+        tick(state);
+        done += quiet + 1;
+    }
+
+    return done;
+}
+
+const Point *figureShape(Tetromino figure, int rotation)
+{
+    if (figure < TetrominoNone) {
+        figure = TetrominoNone;
+    }
+
+    return figureShapes[figure][rotation];
+}
+
+/* The middle of the field, the even-sized figures leaning left. */
+Point figureSpawnPosition(Tetromino figure, int width)
+{
+    Point pos = {width/2, 0};
+
+    if (figure == TetrominoI || figure == TetrominoO) {
+        pos.x--;
+    }
+
+    return pos;
+}
+
+int getFigureMask(Tetromino figure, int rotation, Point pos, int width,
+                  FigureMask *mask)
+{
+    const FigureMask *shape = &figureMasks[figure][rotation];
+    int shift = pos.x - FIGURE_MASK_ORIGIN;
+
+    if (pos.x + shape->left < 0 ||
+        pos.x + shape->left + shape->width > width) {
+        return 0;
+    }
+
+    *mask = *shape;
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        mask->rows[r] = shift < 0 ? (Row)(shape->rows[r] >> -shift) :
+                                    (Row)(shape->rows[r] << shift);
+    }
+    mask->top += pos.y;
+    mask->left += pos.x;
+
+    return 1;
+}
+
+int findRotationKick(const GameState *state, Rotation direction)
+{
+    int rotation = state->figureRotation + (direction == Clockwise ? 1 : 3);
+    rotation %= ROTATION_COUNT;
+
+    int i;
+    for (i = 0; i < KICK_COUNT; i++) {
+        Point pos = state->figurePos;
+        FigureMask mask;
+
+        pos.x += kickOffsets[i].x;
+        pos.y += kickOffsets[i].y;
+        if (getFigureMask(state->figure, rotation, pos, state->width,
+                          &mask) &&
+            figureFits(state, &mask, 0, 0)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void rotateClockwise(GameState *state)
+{
+    rotateFigure(state, Clockwise);
+}
+
+void rotateCounterclockwise(GameState *state)
+{
+    rotateFigure(state, Counterclockwise);
+}
+
+int moveUp(GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return 0;
+    }
+
+    if (canBeMovedUp(state)) {
+        moveFigure(state, 0, -1);
+
+        state->lockDelay = LOCK_DELAY_MS;
+        state->fieldRedrawNeeded = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+int moveRight(GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return 0;
+    }
+
+    if (canBeMovedRight(state)) {
+        moveFigure(state, 1, 0);
+
+        updateShadowPosition(state);
+
+        state->lockDelay = LOCK_DELAY_MS;
+        state->fieldRedrawNeeded = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+int moveDown(GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return 0;
+    }
+
+    if (canBeMovedDown(state)) {
+        moveFigure(state, 0, 1);
+
+        state->lockDelay = LOCK_DELAY_MS;
+        state->fieldRedrawNeeded = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+int moveLeft(GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return 0;
+    }
+
+    if (canBeMovedLeft(state)) {
+        moveFigure(state, -1, 0);
+
+        updateShadowPosition(state);
+
+        state->lockDelay = LOCK_DELAY_MS;
+        state->fieldRedrawNeeded = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+void dropDown(GameState *state)
+{
+    if (state->isGameOver || state->isPaused) {
+        return;
+    }
+
+    int distance = dropDistance(state, &state->figureMask);
+    if (distance > 0) {
+        moveFigure(state, 0, distance);
+
+        state->fieldRedrawNeeded = 1;
+    }
+
+    deployFigure(state);
+}
+
+int canBeMovedUp(const GameState *state)
+{
+    if (state->figureMask.top-1 < 0) {
+        return 0;
+    }
+    return figureFits(state, &state->figureMask, 0, -1);
+}
+
+int canBeMovedRight(const GameState *state)
+{
+    return figureFits(state, &state->figureMask, 1, 0);
+}
+
+int canBeMovedDown(const GameState *state)
+{
+    return figureFits(state, &state->figureMask, 0, 1);
+}
+
+int canBeMovedLeft(const GameState *state)
+{
+    return figureFits(state, &state->figureMask, -1, 0);
+}
+
+void deployFigure(GameState *state)
+{
+    PROFILE_BEGIN(start);
+
+    int i;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        setCellFilling(state, state->figureCellsPos[i].x,
+                       state->figureCellsPos[i].y, state->figure);
+    }
+    state->storageUsed = 0;
+    state->gravityProgress = 0;
+    checkForFilledLines(state);
+    newFigure(state);
+
+    PROFILE_END(ProfileDeploy, start);
+}
+
+void newFigure(GameState *state)
+{
+    if (state->nextFigure == TetrominoInit ||
+        state->nextFigure == TetrominoNone) {
+        state->nextFigure = randomTetromino(state);
+    }
+
+    state->figure = state->nextFigure;
+    state->nextFigure = randomTetromino(state);
+
+    moveFigureToDefaultPosition(state);
+    updateShadowPosition(state);
+    state->fieldRedrawNeeded = 1;
+
+    if (!canBeMovedDown(state)) {
+        state->isGameOver = 1;
+    }
+}
+
+/* Every piece gains CHANCE_GAIN per deal and the dealt one pays
+ * CHANCE_COST, so the chances always add up to CHANCE_TOTAL. The pick
+ * compares against the grown chances while the draw only spans the total,
+ * which is the weighting the game has always had. */
+Tetromino randomTetromino(GameState *state)
+{
+    int *chances = state->chances;
+    int value = (int)randomBelow(&state->random, CHANCE_TOTAL);
+    int i;
+
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        chances[i] += CHANCE_GAIN;
+    }
+
+    /* The prefix sums only grow, so the piece is the number of them that
+     * value has reached; counting them avoids an unpredictable branch. */
+    int picked = 0;
+    int sum = 0;
+    for (i = 0; i < TETROMINO_COUNT-1; i++) {
+        sum += chances[i];
+        picked += value >= sum;
+    }
+
+    chances[picked] -= CHANCE_COST;
+    int deficit = 0;
+    if (chances[picked] < 0) {
+        deficit = -chances[picked];
+        chances[picked] = 0;
+    }
+
+    /* What the piece could not pay comes off the others one point at a
+     * time, each from a piece picked evenly among those that have any. The
+     * pick counts through all seven pieces rather than stopping early, so
+     * it runs without data-dependent branches. */
+    if (deficit) {
+        uint32_t count = 0;
+        for (i = 0; i < TETROMINO_COUNT; i++) {
+            count += chances[i] > 0;
+        }
+
+        while (deficit--) {
+            int skip = (int)randomBelow(&state->random, count);
+            int seen = 0;
+            int index = 0;
+            for (i = 0; i < TETROMINO_COUNT; i++) {
+                seen += chances[i] > 0;
+                index += seen <= skip;
+            }
+
+            chances[index]--;
+            count -= !chances[index];
+        }
+    }
+
+    return (Tetromino)(TetrominoI + picked);
+}
+
+void checkForFilledLines(GameState *state)
+{
+    PROFILE_BEGIN(start);
+
+    int filledCount = clearFilledRows(state);
+    state->lines += filledCount;
+
+    switch (filledCount) {
+        case 1:
+            state->score += 1;
+            updateSpeed(state);
+            break;
+        case 2:
+            state->score += 3;
+            updateSpeed(state);
+            break;
+        case 3:
+            state->score += 7;
+            updateSpeed(state);
+            break;
+        case 4:
+            state->score += 15;
+            updateSpeed(state);
+            break;
+        default:
+            break;
+    }
+
+    state->fieldRedrawNeeded = 1;
+
+    PROFILE_END(ProfileLineClear, start);
+}
+
+int lockFigureMask(GameState *state, Tetromino figure, const FigureMask *mask)
+{
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        Row bits = mask->rows[r];
+        while (bits) {
+            int x = __builtin_ctz(bits);
+            setCellFilling(state, x, mask->top + r, figure);
+            bits &= (Row)(bits - 1);
+        }
+    }
+    state->figureMask = *mask;
+
+    return clearFilledRows(state);
+}
+
+void updateSpeed(GameState *state)
+{
+    int i;
+    for (i = 0; i < SPEEDS_COUNT; i++) {
+        if (state->score > scoreList[i]) {
+            state->speed = speedList[i];
+        }
+        else {
+            break;
+        }
+    }
+}
+
+int isCellFilled(const GameState *state, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= state->width || y >= state->height) {
+        return 0;
+    }
+
+    return state->colors[y][x];
+}
+
+void setCellFilling(GameState *state, int x, int y, int filling)
+{
+    if (x < 0 || y < 0 || x >= state->width || y >= state->height) {
+        return;
+    }
+
+    if (!(state->rows[y] >> x & 1) != !filling && x > 0 &&
+        x < state->width-1 && y < state->height-1) {
+        state->boardKey ^= zobristCell(x, y);
+    }
+
+    state->colors[y][x] = (signed char)filling;
+    if (filling) {
+        state->rows[y] |= (Row)(1u << x);
+    }
+    else {
+        state->rows[y] &= (Row)~(1u << x);
+    }
+
+    if (filling > 0) {
+        if (y < state->stackTop) {
+            state->stackTop = y;
+        }
+        if (y < state->columnTop[x]) {
+            state->columnTop[x] = y;
+        }
+    }
+    else if (!filling && y == state->columnTop[x]) {
+        while (y < state->height-1 && !(state->rows[y] & (1u << x))) {
+            y++;
+        }
+        state->columnTop[x] = y;
+    }
+}
+
+int figureFits(const GameState *state, const FigureMask *mask, int dx, int dy)
+{
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        uint32_t m = mask->rows[r];
+        if (!m) {
+            continue;
+        }
+
+        if (dx < 0) {
+            if (m & ((1u << -dx) - 1)) {
+                return 0;
+            }
+            m >>= -dx;
+        }
+        else {
+            m <<= dx;
+            if (m & ~(uint32_t)FULL_ROW(state->width)) {
+                return 0;
+            }
+        }
+
+        int y = mask->top + r + dy;
+        if (y < 0) {
+            continue;
+        }
+        if (y >= state->height || (state->rows[y] & m)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int dropDistance(const GameState *state, const FigureMask *mask)
+{
+    int distance = state->height;
+    int i;
+    for (i = 0; i < mask->width; i++) {
+        int bottom = mask->top + mask->bottom[i];
+        int surface = state->columnTop[mask->left + i];
+        if (bottom >= surface) {
+            /* Tucked under an overhang: the skyline says nothing here. */
+            distance = 0;
+            while (figureFits(state, mask, 0, distance+1)) {
+                distance++;
+            }
+            return distance;
+        }
+        if (surface - 1 - bottom < distance) {
+            distance = surface - 1 - bottom;
+        }
+    }
+
+    return distance;
+}
+
+/* Removes the full rows under figureMask and lets the rows above fall;
+ * returns how many there were. */
+static int clearFilledRows(GameState *state)
+{
+    int first = state->figureMask.top;
+    int last = state->figureMask.top + FIGURE_CELL_COUNT - 1;
+    if (first < 1) {
+        first = 1;
+    }
+    if (last > state->height-2) {
+        last = state->height-2;
+    }
+
+    Row full = FULL_ROW(state->width);
+    int filledCount = 0;
+    int bottom = -1;
+    int y;
+    for (y = last; y >= first; y--) {
+        if (state->rows[y] == full) {
+            if (bottom < 0) {
+                bottom = y;
+            }
+            filledCount++;
+        }
+    }
+
+    if (filledCount) {
+        /* Only the rows from the old stack top down to the lowest cleared
+         * one change, so only their keys are swapped. */
+        int top = state->stackTop;
+        for (y = top; y <= bottom; y++) {
+            state->boardKey ^= zobristRow(y, state->rows[y], state->width);
+        }
+
+        int dst = bottom;
+        for (y = bottom; y >= state->stackTop; y--) {
+            if (y >= first && state->rows[y] == full) {
+                continue;
+            }
+            if (dst != y) {
+                state->rows[dst] = state->rows[y];
+                memcpy(state->colors[dst], state->colors[y],
+                       sizeof(state->colors[y]));
+            }
+            dst--;
+        }
+        for (; dst >= state->stackTop; dst--) {
+            clearRow(state, dst);
+        }
+        for (y = top; y <= bottom; y++) {
+            state->boardKey ^= zobristRow(y, state->rows[y], state->width);
+        }
+        /* Everything above the old stack top was empty and moved down by
+         * the rows cleared. */
+        updateSkyline(state, top + filledCount);
+    }
+
+    return filledCount;
+}
+
+/* Rows above from have to be empty. */
+static void updateSkyline(GameState *state, int from)
+{
+    Row pending = FULL_ROW(state->width) & ~WALL_ROW(state->width);
+    int x;
+    int y;
+
+    for (x = 1; x < state->width-1; x++) {
+        state->columnTop[x] = state->height-1;
+    }
+
+    state->stackTop = state->height-1;
+    for (y = from; pending && y < state->height-1; y++) {
+        Row found = state->rows[y] & pending;
+        if (!found) {
+            continue;
+        }
+        if (y < state->stackTop) {
+            state->stackTop = y;
+        }
+        Row bits = found;
+        while (bits) {
+            state->columnTop[__builtin_ctz(bits)] = y;
+            bits &= (Row)(bits - 1);
+        }
+        pending &= (Row)~found;
+    }
+}
+
+static void clearRow(GameState *state, int y)
+{
+    state->rows[y] = WALL_ROW(state->width);
+    memset(state->colors[y], 0, sizeof(state->colors[y]));
+    state->colors[y][0] = -1;
+    state->colors[y][state->width-1] = -1;
+}
+
+static void placeFigure(GameState *state, int rotation, Point pos)
+{
+    const Point *shape = figureShapes[state->figure][rotation];
+    int i;
+
+    state->figureRotation = rotation;
+    state->figurePos = pos;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        state->figureCellsPos[i].x = pos.x + shape[i].x;
+        state->figureCellsPos[i].y = pos.y + shape[i].y;
+    }
+    getFigureMask(state->figure, rotation, pos, state->width,
+                  &state->figureMask);
+}
+
+static void moveFigure(GameState *state, int dx, int dy)
+{
+    int i;
+
+    state->figurePos.x += dx;
+    state->figurePos.y += dy;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        state->figureCellsPos[i].x += dx;
+        state->figureCellsPos[i].y += dy;
+    }
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        state->figureMask.rows[i] =
+            dx < 0 ? (Row)(state->figureMask.rows[i] >> -dx) :
+                     (Row)(state->figureMask.rows[i] << dx);
+    }
+    state->figureMask.left += dx;
+    state->figureMask.top += dy;
+}
+
+static void rotateFigure(GameState *state, Rotation direction)
+{
+    if (state->isGameOver || state->isPaused) {
+        return;
+    }
+
+    if (state->figure == TetrominoO) {
+        return;
+    }
+
+    int kick = findRotationKick(state, direction);
+    if (kick < 0) {
+        return;
+    }
+
+    int rotation = state->figureRotation + (direction == Clockwise ? 1 : 3);
+    Point pos = state->figurePos;
+    pos.x += kickOffsets[kick].x;
+    pos.y += kickOffsets[kick].y;
+    placeFigure(state, rotation % ROTATION_COUNT, pos);
+
+    updateShadowPosition(state);
+
+    state->lockDelay = LOCK_DELAY_MS;
+    state->fieldRedrawNeeded = 1;
+}
+
+void newGame(GameState *state, unsigned int seed, int width, int height)
+{
+    int x;
+    int y;
+
+    state->width = width;
+    state->height = height;
+    memset(state->rows, 0, sizeof(state->rows));
+    memset(state->colors, 0, sizeof(state->colors));
+    state->boardKey = 0;
+    state->stackTop = height-1;
+    for (x = 0; x < width; x++) {
+        state->columnTop[x] = height-1;
+    }
+
+    for (x = 0; x < width; x++) {
+        setCellFilling(state, x, height-1, -1);
+    }
+    for (y = 0; y < height; y++) {
+        setCellFilling(state, 0, y, -1);
+        setCellFilling(state, width-1, y, -1);
+    }
+    state->columnTop[0] = 0;
+    state->columnTop[width-1] = 0;
+
+    state->figure = TetrominoInit;
+    state->nextFigure = TetrominoInit;
+    state->storedFigure = TetrominoInit;
+
+    state->isGameOver = 0;
+    state->isPaused = 0;
+
+    state->speed = speedList[0];
+    state->score = 0;
+    state->lines = 0;
+
+    state->fieldRedrawNeeded = 1;
+
+    state->lockDelay = 0;
+
+    state->gravityProgress = 0;
+
+    state->seed = seed;
+    seedRandom(&state->random, seed);
+
+    for (x = 0; x < TETROMINO_COUNT; x++) {
+        state->chances[x] = CHANCE_START;
+    }
+
+    state->storageUsed = 0;
+
+    newFigure(state);
+}
+
+int fieldSizeValid(int width, int height)
+{
+    return width >= MIN_FIELD_WIDTH && width <= MAX_FIELD_WIDTH &&
+           height >= MIN_FIELD_HEIGHT && height <= MAX_FIELD_HEIGHT;
+}
+
+int parseFieldSize(const char *text, int *width, int *height)
+{
+    char *end;
+    long columns = strtol(text, &end, 10);
+    if (end == text || *end != 'x') {
+        return 0;
+    }
+    text = end + 1;
+    long rows = strtol(text, &end, 10);
+    if (end == text || *end || columns < 0 || columns > MAX_FIELD_WIDTH ||
+        rows < 0 || rows > MAX_FIELD_HEIGHT ||
+        !fieldSizeValid((int)columns + 2, (int)rows + 1)) {
+        return 0;
+    }
+
+    *width = (int)columns + 2;
+    *height = (int)rows + 1;
+    return 1;
+}
+
+/* Nothing that is worked out from the board or the figure is trusted: the
+ * walls, colours, skyline, board key, figure cells, mask and shadow are
+ * all made again, after the fields they come from are range checked. */
+int restoreGame(GameState *state)
+{
+    if (!fieldSizeValid(state->width, state->height) ||
+        state->figure < TetrominoI || state->figure > TetrominoZ ||
+        state->nextFigure < TetrominoI || state->nextFigure > TetrominoZ ||
+        state->storedFigure < TetrominoInit ||
+        state->storedFigure > TetrominoZ ||
+        state->figureRotation < 0 ||
+        state->figureRotation >= ROTATION_COUNT || state->speed <= 0 ||
+        state->figurePos.y < -FIGURE_CELL_COUNT ||
+        state->figurePos.y >= state->height-1) {
+        return 0;
+    }
+
+    /* randomTetromino() divides by how many pieces still have a chance. */
+    int total = 0;
+    int i;
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        if (state->chances[i] < 0) {
+            return 0;
+        }
+        total += state->chances[i];
+    }
+    if (total != CHANCE_TOTAL) {
+        return 0;
+    }
+
+    FigureMask mask;
+    if (!getFigureMask(state->figure, state->figureRotation,
+                       state->figurePos, state->width, &mask)) {
+        return 0;
+    }
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        if (mask.rows[i] && mask.top + i >= state->height-1) {
+            return 0;
+        }
+    }
+
+    Row inside = FULL_ROW(state->width) & ~WALL_ROW(state->width);
+    int x;
+    int y;
+    for (y = 0; y < state->height-1; y++) {
+        state->rows[y] = (state->rows[y] & inside) | WALL_ROW(state->width);
+        for (x = 1; x < state->width-1; x++) {
+            signed char *color = &state->colors[y][x];
+            if (!(state->rows[y] >> x & 1)) {
+                *color = 0;
+            }
+            else if (*color < TetrominoI || *color > TetrominoZ) {
+                *color = -1;
+            }
+        }
+        state->colors[y][0] = -1;
+        state->colors[y][state->width-1] = -1;
+    }
+    state->rows[state->height-1] = FULL_ROW(state->width);
+    for (x = 0; x < state->width; x++) {
+        state->colors[state->height-1][x] = -1;
+    }
+
+    updateSkyline(state, 0);
+    state->columnTop[0] = 0;
+    state->columnTop[state->width-1] = 0;
+    state->boardKey = zobristBoardKey(state);
+
+    placeFigure(state, state->figureRotation, state->figurePos);
+    updateShadowPosition(state);
+    state->fieldRedrawNeeded = 1;
+
+    return 1;
+}
+
+int packBoardSize(int width, int height)
+{
+    return (3*(width - 2)*(height - 1) + 7)/8;
+}
+
+/* Cell i takes bits 3*i to 3*i+2, low bits first, and may cross into the
+ * next byte. */
+void packGame(const GameState *state, PackedGame *game, unsigned char *board)
+{
+    game->random = state->random;
+    game->seed = state->seed;
+    game->gravityProgress = state->gravityProgress;
+    game->speed = state->speed;
+    game->score = state->score;
+    game->lines = state->lines;
+    game->lockDelay = state->lockDelay;
+
+    game->width = (unsigned char)state->width;
+    game->height = (unsigned char)state->height;
+    game->figure = (signed char)state->figure;
+    game->nextFigure = (signed char)state->nextFigure;
+    game->storedFigure = (signed char)state->storedFigure;
+    game->figureRotation = (unsigned char)state->figureRotation;
+    game->figureX = (signed char)state->figurePos.x;
+    game->figureY = (signed char)state->figurePos.y;
+    game->isGameOver = (unsigned char)state->isGameOver;
+    game->isPaused = (unsigned char)state->isPaused;
+    game->storageUsed = (unsigned char)state->storageUsed;
+    int i;
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        game->chances[i] = (unsigned char)state->chances[i];
+    }
+
+    memset(board, 0, (size_t)packBoardSize(state->width, state->height));
+    int bit = 0;
+    int x;
+    int y;
+    for (y = 0; y < state->height-1; y++) {
+        for (x = 1; x < state->width-1; x++, bit += 3) {
+            int color = state->colors[y][x] > 0 ? state->colors[y][x] : 0;
+            board[bit >> 3] |= (unsigned char)(color << (bit & 7));
+            if ((bit & 7) > 5) {
+                board[(bit >> 3) + 1] |= (unsigned char)(color >>
+                                                         (8 - (bit & 7)));
+            }
+        }
+    }
+}
+
+int unpackGame(const PackedGame *game, const unsigned char *board,
+               GameState *state)
+{
+    if (!fieldSizeValid(game->width, game->height)) {
+        return 0;
+    }
+
+    memset(state, 0, sizeof(*state));
+    state->random = game->random;
+    state->seed = game->seed;
+    state->gravityProgress = game->gravityProgress;
+    state->speed = game->speed;
+    state->score = game->score;
+    state->lines = game->lines;
+    state->lockDelay = game->lockDelay;
+
+    state->width = game->width;
+    state->height = game->height;
+    state->figure = (Tetromino)game->figure;
+    state->nextFigure = (Tetromino)game->nextFigure;
+    state->storedFigure = (Tetromino)game->storedFigure;
+    state->figureRotation = game->figureRotation;
+    state->figurePos.x = game->figureX;
+    state->figurePos.y = game->figureY;
+    state->isGameOver = game->isGameOver;
+    state->isPaused = game->isPaused;
+    state->storageUsed = game->storageUsed;
+    int i;
+    for (i = 0; i < TETROMINO_COUNT; i++) {
+        state->chances[i] = game->chances[i];
+    }
+
+    int bit = 0;
+    int x;
+    int y;
+    for (y = 0; y < state->height-1; y++) {
+        for (x = 1; x < state->width-1; x++, bit += 3) {
+            int color = board[bit >> 3] >> (bit & 7);
+            if ((bit & 7) > 5) {
+                color |= board[(bit >> 3) + 1] << (8 - (bit & 7));
+            }
+            color &= 7;
+            state->colors[y][x] = (signed char)color;
+            if (color) {
+                state->rows[y] |= (Row)(1u << x);
+            }
+        }
+    }
+
+    return restoreGame(state);
+}
+
+void storageFigure(GameState *state)
+{
+    if (!state->storageUsed) {
+        Tetromino tmp = state->figure;
+        state->figure = state->storedFigure;
+        state->storedFigure = tmp;
+
+        if (state->figure == TetrominoInit || state->figure == TetrominoNone) {
+            state->figure = randomTetromino(state);
+        }
+
+        moveFigureToDefaultPosition(state);
+        updateShadowPosition(state);
+        state->fieldRedrawNeeded = 1;
+
+        state->storageUsed = 1;
+        state->gravityProgress = 0;
+    }
+}
+
+int moveFigureToDefaultPosition(GameState *state)
+{
+    if (state->figure == TetrominoNone || state->figure == TetrominoInit) {
+        return 1;
+    }
+
+    placeFigure(state, 0, figureSpawnPosition(state->figure, state->width));
+
+    return figureFits(state, &state->figureMask, 0, 0);
+}
+
+void updateShadowPosition(GameState *state)
+{
+    int distance = dropDistance(state, &state->figureMask);
+
+    int i;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        state->shadowCellsPos[i] = state->figureCellsPos[i];
+        state->shadowCellsPos[i].y += distance;
+    }
+}
+
+void pauseGame(GameState *state)
+{
+    state->isPaused = !state->isPaused;
+    state->fieldRedrawNeeded = 1;
+}
@@ -0,0 +1,242 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+#include "random.h"
+
+
+/* Field sizes count the walls and the floor, so the classic 10 by 21
+ * well is 12 by 22. Storage is always for the largest field. */
+#define DEFAULT_FIELD_WIDTH 12
+#define DEFAULT_FIELD_HEIGHT 22
+#define MIN_FIELD_WIDTH 6
+#define MIN_FIELD_HEIGHT 6
+#define MAX_FIELD_WIDTH 22
+#define MAX_FIELD_HEIGHT 42
+
+#define FULL_ROW(width) ((Row)((1u << (width)) - 1))
+#define WALL_ROW(width) ((Row)(1u | 1u << ((width) - 1)))
+
+#define FIGURE_CELL_COUNT   4
+#define TETROMINO_COUNT     7
+#define ROTATION_COUNT      4
+#define KICK_COUNT          4
+#define FIGURE_MASK_ORIGIN  2
+
+#define SPEEDS_COUNT        6
+
+/* The simulation advances in fixed ticks of one millisecond. */
+#define TICKS_PER_SECOND    1000
+#define LOCK_DELAY_MS       750
+
+/* Gravity is kept in fractions of a cell per tick. */
+#define GRAVITY_ONE         (1u << 24)
+#define MS_PER_CELL(ms)     ((int)(GRAVITY_ONE / (ms)))
+
+#define MAX_INPUT_COUNT     10
+
+
+typedef struct {
+    int x;
+    int y;
+} Point;
+
+/* One bit per column, bit x set when cell x of the row is filled. */
+typedef uint32_t Row;
+
+typedef enum {
+    TetrominoInit = -1,
+    TetrominoNone = 0,
+    TetrominoI = 1,
+    TetrominoO = 2,
+    TetrominoT = 3,
+    TetrominoJ = 4,
+    TetrominoL = 5,
+    TetrominoS = 6,
+    TetrominoZ = 7,
+} Tetromino;
+
+typedef enum {
+    Clockwise,
+    Counterclockwise,
+} Rotation;
+
+typedef enum {
+    InputNone = 0,
+    InputDrop,
+    InputRight,
+    InputDown,
+    InputLeft,
+    InputRotateClockwise,
+    InputRotateCounterclockwise,
+    InputNewGame,
+    InputStorage,
+    InputPause,
+} Input;
+
+typedef struct {
+    Input list[MAX_INPUT_COUNT];
+    int count;
+} Inputs;
+
+/* Figure occupancy as row masks, rows[0] being board row top. bottom[i] is
+ * the lowest mask row used by column left+i. */
+typedef struct {
+    Row rows[FIGURE_CELL_COUNT];
+    int top;
+    int left;
+    int width;
+    signed char bottom[FIGURE_CELL_COUNT];
+} FigureMask;
+
+/* Everything a single game needs; no globals, so games are independent. */
+typedef struct {
+    int width;
+    int height;
+    Row rows[MAX_FIELD_HEIGHT];
+    int stackTop;
+    int columnTop[MAX_FIELD_WIDTH];
+    /* Zobrist key of the filled cells, see zobrist.h. */
+    uint64_t boardKey;
+
+    Tetromino figure;
+    Tetromino nextFigure;
+    Tetromino storedFigure;
+    int figureRotation;
+    Point figurePos;
+    Point figureCellsPos[FIGURE_CELL_COUNT];
+    FigureMask figureMask;
+    Point shadowCellsPos[FIGURE_CELL_COUNT];
+
+    int isGameOver;
+    int isPaused;
+
+    /* Cells per tick, in 1/GRAVITY_ONE units. */
+    int speed;
+    int score;
+    int lines;
+
+    int fieldRedrawNeeded;
+
+    Random random;
+    unsigned int seed;
+
+    /* Weights of the pieces, TetrominoI first. */
+    int chances[TETROMINO_COUNT];
+
+    int lockDelay;
+
+    int storageUsed;
+
+    uint32_t gravityProgress;
+
+    /* Only drawing and hashing read it, so it stays clear of the fields
+     * the moves use. */
+    signed char colors[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
+} GameState;
+
+/* A game with everything restoreGame() works out left out, for keeping
+ * many of them. Its board goes apart, packBoardSize() bytes holding the
+ * colour of each cell inside the walls in three bits. */
+typedef struct {
+    Random random;
+    unsigned int seed;
+    uint32_t gravityProgress;
+    int speed;
+    int score;
+    int lines;
+    int lockDelay;
+
+    unsigned char width;
+    unsigned char height;
+    signed char figure;
+    signed char nextFigure;
+    signed char storedFigure;
+    unsigned char figureRotation;
+    signed char figureX;
+    signed char figureY;
+    unsigned char isGameOver;
+    unsigned char isPaused;
+    unsigned char storageUsed;
+    unsigned char chances[TETROMINO_COUNT];
+} PackedGame;
+
+
+extern const int speedList[SPEEDS_COUNT];
+extern const int scoreList[SPEEDS_COUNT];
+
+
+/* The same seed always deals the same pieces. The size has to pass
+ * fieldSizeValid(); InputNewGame keeps the one the game has. */
+void newGame(GameState *state, unsigned int seed, int width, int height);
+int fieldSizeValid(int width, int height);
+/* Reads the inside of a field, such as 10x40, into a size with the walls
+ * and floor. Returns 0 when it is malformed or out of range. */
+int parseFieldSize(const char *text, int *width, int *height);
+/* Checks a game that comes from outside, such as a saved one, and makes
+ * everything derived from its board and figure again; returns 0 when it
+ * is out of range. */
+int restoreGame(GameState *state);
+int packBoardSize(int width, int height);
+/* Every filled cell inside the walls must have a figure's colour, as in
+ * any game the engine played from newGame(). */
+void packGame(const GameState *state, PackedGame *game, unsigned char *board);
+/* Returns 0 when restoreGame() refuses what comes out. */
+int unpackGame(const PackedGame *game, const unsigned char *board,
+               GameState *state);
+void step(GameState *state, const Inputs *inputs);
+void applyInputs(GameState *state, const Inputs *inputs);
+void tick(GameState *state);
+/* Ticks until gravity next acts, or -1 while nothing runs on its own. */
+int ticksUntilGravity(const GameState *state);
+/* tick() up to ticks times, stopping once nothing runs on its own;
+ * returns how many ran. */
+long long runTicks(GameState *state, long long ticks);
+
+const Point *figureShape(Tetromino figure, int rotation);
+Point figureSpawnPosition(Tetromino figure, int width);
+/* Returns 0 when the figure would stick out of a field this wide. */
+int getFigureMask(Tetromino figure, int rotation, Point pos, int width,
+                  FigureMask *mask);
+/* Index of the first kick offset the turned figure fits at, or -1. */
+int findRotationKick(const GameState *state, Rotation direction);
+void rotateClockwise(GameState *state);
+void rotateCounterclockwise(GameState *state);
+
+int moveUp(GameState *state);
+int moveRight(GameState *state);
+int moveDown(GameState *state);
+int moveLeft(GameState *state);
+void dropDown(GameState *state);
+int canBeMovedUp(const GameState *state);
+int canBeMovedRight(const GameState *state);
+int canBeMovedDown(const GameState *state);
+int canBeMovedLeft(const GameState *state);
+
+void deployFigure(GameState *state);
+void newFigure(GameState *state);
+Tetromino randomTetromino(GameState *state);
+
+/* Only the rows covered by figureMask are tested, so call it right after
+ * the figure has been written into the board. */
+void checkForFilledLines(GameState *state);
+/* Writes figure into the board at mask and clears the rows it fills, with
+ * no scoring, profiling or next figure; returns the rows cleared. Meant
+ * for planners working on copies of a game. */
+int lockFigureMask(GameState *state, Tetromino figure, const FigureMask *mask);
+void updateSpeed(GameState *state);
+
+int isCellFilled(const GameState *state, int x, int y);
+void setCellFilling(GameState *state, int x, int y, int filling);
+
+int figureFits(const GameState *state, const FigureMask *mask, int dx, int dy);
+int dropDistance(const GameState *state, const FigureMask *mask);
+
+void storageFigure(GameState *state);
+int moveFigureToDefaultPosition(GameState *state);
+void updateShadowPosition(GameState *state);
+
+void pauseGame(GameState *state);
+
+#endif
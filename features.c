@@ -0,0 +1,504 @@
+#include <stdlib.h>
+
+#include "features.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FEATURES_X86
+#include <immintrin.h>
+#endif
+
+
+#define INNER_MASK(width) ((uint32_t)(FULL_ROW(width) & ~WALL_ROW(width)))
+/* Columns x whose right neighbour x+1 is also inside. */
+#define PAIR_MASK(width)  (INNER_MASK(width) & ~(1u << ((width) - 2)))
+/* Cells x with a neighbour x+1, walls included. */
+#define EDGE_MASK(width)  ((1u << ((width) - 1)) - 1)
+
+/* Well depths are counted bit-sliced, one plane per bit of the depth, so
+ * every column of every lane counts at once. A well is at most height-1
+ * deep. */
+#define WELL_PLANES(height) (32 - __builtin_clz((unsigned)(height) - 1))
+#define MAX_WELL_PLANES 6
+
+#if MAX_FIELD_HEIGHT - 1 >= (1 << MAX_WELL_PLANES)
+#error "MAX_WELL_PLANES is too small for MAX_FIELD_HEIGHT"
+#endif
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+
+typedef void (*ScalarKernel)(const BoardBatch *batch, int count,
+                             FeatureBatch *features);
+typedef void (*VectorKernel)(const BoardBatch *batch, FeatureBatch *features);
+
+/* Every kernel built for one field size; a width of 0 takes any size. */
+typedef struct {
+    int width;
+    int height;
+    ScalarKernel scalar;
+#ifdef FEATURES_X86
+    VectorKernel sse4;
+    VectorKernel avx2;
+#endif
+} SizedKernels;
+
+
+static const SizedKernels *sizedKernels(const BoardBatch *batch);
+static inline int countBits(uint32_t v);
+static ALWAYS_INLINE void scalarLane(const BoardBatch *batch, int lane,
+                                     FeatureBatch *features, int width,
+                                     int height);
+#ifdef FEATURES_X86
+__attribute__((target("sse4.1")))
+static ALWAYS_INLINE void sse4Features(const BoardBatch *batch,
+                                       FeatureBatch *features, int width,
+                                       int height);
+__attribute__((target("avx2")))
+static ALWAYS_INLINE void avx2Features(const BoardBatch *batch,
+                                       FeatureBatch *features, int width,
+                                       int height);
+#endif
+
+
+/* Copies of the kernels with the size fixed, so the masks, the row count
+ * and the well planes are constants the compiler folds in. The classic
+ * field and the common tall and wide ones get their own; every other size
+ * runs the generic copy, which reads the size from the batch. */
+#define SCALAR_KERNEL(name, width, height) \
+    static void scalar##name(const BoardBatch *batch, int count, \
+                             FeatureBatch *features) \
+    { \
+        int lane; \
+        for (lane = 0; lane < count; lane++) { \
+            scalarLane(batch, lane, features, width, height); \
+        } \
+    }
+
+#ifdef FEATURES_X86
+#define SIZED_KERNELS(name, width, height) \
+    SCALAR_KERNEL(name, width, height) \
+    __attribute__((target("sse4.1"))) \
+    static void sse4##name(const BoardBatch *batch, FeatureBatch *features) \
+    { \
+        sse4Features(batch, features, width, height); \
+    } \
+    __attribute__((target("avx2"))) \
+    static void avx2##name(const BoardBatch *batch, FeatureBatch *features) \
+    { \
+        avx2Features(batch, features, width, height); \
+    }
+#define SIZED_ENTRY(name, width, height) \
+    {width, height, scalar##name, sse4##name, avx2##name}
+#else
+#define SIZED_KERNELS(name, width, height) SCALAR_KERNEL(name, width, height)
+#define SIZED_ENTRY(name, width, height) {width, height, scalar##name}
+#endif
+
+SIZED_KERNELS(Classic, DEFAULT_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT)
+SIZED_KERNELS(Tall, DEFAULT_FIELD_WIDTH, TALL_FIELD_HEIGHT)
+SIZED_KERNELS(Wide, MAX_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT)
+SIZED_KERNELS(Generic, batch->width, batch->height)
+
+static const SizedKernels kernelSizes[] = {
+    SIZED_ENTRY(Classic, DEFAULT_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT),
+    SIZED_ENTRY(Tall, DEFAULT_FIELD_WIDTH, TALL_FIELD_HEIGHT),
+    SIZED_ENTRY(Wide, MAX_FIELD_WIDTH, DEFAULT_FIELD_HEIGHT),
+    SIZED_ENTRY(Generic, 0, 0),
+};
+
+
+static int chosenKernel = -1;
+
+static const char *kernelNames[FEATURE_KERNEL_COUNT] = {
+    "scalar", "sse4", "avx2",
+};
+
+
+FeatureKernel bestFeatureKernel(void)
+{
+    int kernel = __atomic_load_n(&chosenKernel, __ATOMIC_RELAXED);
+    if (kernel < 0) {
+        kernel = FEATURE_KERNEL_COUNT - 1;
+        while (!featureKernelSupported((FeatureKernel)kernel)) {
+            kernel--;
+        }
+        __atomic_store_n(&chosenKernel, kernel, __ATOMIC_RELAXED);
+    }
+
+    return (FeatureKernel)kernel;
+}
+
+int featureKernelSupported(FeatureKernel kernel)
+{
+    switch (kernel) {
+        case FeatureKernelScalar:
+            return 1;
+#ifdef FEATURES_X86
+        case FeatureKernelSse4:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1");
+        case FeatureKernelAvx2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char *featureKernelName(FeatureKernel kernel)
+{
+    return kernel >= 0 && kernel < FEATURE_KERNEL_COUNT ?
+           kernelNames[kernel] : "unknown";
+}
+
+void boardFeatures(const BoardBatch *batch, FeatureBatch *features)
+{
+    boardFeaturesWith(bestFeatureKernel(), batch, features);
+}
+
+void boardFeaturesWith(FeatureKernel kernel, const BoardBatch *batch,
+                       FeatureBatch *features)
+{
+    const SizedKernels *kernels = sizedKernels(batch);
+
+    switch (kernel) {
+#ifdef FEATURES_X86
+        case FeatureKernelAvx2:
+            kernels->avx2(batch, features);
+            break;
+        case FeatureKernelSse4:
+            kernels->sse4(batch, features);
+            break;
+#endif
+        default:
+            kernels->scalar(batch, FEATURE_LANES, features);
+            break;
+    }
+}
+
+void boardFeaturesScalar(const BoardBatch *batch, int count,
+                         FeatureBatch *features)
+{
+    sizedKernels(batch)->scalar(batch, count, features);
+}
+
+#define FILLED(x, y) \
+    ((y) >= height-1 || (x) <= 0 || (x) >= width-1 || (rows[y] >> (x) & 1))
+
+void referenceFeatures(const Row *rows, int width, int height,
+                       FeatureBatch *features, int lane)
+{
+    int heights[MAX_FIELD_WIDTH] = {0};
+    int total = 0;
+    int holes = 0;
+    int bumpiness = 0;
+    int rowTransitions = 0;
+    int columnTransitions = 0;
+    int wells = 0;
+
+    int x;
+    int y;
+    for (x = 1; x < width-1; x++) {
+        for (y = 0; y < height-1 && !FILLED(x, y); y++) {
+        }
+        heights[x] = height-1 - y;
+        total += heights[x];
+
+        for (y++; y < height-1; y++) {
+            holes += !FILLED(x, y);
+        }
+
+        int run = 0;
+        for (y = 0; y < height-1; y++) {
+            columnTransitions += FILLED(x, y) != FILLED(x, y+1);
+            if (!FILLED(x, y) && FILLED(x-1, y) && FILLED(x+1, y)) {
+                run++;
+                wells += run;
+            }
+            else {
+                run = 0;
+            }
+        }
+    }
+
+    for (x = 1; x < width-2; x++) {
+        bumpiness += abs(heights[x] - heights[x+1]);
+    }
+
+    for (y = 0; y < height-1; y++) {
+        for (x = 0; x < width-1; x++) {
+            rowTransitions += FILLED(x, y) != FILLED(x+1, y);
+        }
+    }
+
+    features->height[lane] = total;
+    features->holes[lane] = holes;
+    features->bumpiness[lane] = bumpiness;
+    features->rowTransitions[lane] = rowTransitions;
+    features->columnTransitions[lane] = columnTransitions;
+    features->wells[lane] = wells;
+}
+
+#undef FILLED
+
+/* The generic entry comes last and takes any size. */
+static const SizedKernels *sizedKernels(const BoardBatch *batch)
+{
+    const SizedKernels *kernels = kernelSizes;
+    while (kernels->width &&
+           (kernels->width != batch->width ||
+            kernels->height != batch->height)) {
+        kernels++;
+    }
+
+    return kernels;
+}
+
+/* Without popcnt in the baseline ISA __builtin_popcount() is a libcall. */
+static inline int countBits(uint32_t v)
+{
+    v -= v >> 1 & 0x55555555u;
+    v = (v & 0x33333333u) + (v >> 2 & 0x33333333u);
+    v = (v + (v >> 4)) & 0x0f0f0f0fu;
+
+    return (int)(v*0x01010101u >> 24);
+}
+
+/* Row by row, every feature is the population count of some mask:
+ * covered holds the columns whose top is at or above the row, so it adds
+ * one per column to height and one per differing neighbour to bumpiness,
+ * and its cells that are empty in the row are holes. */
+static ALWAYS_INLINE void scalarLane(const BoardBatch *batch, int lane,
+                                     FeatureBatch *features, int width,
+                                     int height)
+{
+    const uint32_t innerMask = INNER_MASK(width);
+    const uint32_t pairMask = PAIR_MASK(width);
+    const uint32_t edgeMask = EDGE_MASK(width);
+    const int wellPlanes = WELL_PLANES(height);
+    uint32_t covered = 0;
+    uint32_t planes[MAX_WELL_PLANES] = {0};
+    int total = 0;
+    int holes = 0;
+    int bumpiness = 0;
+    int rowTransitions = 0;
+    int columnTransitions = 0;
+    int wells = 0;
+
+    int y;
+    for (y = 0; y < height-1; y++) {
+        uint32_t row = batch->rows[y][lane];
+        uint32_t below = batch->rows[y+1][lane];
+        uint32_t inner = row & innerMask;
+
+        holes += countBits(covered & ~inner);
+        covered |= inner;
+        total += countBits(covered);
+        bumpiness += countBits((covered ^ covered >> 1) & pairMask);
+        rowTransitions += countBits((row ^ row >> 1) & edgeMask);
+        columnTransitions += countBits((row ^ below) & innerMask);
+
+        uint32_t well = ~row & row << 1 & row >> 1 & innerMask;
+        uint32_t carry = well;
+        int p;
+        for (p = 0; p < wellPlanes; p++) {
+            uint32_t plane = planes[p];
+            planes[p] = (plane ^ carry) & well;
+            carry &= plane;
+            wells += countBits(planes[p]) << p;
+        }
+    }
+
+    features->height[lane] = total;
+    features->holes[lane] = holes;
+    features->bumpiness[lane] = bumpiness;
+    features->rowTransitions[lane] = rowTransitions;
+    features->columnTransitions[lane] = columnTransitions;
+    features->wells[lane] = wells;
+}
+
+#ifdef FEATURES_X86
+
+/* Per-lane bit counts: nibble lookups give the count of every byte, and
+ * two shifted adds fold the four bytes of a lane into its low byte. */
+__attribute__((target("sse4.1")))
+static inline __m128i popcount128(__m128i v)
+{
+    const __m128i lut = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                      1, 2, 2, 3, 2, 3, 3, 4);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    __m128i bytes = _mm_add_epi8(
+        _mm_shuffle_epi8(lut, _mm_and_si128(v, nibble)),
+        _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi32(v, 4), nibble)));
+
+    bytes = _mm_add_epi8(bytes, _mm_srli_epi32(bytes, 16));
+    bytes = _mm_add_epi8(bytes, _mm_srli_epi32(bytes, 8));
+
+    return _mm_and_si128(bytes, _mm_set1_epi32(0xff));
+}
+
+__attribute__((target("sse4.1")))
+static ALWAYS_INLINE void sse4Features(const BoardBatch *batch,
+                                       FeatureBatch *features, int width,
+                                       int height)
+{
+    const __m128i innerMask = _mm_set1_epi32((int)INNER_MASK(width));
+    const __m128i pairMask = _mm_set1_epi32((int)PAIR_MASK(width));
+    const __m128i edgeMask = _mm_set1_epi32((int)EDGE_MASK(width));
+    const int wellPlanes = WELL_PLANES(height);
+
+    int half;
+    for (half = 0; half < FEATURE_LANES; half += 4) {
+        __m128i covered = _mm_setzero_si128();
+        __m128i planes[MAX_WELL_PLANES];
+        __m128i total = _mm_setzero_si128();
+        __m128i holes = _mm_setzero_si128();
+        __m128i bumpiness = _mm_setzero_si128();
+        __m128i rowTransitions = _mm_setzero_si128();
+        __m128i columnTransitions = _mm_setzero_si128();
+        __m128i wells = _mm_setzero_si128();
+
+        int p;
+        for (p = 0; p < wellPlanes; p++) {
+            planes[p] = _mm_setzero_si128();
+        }
+
+        __m128i row = _mm_loadu_si128((const __m128i *)&batch->rows[0][half]);
+        int y;
+        for (y = 0; y < height-1; y++) {
+            __m128i below =
+                _mm_loadu_si128((const __m128i *)&batch->rows[y+1][half]);
+            __m128i inner = _mm_and_si128(row, innerMask);
+
+            holes = _mm_add_epi32(holes,
+                popcount128(_mm_andnot_si128(inner, covered)));
+            covered = _mm_or_si128(covered, inner);
+            total = _mm_add_epi32(total, popcount128(covered));
+            bumpiness = _mm_add_epi32(bumpiness, popcount128(_mm_and_si128(
+                _mm_xor_si128(covered, _mm_srli_epi32(covered, 1)),
+                pairMask)));
+            rowTransitions = _mm_add_epi32(rowTransitions,
+                popcount128(_mm_and_si128(
+                    _mm_xor_si128(row, _mm_srli_epi32(row, 1)), edgeMask)));
+            columnTransitions = _mm_add_epi32(columnTransitions,
+                popcount128(_mm_and_si128(_mm_xor_si128(row, below),
+                                          innerMask)));
+
+            __m128i well = _mm_andnot_si128(row, _mm_and_si128(
+                _mm_and_si128(_mm_slli_epi32(row, 1), _mm_srli_epi32(row, 1)),
+                innerMask));
+            __m128i carry = well;
+            for (p = 0; p < wellPlanes; p++) {
+                __m128i plane = planes[p];
+                planes[p] = _mm_and_si128(_mm_xor_si128(plane, carry), well);
+                carry = _mm_and_si128(carry, plane);
+                wells = _mm_add_epi32(wells,
+                    _mm_slli_epi32(popcount128(planes[p]), p));
+            }
+
+            row = below;
+        }
+
+        _mm_storeu_si128((__m128i *)&features->height[half], total);
+        _mm_storeu_si128((__m128i *)&features->holes[half], holes);
+        _mm_storeu_si128((__m128i *)&features->bumpiness[half], bumpiness);
+        _mm_storeu_si128((__m128i *)&features->rowTransitions[half],
+                         rowTransitions);
+        _mm_storeu_si128((__m128i *)&features->columnTransitions[half],
+                         columnTransitions);
+        _mm_storeu_si128((__m128i *)&features->wells[half], wells);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    __m256i bytes = _mm256_add_epi8(
+        _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble)),
+        _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi32(v, 4),
+                                                  nibble)));
+
+    bytes = _mm256_add_epi8(bytes, _mm256_srli_epi32(bytes, 16));
+    bytes = _mm256_add_epi8(bytes, _mm256_srli_epi32(bytes, 8));
+
+    return _mm256_and_si256(bytes, _mm256_set1_epi32(0xff));
+}
+
+__attribute__((target("avx2")))
+static ALWAYS_INLINE void avx2Features(const BoardBatch *batch,
+                                       FeatureBatch *features, int width,
+                                       int height)
+{
+    const __m256i innerMask = _mm256_set1_epi32((int)INNER_MASK(width));
+    const __m256i pairMask = _mm256_set1_epi32((int)PAIR_MASK(width));
+    const __m256i edgeMask = _mm256_set1_epi32((int)EDGE_MASK(width));
+    const int wellPlanes = WELL_PLANES(height);
+
+    __m256i covered = _mm256_setzero_si256();
+    __m256i planes[MAX_WELL_PLANES];
+    __m256i total = _mm256_setzero_si256();
+    __m256i holes = _mm256_setzero_si256();
+    __m256i bumpiness = _mm256_setzero_si256();
+    __m256i rowTransitions = _mm256_setzero_si256();
+    __m256i columnTransitions = _mm256_setzero_si256();
+    __m256i wells = _mm256_setzero_si256();
+
+    int p;
+    for (p = 0; p < wellPlanes; p++) {
+        planes[p] = _mm256_setzero_si256();
+    }
+
+    __m256i row = _mm256_loadu_si256((const __m256i *)batch->rows[0]);
+    int y;
+    for (y = 0; y < height-1; y++) {
+        __m256i below = _mm256_loadu_si256((const __m256i *)batch->rows[y+1]);
+        __m256i inner = _mm256_and_si256(row, innerMask);
+
+        holes = _mm256_add_epi32(holes,
+            popcount256(_mm256_andnot_si256(inner, covered)));
+        covered = _mm256_or_si256(covered, inner);
+        total = _mm256_add_epi32(total, popcount256(covered));
+        bumpiness = _mm256_add_epi32(bumpiness, popcount256(_mm256_and_si256(
+            _mm256_xor_si256(covered, _mm256_srli_epi32(covered, 1)),
+            pairMask)));
+        rowTransitions = _mm256_add_epi32(rowTransitions,
+            popcount256(_mm256_and_si256(
+                _mm256_xor_si256(row, _mm256_srli_epi32(row, 1)), edgeMask)));
+        columnTransitions = _mm256_add_epi32(columnTransitions,
+            popcount256(_mm256_and_si256(_mm256_xor_si256(row, below),
+                                         innerMask)));
+
+        __m256i well = _mm256_andnot_si256(row, _mm256_and_si256(
+            _mm256_and_si256(_mm256_slli_epi32(row, 1),
+                             _mm256_srli_epi32(row, 1)),
+            innerMask));
+        __m256i carry = well;
+        for (p = 0; p < wellPlanes; p++) {
+            __m256i plane = planes[p];
+            planes[p] = _mm256_and_si256(_mm256_xor_si256(plane, carry), well);
+            carry = _mm256_and_si256(carry, plane);
+            wells = _mm256_add_epi32(wells,
+                _mm256_slli_epi32(popcount256(planes[p]), p));
+        }
+
+        row = below;
+    }
+
+    _mm256_storeu_si256((__m256i *)features->height, total);
+    _mm256_storeu_si256((__m256i *)features->holes, holes);
+    _mm256_storeu_si256((__m256i *)features->bumpiness, bumpiness);
+    _mm256_storeu_si256((__m256i *)features->rowTransitions, rowTransitions);
+    _mm256_storeu_si256((__m256i *)features->columnTransitions,
+                        columnTransitions);
+    _mm256_storeu_si256((__m256i *)features->wells, wells);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef FEATURES_H
+#define FEATURES_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/* Boards evaluated per call, one per 32-bit lane of an AVX2 register. */
+#define FEATURE_LANES 8
+
+/* Besides the default field, 10 by 40 and the widest field at the
+ * default height have kernels built for their size. */
+#define TALL_FIELD_HEIGHT 41
+
+
+typedef enum {
+    FeatureKernelScalar,
+    FeatureKernelSse4,
+    FeatureKernelAvx2,
+} FeatureKernel;
+
+#define FEATURE_KERNEL_COUNT 3
+
+/* Board rows transposed so lane i of every row is board i. Rows keep their
+ * walls and the floor, as in GameState, and all lanes share one size. */
+typedef struct {
+    int width;
+    int height;
+    uint32_t rows[MAX_FIELD_HEIGHT][FEATURE_LANES];
+} BoardBatch;
+
+/* Features of the width-2 by height-1 interior, per lane:
+ * height is the sum of the column heights, holes counts empty cells under
+ * a column top, transitions count filled/empty changes between
+ * neighbours with walls and floor counted as filled, and wells sums
+ * 1 + 2 + .. + depth over every run of cells with both sides filled. */
+typedef struct {
+    int32_t height[FEATURE_LANES];
+    int32_t holes[FEATURE_LANES];
+    int32_t bumpiness[FEATURE_LANES];
+    int32_t rowTransitions[FEATURE_LANES];
+    int32_t columnTransitions[FEATURE_LANES];
+    int32_t wells[FEATURE_LANES];
+} FeatureBatch;
+
+
+/* The fastest kernel this CPU runs, picked on the first call. */
+FeatureKernel bestFeatureKernel(void);
+int featureKernelSupported(FeatureKernel kernel);
+const char *featureKernelName(FeatureKernel kernel);
+
+/* Every lane is read, so lanes past the boards of interest must still
+ * hold some board. */
+void boardFeatures(const BoardBatch *batch, FeatureBatch *features);
+void boardFeaturesWith(FeatureKernel kernel, const BoardBatch *batch,
+                       FeatureBatch *features);
+/* Only lanes below count, for one-off boards. */
+void boardFeaturesScalar(const BoardBatch *batch, int count,
+                         FeatureBatch *features);
+
+/* Cell by cell from the definitions; what the kernels are checked
+ * against. */
+void referenceFeatures(const Row *rows, int width, int height,
+                       FeatureBatch *features, int lane);
+
+#endif
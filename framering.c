@@ -0,0 +1,44 @@
+#include <stddef.h>
+
+#include "framering.h"
+
+
+void frameRingInit(FrameRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+Frame *frameRingReserve(FrameRing *ring)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail == FRAME_RING_SIZE) {
+        return NULL;
+    }
+
+    return &ring->frames[ring->head % FRAME_RING_SIZE];
+}
+
+void frameRingPublish(FrameRing *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Stale frames are skipped by moving the tail up to the newest, which
+ * hands their slots back before the newest one is even read. */
+const Frame *frameRingLatest(FrameRing *ring)
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == ring->tail) {
+        return NULL;
+    }
+
+    __atomic_store_n(&ring->tail, head - 1, __ATOMIC_RELEASE);
+
+    return &ring->frames[(head - 1) % FRAME_RING_SIZE];
+}
+
+void frameRingRelease(FrameRing *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
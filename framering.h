@@ -0,0 +1,39 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include "engine.h"
+#include "profile.h"
+
+
+/* A power of two, so the free running indices wrap cleanly. */
+#define FRAME_RING_SIZE 4
+
+
+/* Everything a screen update reads, copied out of the game so the two
+ * threads share nothing else. */
+typedef struct {
+    GameState state;
+    /* The stats are filled in, which they only are now and then. */
+    int profiled;
+    ProfileStats profile[PROFILE_SECTION_COUNT];
+} Frame;
+
+/* One producer and one consumer, no locks. Each index is written by one
+ * side only and sits on a cache line of its own. */
+typedef struct {
+    Frame frames[FRAME_RING_SIZE];
+    unsigned int head __attribute__((aligned(64)));
+    unsigned int tail __attribute__((aligned(64)));
+} FrameRing;
+
+
+void frameRingInit(FrameRing *ring);
+/* The producer's next slot, or NULL while the consumer holds them all. */
+Frame *frameRingReserve(FrameRing *ring);
+void frameRingPublish(FrameRing *ring);
+/* The consumer's newest frame, the ones before it given back unread, or
+ * NULL when nothing new came. It stays put until frameRingRelease(). */
+const Frame *frameRingLatest(FrameRing *ring);
+void frameRingRelease(FrameRing *ring);
+
+#endif
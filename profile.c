@@ -0,0 +1,180 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "profile.h"
+
+
+/* Log-linear buckets as in HdrHistogram: values below SUB_BUCKET_COUNT are
+ * exact, above that every power of two is split into SUB_BUCKET_COUNT
+ * buckets, which keeps the error under 1/SUB_BUCKET_COUNT. */
+#define SUB_BUCKET_BITS     5
+#define SUB_BUCKET_COUNT    (1 << SUB_BUCKET_BITS)
+#define MAGNITUDE_COUNT     (64 - SUB_BUCKET_BITS + 1)
+#define BUCKET_COUNT        (MAGNITUDE_COUNT * SUB_BUCKET_COUNT)
+
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t buckets[BUCKET_COUNT];
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+
+static int bucketIndex(uint64_t value);
+static uint64_t bucketValue(int index);
+static uint64_t valueAtPercentile(const Histogram *histogram,
+                                  double percentile);
+
+
+int profilingEnabled = 0;
+
+static Histogram histograms[PROFILE_SECTION_COUNT] = {
+    [0 ... PROFILE_SECTION_COUNT-1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static const char *sectionNames[PROFILE_SECTION_COUNT] = {
+    [ProfileKbin] = "kbin",
+    [ProfileWork] = "work",
+    [ProfileDraw] = "draw",
+    [ProfileFrame] = "frame",
+    [ProfileRotation] = "rotate",
+    [ProfileMove] = "move",
+    [ProfileDeploy] = "deploy",
+    [ProfileLineClear] = "lines",
+};
+
+
+uint64_t profileClock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec*1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void profileRecord(ProfileSection section, uint64_t nsec)
+{
+    Histogram *histogram = &histograms[section];
+
+    pthread_mutex_lock(&histogram->lock);
+    histogram->buckets[bucketIndex(nsec)]++;
+    if (!histogram->count || nsec < histogram->min) {
+        histogram->min = nsec;
+    }
+    if (nsec > histogram->max) {
+        histogram->max = nsec;
+    }
+    histogram->count++;
+    histogram->total += nsec;
+    pthread_mutex_unlock(&histogram->lock);
+}
+
+void profileGetStats(ProfileSection section, ProfileStats *stats)
+{
+    Histogram *histogram = &histograms[section];
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&histogram->lock);
+    if (histogram->count) {
+        stats->count = histogram->count;
+        stats->min = histogram->min;
+        stats->max = histogram->max;
+        stats->avg = histogram->total/histogram->count;
+        stats->p99 = valueAtPercentile(histogram, 99.0);
+    }
+    pthread_mutex_unlock(&histogram->lock);
+}
+
+const char *profileSectionName(ProfileSection section)
+{
+    return sectionNames[section];
+}
+
+/* One block per section in the layout of HdrHistogram's percentile
+ * output, so existing plotting tools can read it. Meant for when nothing
+ * records any more, so it takes no locks. */
+int profileWriteHistograms(FILE *file)
+{
+    int section;
+    for (section = 0; section < PROFILE_SECTION_COUNT; section++) {
+        const Histogram *histogram = &histograms[section];
+
+        fprintf(file, "# %s count=%llu min=%llu max=%llu mean=%.1f\n",
+                sectionNames[section], (unsigned long long)histogram->count,
+                (unsigned long long)histogram->min,
+                (unsigned long long)histogram->max,
+                histogram->count ?
+                (double)histogram->total/(double)histogram->count : 0.0);
+        fprintf(file, "%12s %14s %10s\n", "Value(ns)", "Percentile",
+                "TotalCount");
+
+        uint64_t seen = 0;
+        int i;
+        for (i = 0; i < BUCKET_COUNT && seen < histogram->count; i++) {
+            if (!histogram->buckets[i]) {
+                continue;
+            }
+            seen += histogram->buckets[i];
+            fprintf(file, "%12llu %14.12f %10llu\n",
+                    (unsigned long long)bucketValue(i),
+                    (double)seen/(double)histogram->count,
+                    (unsigned long long)seen);
+        }
+        fprintf(file, "\n");
+    }
+
+    return ferror(file) ? -1 : 0;
+}
+
+static int bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKET_COUNT) {
+        return (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int magnitude = msb - SUB_BUCKET_BITS + 1;
+    int sub = (int)(value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT-1);
+
+    return magnitude*SUB_BUCKET_COUNT + sub;
+}
+
+/* Highest value that falls into the bucket. */
+static uint64_t bucketValue(int index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return (uint64_t)index;
+    }
+
+    int magnitude = index/SUB_BUCKET_COUNT;
+    uint64_t sub = (uint64_t)(index%SUB_BUCKET_COUNT + SUB_BUCKET_COUNT);
+    int shift = magnitude - 1;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t valueAtPercentile(const Histogram *histogram,
+                                  double percentile)
+{
+    uint64_t wanted = (uint64_t)((double)histogram->count*percentile/100.0 +
+                                 0.999999);
+    if (wanted < 1) {
+        wanted = 1;
+    }
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < BUCKET_COUNT; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted) {
+            uint64_t value = bucketValue(i);
+            return value > histogram->max ? histogram->max : value;
+        }
+    }
+
+    return histogram->max;
+}
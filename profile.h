@@ -0,0 +1,53 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+
+#define PROFILE_SECTION_COUNT 8
+
+
+typedef enum {
+    ProfileKbin,
+    ProfileWork,
+    ProfileDraw,
+    /* Handing a frame to the render thread, which then draws it. */
+    ProfileFrame,
+    ProfileRotation,
+    ProfileMove,
+    ProfileDeploy,
+    ProfileLineClear,
+} ProfileSection;
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t avg;
+    uint64_t p99;
+} ProfileStats;
+
+
+/* Off unless the front end turns it on. The histograms are process-wide
+ * and each has a lock, so any thread may record into them. */
+extern int profilingEnabled;
+
+#define PROFILE_BEGIN(start) \
+    uint64_t start = profilingEnabled ? profileClock() : 0
+
+#define PROFILE_END(section, start) \
+    do { \
+        if (profilingEnabled) { \
+            profileRecord((section), profileClock() - (start)); \
+        } \
+    } while (0)
+
+
+uint64_t profileClock(void);
+void profileRecord(ProfileSection section, uint64_t nsec);
+void profileGetStats(ProfileSection section, ProfileStats *stats);
+const char *profileSectionName(ProfileSection section);
+int profileWriteHistograms(FILE *file);
+
+#endif
@@ -0,0 +1,29 @@
+#include "protocol.h"
+
+
+int putVarint(unsigned char *buffer, uint64_t value)
+{
+    int size = 0;
+    while (value >= 0x80) {
+        buffer[size++] = (unsigned char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer[size++] = (unsigned char)value;
+
+    return size;
+}
+
+int getVarint(const unsigned char *buffer, int size, uint64_t *value)
+{
+    *value = 0;
+
+    int i;
+    for (i = 0; i < size && i < VARINT_MAX_SIZE; i++) {
+        *value |= (uint64_t)(buffer[i] & 0x7f) << (7*i);
+        if (!(buffer[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
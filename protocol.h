@@ -0,0 +1,50 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/* The client sends one byte per key, the Input it stands for. The server
+ * sends messages, each its length as a varint and then the type byte and
+ * the body; every number in them is an unsigned LEB128 varint. */
+#define PROTOCOL_VERSION    1
+
+#define DEFAULT_SOCKET_PATH "tetris.sock"
+
+#define VARINT_MAX_SIZE     10
+
+/* Big enough for an update of every cell of the largest field. */
+#define MAX_MESSAGE_SIZE \
+    (64 + 4*(MAX_FIELD_WIDTH - 2)*(MAX_FIELD_HEIGHT - 1))
+
+
+typedef enum {
+    /* Protocol version, field width and height, walls included. */
+    MessageHello = 'H',
+    /* Flags, bars of the speed meter, next and stored figure plus one,
+     * score, lines, seed, then the changed cells as a count and, per
+     * cell, how many cells it skips past the previous one and its look. */
+    MessageUpdate = 'U',
+} MessageType;
+
+typedef enum {
+    UpdateGameOver = 1,
+    UpdatePaused = 2,
+} UpdateFlag;
+
+/* What a cell inside the walls shows: a figure's colour, its shadow or
+ * nothing. */
+typedef enum {
+    CellEmpty = 0,
+    CellShadow = TETROMINO_COUNT + 1,
+} CellLook;
+
+
+/* Returns the bytes written, at most VARINT_MAX_SIZE. */
+int putVarint(unsigned char *buffer, uint64_t value);
+/* Returns the bytes read, or 0 when the buffer ends first. */
+int getVarint(const unsigned char *buffer, int size, uint64_t *value);
+
+#endif
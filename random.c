@@ -0,0 +1,44 @@
+#include "random.h"
+
+
+#define PCG_MULTIPLIER  6364136223846793005ull
+#define PCG_STREAM      1442695040888963407ull
+
+
+void seedRandom(Random *random, uint64_t seed)
+{
+    random->state = 0;
+    random->increment = PCG_STREAM | 1u;
+    nextRandom(random);
+    random->state += seed;
+    nextRandom(random);
+}
+
+uint32_t nextRandom(Random *random)
+{
+    uint64_t old = random->state;
+    random->state = old*PCG_MULTIPLIER + random->increment;
+
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rotation = (uint32_t)(old >> 59);
+
+    return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+/* Lemire's multiply-and-shift, redrawing the few values that would make
+ * some results more likely than others. */
+uint32_t randomBelow(Random *random, uint32_t bound)
+{
+    uint64_t product = (uint64_t)nextRandom(random)*bound;
+    uint32_t low = (uint32_t)product;
+
+    if (low < bound) {
+        uint32_t threshold = (uint32_t)-bound % bound;
+        while (low < threshold) {
+            product = (uint64_t)nextRandom(random)*bound;
+            low = (uint32_t)product;
+        }
+    }
+
+    return (uint32_t)(product >> 32);
+}
@@ -0,0 +1,20 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+
+/* PCG32 generator state. Every game owns one, so games can run side by
+ * side without sharing hidden state. */
+typedef struct {
+    uint64_t state;
+    uint64_t increment;
+} Random;
+
+
+void seedRandom(Random *random, uint64_t seed);
+uint32_t nextRandom(Random *random);
+/* Uniform in [0, bound), without the bias of a plain modulo. */
+uint32_t randomBelow(Random *random, uint32_t bound);
+
+#endif
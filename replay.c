@@ -0,0 +1,192 @@
+#include <string.h>
+
+#include "replay.h"
+
+
+/* File layout: the magic and version, the seed, the field width and
+ * height, then one record per input
+ * batch: the tick delta since the previous record, the input count and the
+ * inputs. A record with no inputs ends the file and carries the final
+ * score and board hash. Every number is an unsigned LEB128 varint. */
+#define REPLAY_MAGIC    "TTRP"
+#define REPLAY_VERSION  5
+
+#define FNV_OFFSET      0xcbf29ce484222325ull
+#define FNV_PRIME       0x100000001b3ull
+
+
+static void writeVarint(FILE *file, uint64_t value);
+static int readVarint(FILE *file, uint64_t *value);
+
+
+int replayCreate(Replay *replay, const char *path, unsigned int seed,
+                 int width, int height)
+{
+    replay->file = fopen(path, "wb");
+    replay->lastTick = 0;
+    if (replay->file == NULL) {
+        return 0;
+    }
+
+    fputs(REPLAY_MAGIC, replay->file);
+    fputc(REPLAY_VERSION, replay->file);
+    writeVarint(replay->file, seed);
+    writeVarint(replay->file, (uint64_t)width);
+    writeVarint(replay->file, (uint64_t)height);
+
+    return !ferror(replay->file);
+}
+
+void replayWriteInputs(Replay *replay, long long tick, const Input *inputs,
+                       int count)
+{
+    if (replay->file == NULL || count <= 0) {
+        return;
+    }
+
+    writeVarint(replay->file, (uint64_t)(tick - replay->lastTick));
+    writeVarint(replay->file, (uint64_t)count);
+    int i;
+    for (i = 0; i < count; i++) {
+        writeVarint(replay->file, (uint64_t)inputs[i]);
+    }
+    replay->lastTick = tick;
+}
+
+int replayFinish(Replay *replay, long long tick, const GameState *state)
+{
+    if (replay->file == NULL) {
+        return 0;
+    }
+
+    writeVarint(replay->file, (uint64_t)(tick - replay->lastTick));
+    writeVarint(replay->file, 0);
+    writeVarint(replay->file, (uint64_t)state->score);
+    writeVarint(replay->file, boardHash(state));
+
+    int failed = ferror(replay->file);
+    failed |= fclose(replay->file) != 0;
+    replay->file = NULL;
+
+    return !failed;
+}
+
+int replayOpen(Replay *replay, const char *path, unsigned int *seed,
+               int *width, int *height)
+{
+    replay->file = fopen(path, "rb");
+    replay->lastTick = 0;
+    if (replay->file == NULL) {
+        return 0;
+    }
+
+    char magic[sizeof(REPLAY_MAGIC) - 1];
+    uint64_t value;
+    uint64_t columns;
+    uint64_t rows;
+    if (fread(magic, sizeof(magic), 1, replay->file) != 1 ||
+        memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0 ||
+        fgetc(replay->file) != REPLAY_VERSION ||
+        !readVarint(replay->file, &value) ||
+        !readVarint(replay->file, &columns) ||
+        !readVarint(replay->file, &rows) ||
+        columns > MAX_FIELD_WIDTH || rows > MAX_FIELD_HEIGHT ||
+        !fieldSizeValid((int)columns, (int)rows)) {
+        replayClose(replay);
+        return 0;
+    }
+    *seed = (unsigned int)value;
+    *width = (int)columns;
+    *height = (int)rows;
+
+    return 1;
+}
+
+int replayRead(Replay *replay, ReplayEvent *event)
+{
+    uint64_t delta;
+    uint64_t count;
+    if (!readVarint(replay->file, &delta) ||
+        !readVarint(replay->file, &count) || count > REPLAY_MAX_INPUTS) {
+        return 0;
+    }
+
+    replay->lastTick += (long long)delta;
+    event->tick = replay->lastTick;
+    event->inputCount = (int)count;
+
+    uint64_t value;
+    int i;
+    for (i = 0; i < event->inputCount; i++) {
+        if (!readVarint(replay->file, &value) || value > InputPause) {
+            return 0;
+        }
+        event->inputs[i] = (Input)value;
+    }
+
+    if (!event->inputCount) {
+        if (!readVarint(replay->file, &value)) {
+            return 0;
+        }
+        event->score = (int)value;
+        if (!readVarint(replay->file, &event->hash)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void replayClose(Replay *replay)
+{
+    if (replay->file != NULL) {
+        fclose(replay->file);
+        replay->file = NULL;
+    }
+}
+
+/* FNV-1a over the part of the colour plane the field uses, which also
+ * fixes the row masks. */
+uint64_t boardHash(const GameState *state)
+{
+    uint64_t hash = FNV_OFFSET;
+
+    int x;
+    int y;
+    for (y = 0; y < state->height; y++) {
+        for (x = 0; x < state->width; x++) {
+            hash ^= (unsigned char)state->colors[y][x];
+            hash *= FNV_PRIME;
+        }
+    }
+
+    return hash;
+}
+
+static void writeVarint(FILE *file, uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    fputc((int)value, file);
+}
+
+static int readVarint(FILE *file, uint64_t *value)
+{
+    *value = 0;
+
+    int shift;
+    for (shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
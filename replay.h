@@ -0,0 +1,44 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+
+
+#define REPLAY_MAX_INPUTS MAX_INPUT_COUNT
+
+
+typedef struct {
+    FILE *file;
+    long long lastTick;
+} Replay;
+
+/* One batch of inputs as the game took it, auto-repeated moves included,
+ * or the end record with the result the recorded game finished with when
+ * inputCount is 0. */
+typedef struct {
+    long long tick;
+    Input inputs[REPLAY_MAX_INPUTS];
+    int inputCount;
+    int score;
+    uint64_t hash;
+} ReplayEvent;
+
+
+int replayCreate(Replay *replay, const char *path, unsigned int seed,
+                 int width, int height);
+void replayWriteInputs(Replay *replay, long long tick, const Input *inputs,
+                       int count);
+int replayFinish(Replay *replay, long long tick, const GameState *state);
+
+int replayOpen(Replay *replay, const char *path, unsigned int *seed,
+               int *width, int *height);
+/* Returns 0 once the file turns out truncated or malformed. */
+int replayRead(Replay *replay, ReplayEvent *event);
+void replayClose(Replay *replay);
+
+uint64_t boardHash(const GameState *state);
+
+#endif
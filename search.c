@@ -0,0 +1,785 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "search.h"
+#include "zobrist.h"
+
+
+#define ARENA_BLOCK_SIZE    (1 << 20)
+#define ARENA_ALIGN         16
+
+/* 1 << TABLE_BITS buckets of TABLE_BUCKET_ENTRIES boards: 256 KiB. Most
+ * hits are boards met twice within one search, so a table that outgrows
+ * the L2 cache only makes the stores dearer. */
+#define TABLE_BITS          12
+
+/* Two figures, every turn and every column. */
+#define MAX_CANDIDATES      (2*ROTATION_COUNT*(MAX_FIELD_WIDTH - 2))
+
+
+/* Bump allocator. Blocks stay around across resets, so once the first few
+ * moves have grown it a search asks the system for nothing. */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    unsigned char *data;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+} Arena;
+
+/* Tasks of one phase. The owner pops from the tail, idle workers steal
+ * from the head. */
+typedef struct {
+    pthread_mutex_t lock;
+    int *tasks;
+    int head;
+    int tail;
+} TaskQueue;
+
+typedef struct {
+    Planner *planner;
+    int index;
+    pthread_t thread;
+    Arena arena;
+    TaskQueue queue;
+    TableStats stats;
+} Worker;
+
+/* A board reached by the line of placements that starts with first. The
+ * figure to place next is spawned in state, or TetrominoNone when it is
+ * not known yet. */
+typedef struct {
+    GameState state;
+    Plan first;
+    double lineScore;
+} SearchNode;
+
+typedef struct {
+    const SearchNode *parent;
+    /* Turned and shifted, not yet dropped. */
+    FigureMask mask;
+    Tetromino figure;
+    Tetromino stored;
+    Plan first;
+    double lineScore;
+    double score;
+    /* The board and figures the candidate leaves, for spotting the same
+     * position reached in another order. */
+    uint64_t key;
+    /* Tie-break that keeps the search independent of thread timing. */
+    int order;
+} Candidate;
+
+typedef struct {
+    Candidate *candidates;
+    int count;
+} Expansion;
+
+typedef enum {
+    PhaseExpand,
+    PhaseMaterialize,
+} Phase;
+
+struct Planner {
+    Worker *workers;
+    int workerCount;
+    int beamWidth;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    int generation;
+    int running;
+    int stopping;
+
+    Phase phase;
+    int level;
+    Tetromino upcoming[SEARCH_DEPTH + 2];
+
+    SearchNode **nodes;
+    int nodeCount;
+    Expansion *expansions;
+    Candidate **heap;
+    int selectedCount;
+
+    /* Board scores, shared by every thread and kept across moves and
+     * games since a board always scores the same. */
+    TranspositionTable table;
+    /* Open addressing set of the keys kept at one level. */
+    uint64_t *seen;
+    int seenMask;
+};
+
+/* Candidates are scored in batches, lane i of batch being pending[i]. */
+typedef struct {
+    Planner *planner;
+    int worker;
+    const SearchNode *node;
+    Expansion *expansion;
+    int index;
+    int useStorage;
+    Tetromino figure;
+    Tetromino stored;
+    BoardBatch batch;
+    Candidate *pending[FEATURE_LANES];
+    int lines[FEATURE_LANES];
+    uint64_t boardKeys[FEATURE_LANES];
+    int count;
+} ExpandContext;
+
+
+static void *workerMain(void *argument);
+static void runPhase(Planner *planner, Phase phase, int taskCount);
+static void runTasks(Worker *worker);
+static int takeTask(Worker *worker);
+static void expandNode(Worker *worker, int index);
+static void addCandidate(void *context, const GameState *state,
+                         const FigureMask *mask, int rotation, int shift);
+static void scoreCandidates(ExpandContext *context);
+static uint64_t droppedBoardKey(const GameState *state,
+                                const FigureMask *mask, int lines,
+                                const BoardBatch *batch, int lane);
+static void materializeNode(Worker *worker, int index);
+static int selectCandidates(Planner *planner);
+static int dropRepeats(Planner *planner);
+static int isBetter(const Candidate *a, const Candidate *b);
+static int compareCandidates(const void *a, const void *b);
+static void siftDown(Candidate **heap, int count, int i);
+static void *arenaAlloc(Arena *arena, size_t size);
+static void arenaReset(Arena *arena);
+static void arenaFree(Arena *arena);
+
+
+Planner *plannerCreate(int threadCount)
+{
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (threadCount > MAX_SEARCH_THREADS) {
+        threadCount = MAX_SEARCH_THREADS;
+    }
+
+    Planner *planner = calloc(1, sizeof(*planner));
+    if (planner == NULL) {
+        return NULL;
+    }
+    planner->workerCount = threadCount;
+    planner->beamWidth = BEAM_PER_THREAD*threadCount;
+
+    int width = planner->beamWidth;
+    planner->seenMask = 1;
+    while (planner->seenMask < 2*width) {
+        planner->seenMask <<= 1;
+    }
+    planner->seenMask--;
+
+    planner->workers = calloc((size_t)threadCount, sizeof(Worker));
+    planner->nodes = calloc((size_t)width, sizeof(SearchNode *));
+    planner->expansions = calloc((size_t)width, sizeof(Expansion));
+    planner->heap = calloc((size_t)width, sizeof(Candidate *));
+    planner->seen = calloc((size_t)planner->seenMask + 1, sizeof(uint64_t));
+    if (planner->workers == NULL || planner->nodes == NULL ||
+        planner->expansions == NULL || planner->heap == NULL ||
+        planner->seen == NULL ||
+        !tableCreate(&planner->table, TABLE_BITS)) {
+        plannerDestroy(planner);
+        return NULL;
+    }
+
+    pthread_mutex_init(&planner->lock, NULL);
+    pthread_cond_init(&planner->wake, NULL);
+    pthread_cond_init(&planner->idle, NULL);
+
+    int i;
+    for (i = 0; i < threadCount; i++) {
+        Worker *worker = &planner->workers[i];
+        worker->planner = planner;
+        worker->index = i;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        worker->queue.tasks = malloc(sizeof(int)*(size_t)width);
+        if (worker->queue.tasks == NULL) {
+            plannerDestroy(planner);
+            return NULL;
+        }
+    }
+
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&planner->workers[i].thread, NULL, workerMain,
+                           &planner->workers[i]) != 0) {
+            planner->workerCount = i;
+            plannerDestroy(planner);
+            return NULL;
+        }
+    }
+
+    return planner;
+}
+
+void plannerDestroy(Planner *planner)
+{
+    if (planner == NULL) {
+        return;
+    }
+
+    int i;
+    if (planner->workers != NULL) {
+        pthread_mutex_lock(&planner->lock);
+        planner->stopping = 1;
+        pthread_cond_broadcast(&planner->wake);
+        pthread_mutex_unlock(&planner->lock);
+
+        for (i = 1; i < planner->workerCount; i++) {
+            pthread_join(planner->workers[i].thread, NULL);
+        }
+        for (i = 0; i < planner->workerCount; i++) {
+            arenaFree(&planner->workers[i].arena);
+            free(planner->workers[i].queue.tasks);
+        }
+    }
+
+    free(planner->workers);
+    free(planner->nodes);
+    free(planner->expansions);
+    free(planner->heap);
+    free(planner->seen);
+    tableDestroy(&planner->table);
+    free(planner);
+}
+
+int plannerThreadCount(const Planner *planner)
+{
+    return planner->workerCount;
+}
+
+void plannerTableStats(const Planner *planner, TableStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    int i;
+    for (i = 0; i < planner->workerCount; i++) {
+        stats->probes += planner->workers[i].stats.probes;
+        stats->hits += planner->workers[i].stats.hits;
+        stats->stores += planner->workers[i].stats.stores;
+    }
+}
+
+/* Level by level: every node of the beam is expanded into candidates in
+ * parallel, the best beamWidth candidates are kept, and those become the
+ * nodes of the next level. The plan is the first move of the best line
+ * that went deepest. */
+int plannerFindMove(Planner *planner, const GameState *state, Plan *plan)
+{
+    if (state->isGameOver || state->isPaused ||
+        state->figure <= TetrominoNone) {
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < planner->workerCount; i++) {
+        arenaReset(&planner->workers[i].arena);
+    }
+
+    planner->upcoming[0] = state->figure;
+    planner->upcoming[1] = state->nextFigure;
+    for (i = 2; i < SEARCH_DEPTH + 2; i++) {
+        planner->upcoming[i] = TetrominoNone;
+    }
+
+    SearchNode *root = arenaAlloc(&planner->workers[0].arena, sizeof(*root));
+    root->state = *state;
+    root->lineScore = 0.0;
+    memset(&root->first, 0, sizeof(root->first));
+    planner->nodes[0] = root;
+    planner->nodeCount = 1;
+
+    int found = 0;
+    for (planner->level = 0; planner->level < SEARCH_DEPTH &&
+                             planner->nodeCount; planner->level++) {
+        runPhase(planner, PhaseExpand, planner->nodeCount);
+        if (!selectCandidates(planner) || !dropRepeats(planner)) {
+            break;
+        }
+
+        *plan = planner->heap[0]->first;
+        found = 1;
+
+        if (planner->level < SEARCH_DEPTH-1) {
+            runPhase(planner, PhaseMaterialize, planner->selectedCount);
+
+            int alive = 0;
+            for (i = 0; i < planner->selectedCount; i++) {
+                if (planner->nodes[i] != NULL) {
+                    planner->nodes[alive++] = planner->nodes[i];
+                }
+            }
+            planner->nodeCount = alive;
+        }
+    }
+
+    return found;
+}
+
+int planInputs(const Plan *plan, Input *list)
+{
+    int count = 0;
+    if (plan->useStorage) {
+        list[count++] = InputStorage;
+    }
+
+    return count + placementInputs(&plan->placement, list + count);
+}
+
+static void *workerMain(void *argument)
+{
+    Worker *worker = argument;
+    Planner *planner = worker->planner;
+    int seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&planner->lock);
+        while (planner->generation == seen && !planner->stopping) {
+            pthread_cond_wait(&planner->wake, &planner->lock);
+        }
+        if (planner->stopping) {
+            pthread_mutex_unlock(&planner->lock);
+            return NULL;
+        }
+        seen = planner->generation;
+        pthread_mutex_unlock(&planner->lock);
+
+        runTasks(worker);
+
+        pthread_mutex_lock(&planner->lock);
+        if (--planner->running == 0) {
+            pthread_cond_signal(&planner->idle);
+        }
+        pthread_mutex_unlock(&planner->lock);
+    }
+}
+
+/* Deals the tasks out round robin and works along with the pool until
+ * every queue is empty. */
+static void runPhase(Planner *planner, Phase phase, int taskCount)
+{
+    int i;
+    for (i = 0; i < planner->workerCount; i++) {
+        planner->workers[i].queue.head = 0;
+        planner->workers[i].queue.tail = 0;
+    }
+    for (i = 0; i < taskCount; i++) {
+        TaskQueue *queue = &planner->workers[i % planner->workerCount].queue;
+        queue->tasks[queue->tail++] = i;
+    }
+    planner->phase = phase;
+
+    if (planner->workerCount > 1) {
+        pthread_mutex_lock(&planner->lock);
+        planner->running = planner->workerCount - 1;
+        planner->generation++;
+        pthread_cond_broadcast(&planner->wake);
+        pthread_mutex_unlock(&planner->lock);
+    }
+
+    runTasks(&planner->workers[0]);
+
+    if (planner->workerCount > 1) {
+        pthread_mutex_lock(&planner->lock);
+        while (planner->running) {
+            pthread_cond_wait(&planner->idle, &planner->lock);
+        }
+        pthread_mutex_unlock(&planner->lock);
+    }
+}
+
+static void runTasks(Worker *worker)
+{
+    int task;
+    while ((task = takeTask(worker)) >= 0) {
+        if (worker->planner->phase == PhaseExpand) {
+            expandNode(worker, task);
+        }
+        else {
+            materializeNode(worker, task);
+        }
+    }
+}
+
+static int takeTask(Worker *worker)
+{
+    Planner *planner = worker->planner;
+    TaskQueue *queue = &worker->queue;
+    int task = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head) {
+        task = queue->tasks[--queue->tail];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    int i;
+    for (i = 1; task < 0 && i < planner->workerCount; i++) {
+        TaskQueue *victim =
+            &planner->workers[(worker->index + i) % planner->workerCount].queue;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail > victim->head) {
+            task = victim->tasks[victim->head++];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return task;
+}
+
+/* Every placement of the figure in hand and, if the store may be used, of
+ * the stored figure instead. */
+static void expandNode(Worker *worker, int index)
+{
+    Planner *planner = worker->planner;
+    const SearchNode *node = planner->nodes[index];
+    Expansion *expansion = &planner->expansions[index];
+
+    expansion->candidates = arenaAlloc(&worker->arena,
+                                       sizeof(Candidate)*MAX_CANDIDATES);
+    expansion->count = 0;
+
+    ExpandContext context;
+    context.planner = planner;
+    context.worker = worker->index;
+    context.node = node;
+    context.expansion = expansion;
+    context.index = index;
+    context.useStorage = 0;
+    context.figure = node->state.figure;
+    context.stored = node->state.storedFigure;
+    context.count = 0;
+    forEachPlacement(&node->state, addCandidate, &context);
+
+    Tetromino stored = node->state.storedFigure;
+    if (stored > TetrominoNone && stored != node->state.figure &&
+        !node->state.storageUsed) {
+        GameState probe = node->state;
+        probe.figure = stored;
+        if (moveFigureToDefaultPosition(&probe)) {
+            context.useStorage = 1;
+            context.figure = stored;
+            context.stored = node->state.figure;
+            forEachPlacement(&probe, addCandidate, &context);
+        }
+    }
+
+    scoreCandidates(&context);
+}
+
+/* Boards the table knows are scored on the spot; the rest wait for a
+ * full batch. */
+static void addCandidate(void *argument, const GameState *state,
+                         const FigureMask *mask, int rotation, int shift)
+{
+    ExpandContext *context = argument;
+    Planner *planner = context->planner;
+    Expansion *expansion = context->expansion;
+    if (expansion->count == MAX_CANDIDATES) {
+        return;
+    }
+
+    int lines = dropIntoBatch(state, mask, &context->batch, context->count);
+    if (lines < 0) {
+        return;
+    }
+    uint64_t boardKey = droppedBoardKey(state, mask, lines, &context->batch,
+                                        context->count);
+
+    Candidate *candidate = &expansion->candidates[expansion->count];
+    candidate->parent = context->node;
+    candidate->mask = *mask;
+    candidate->figure = context->figure;
+    candidate->stored = context->stored;
+    candidate->lineScore = context->node->lineScore + WEIGHT_LINES*lines;
+    candidate->order = context->index*MAX_CANDIDATES + expansion->count;
+    candidate->key = boardKey ^
+        zobristFigure(ZobristFigure, planner->upcoming[planner->level + 1]) ^
+        zobristFigure(ZobristNextFigure,
+                      planner->upcoming[planner->level + 2]) ^
+        zobristFigure(ZobristStoredFigure, context->stored);
+
+    if (planner->level == 0) {
+        candidate->first.useStorage = context->useStorage;
+        candidate->first.placement.rotation = rotation;
+        candidate->first.placement.shift = shift;
+        candidate->first.placement.lines = lines;
+    }
+    else {
+        candidate->first = context->node->first;
+    }
+
+    expansion->count++;
+
+    double board;
+    Worker *worker = &planner->workers[context->worker];
+    if (tableProbe(&planner->table, boardKey, &board, &worker->stats)) {
+        candidate->score = board + candidate->lineScore;
+        if (planner->level == 0) {
+            candidate->first.placement.score = board + WEIGHT_LINES*lines;
+        }
+        return;
+    }
+
+    context->pending[context->count] = candidate;
+    context->lines[context->count] = lines;
+    context->boardKeys[context->count] = boardKey;
+    if (++context->count == FEATURE_LANES) {
+        scoreCandidates(context);
+    }
+}
+
+static void scoreCandidates(ExpandContext *context)
+{
+    if (!context->count) {
+        return;
+    }
+
+    Planner *planner = context->planner;
+    Worker *worker = &planner->workers[context->worker];
+    FeatureBatch features;
+    padBatch(&context->batch, context->count);
+    boardFeatures(&context->batch, &features);
+
+    int lane;
+    for (lane = 0; lane < context->count; lane++) {
+        Candidate *candidate = context->pending[lane];
+        int lines = context->lines[lane];
+        double board = featureScore(&features, lane, 0);
+
+        tableStore(&planner->table, context->boardKeys[lane], board,
+                   &worker->stats);
+        candidate->score = board + candidate->lineScore;
+        if (planner->level == 0) {
+            candidate->first.placement.score = board + WEIGHT_LINES*lines;
+        }
+    }
+    context->count = 0;
+}
+
+/* The parent's key with the figure's cells added, unless rows were
+ * cleared and moved; then the dropped board is hashed from scratch. */
+static uint64_t droppedBoardKey(const GameState *state,
+                                const FigureMask *mask, int lines,
+                                const BoardBatch *batch, int lane)
+{
+    uint64_t key = 0;
+    int y;
+    if (lines) {
+        for (y = 0; y < batch->height-1; y++) {
+            key ^= zobristRow(y, (Row)batch->rows[y][lane], batch->width);
+        }
+        return key;
+    }
+
+    key = state->boardKey;
+    int top = mask->top + dropDistance(state, mask);
+    int r;
+    for (r = 0; r < FIGURE_CELL_COUNT; r++) {
+        Row cells = mask->rows[r];
+        while (cells) {
+            key ^= zobristCell(__builtin_ctz(cells), top + r);
+            cells &= (Row)(cells - 1);
+        }
+    }
+
+    return key;
+}
+
+/* Drops the candidate's figure for real on a copy of its parent and spawns
+ * the figure that comes after it. Leaves NULL if that one does not fit. */
+static void materializeNode(Worker *worker, int index)
+{
+    Planner *planner = worker->planner;
+    const Candidate *candidate = planner->heap[index];
+
+    SearchNode *node = arenaAlloc(&worker->arena, sizeof(*node));
+    node->state = candidate->parent->state;
+    node->first = candidate->first;
+    node->lineScore = candidate->lineScore;
+
+    FigureMask landed = candidate->mask;
+    landed.top += dropDistance(&node->state, &landed);
+    lockFigureMask(&node->state, candidate->figure, &landed);
+
+    node->state.figure = planner->upcoming[planner->level + 1];
+    node->state.storedFigure = candidate->stored;
+    node->state.storageUsed = 0;
+    if (!moveFigureToDefaultPosition(&node->state)) {
+        node = NULL;
+    }
+
+    planner->nodes[index] = node;
+}
+
+/* Keeps the best beamWidth candidates of the level in heap, best first. */
+static int selectCandidates(Planner *planner)
+{
+    Candidate **heap = planner->heap;
+    int width = planner->beamWidth;
+    int count = 0;
+
+    int n;
+    for (n = 0; n < planner->nodeCount; n++) {
+        Expansion *expansion = &planner->expansions[n];
+        int i;
+        for (i = 0; i < expansion->count; i++) {
+            Candidate *candidate = &expansion->candidates[i];
+            if (count < width) {
+                heap[count++] = candidate;
+                if (count == width) {
+                    int j;
+                    for (j = width/2 - 1; j >= 0; j--) {
+                        siftDown(heap, count, j);
+                    }
+                }
+            }
+            else if (isBetter(candidate, heap[0])) {
+                heap[0] = candidate;
+                siftDown(heap, count, 0);
+            }
+        }
+    }
+
+    qsort(heap, (size_t)count, sizeof(*heap), compareCandidates);
+    planner->selectedCount = count;
+
+    return count;
+}
+
+/* Keeps the first, so best, of the kept candidates that leave the same
+ * board and figures. */
+static int dropRepeats(Planner *planner)
+{
+    memset(planner->seen, 0, sizeof(uint64_t)*(size_t)(planner->seenMask + 1));
+
+    int kept = 0;
+    int i;
+    for (i = 0; i < planner->selectedCount; i++) {
+        /* 0 marks a free slot, so key 0 is stored as 1. */
+        uint64_t key = planner->heap[i]->key ? planner->heap[i]->key : 1;
+        int slot = (int)(key & (uint64_t)planner->seenMask);
+        while (planner->seen[slot] && planner->seen[slot] != key) {
+            slot = (slot + 1) & planner->seenMask;
+        }
+        if (planner->seen[slot]) {
+            continue;
+        }
+        planner->seen[slot] = key;
+        planner->heap[kept++] = planner->heap[i];
+    }
+    planner->selectedCount = kept;
+
+    return kept;
+}
+
+static int isBetter(const Candidate *a, const Candidate *b)
+{
+    if (a->score != b->score) {
+        return a->score > b->score;
+    }
+
+    return a->order < b->order;
+}
+
+static int compareCandidates(const void *a, const void *b)
+{
+    const Candidate *first = *(Candidate *const *)a;
+    const Candidate *second = *(Candidate *const *)b;
+
+    if (isBetter(first, second)) {
+        return -1;
+    }
+
+    return isBetter(second, first) ? 1 : 0;
+}
+
+/* Min-heap on isBetter: the worst kept candidate sits on top. */
+static void siftDown(Candidate **heap, int count, int i)
+{
+    while (1) {
+        int worst = i;
+        int left = 2*i + 1;
+        int right = left + 1;
+        if (left < count && isBetter(heap[worst], heap[left])) {
+            worst = left;
+        }
+        if (right < count && isBetter(heap[worst], heap[right])) {
+            worst = right;
+        }
+        if (worst == i) {
+            return;
+        }
+
+        Candidate *swap = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = swap;
+        i = worst;
+    }
+}
+
+static void *arenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    while (arena->current == NULL ||
+           arena->current->used + size > arena->current->size) {
+        ArenaBlock *next = arena->current != NULL ? arena->current->next :
+                                                    arena->first;
+        if (next == NULL) {
+            next = malloc(sizeof(*next));
+            if (next == NULL) {
+                abort();
+            }
+            next->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            next->data = malloc(next->size);
+            if (next->data == NULL) {
+                abort();
+            }
+            next->next = NULL;
+            if (arena->current != NULL) {
+                arena->current->next = next;
+            }
+            else {
+                arena->first = next;
+            }
+        }
+        next->used = 0;
+        arena->current = next;
+    }
+
+    void *memory = arena->current->data + arena->current->used;
+    arena->current->used += size;
+
+    return memory;
+}
+
+static void arenaReset(Arena *arena)
+{
+    arena->current = arena->first;
+    if (arena->current != NULL) {
+        arena->current->used = 0;
+    }
+}
+
+static void arenaFree(Arena *arena)
+{
+    ArenaBlock *block = arena->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block->data);
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
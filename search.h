@@ -0,0 +1,42 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "engine.h"
+#include "bot.h"
+#include "transposition.h"
+
+
+/* Beam slots every worker thread adds, so a wider machine searches a
+ * proportionally wider beam in about the same time. */
+#define BEAM_PER_THREAD     24
+#define MAX_SEARCH_THREADS  64
+
+/* Placements along every line of the search: the current figure, the next
+ * one, and then the stored one, which is all a third placement can use
+ * since the piece after next is not known yet. */
+#define SEARCH_DEPTH        3
+
+
+typedef struct {
+    /* Swap with the stored figure before placing. */
+    int useStorage;
+    Placement placement;
+} Plan;
+
+typedef struct Planner Planner;
+
+
+/* Starts threadCount - 1 workers; the calling thread is the last one. */
+Planner *plannerCreate(int threadCount);
+void plannerDestroy(Planner *planner);
+int plannerThreadCount(const Planner *planner);
+/* Board score table use summed over the threads so far. */
+void plannerTableStats(const Planner *planner, TableStats *stats);
+/* Beam search over the current, next and stored figures, swaps included.
+ * Returns 0 when the figure has nowhere to go. */
+int plannerFindMove(Planner *planner, const GameState *state, Plan *plan);
+
+/* The inputs that carry a plan out, ending with the drop. */
+int planInputs(const Plan *plan, Input *list);
+
+#endif
@@ -0,0 +1,586 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "engine.h"
+#include "protocol.h"
+#include "timerwheel.h"
+
+
+#define MAX_EVENTS      256
+#define LISTEN_BACKLOG  128
+/* Key bytes taken from a client per read. */
+#define READ_CHUNK      64
+
+#define TICK_NSEC (1000000000L/TICKS_PER_SECOND)
+
+
+/* Everything one client's game needs: no windows, no screen, and a send
+ * buffer only while the socket is full. The game stays packed between
+ * events and is unpacked into a GameState on the stack for each. */
+typedef struct {
+    /* First, so a timer that fires is its session. */
+    WheelTimer timer;
+    int fd;
+    /* The game has been run up to this tick. */
+    long long tick;
+
+    /* What the client was last sent, so updates only carry changes. */
+    int sentFlags;
+    int sentSpeed;
+    int sentNext;
+    int sentStored;
+    int sentScore;
+    int sentLines;
+    unsigned int sentSeed;
+
+    /* The tail of a message the socket did not take, or NULL. */
+    unsigned char *pending;
+    int pendingStart;
+    int pendingLength;
+
+    PackedGame game;
+    /* One look per cell inside the walls, as the client has them; it
+     * follows board. */
+    unsigned char *frame;
+    /* The game's board as packGame() writes it. */
+    unsigned char board[];
+} Session;
+
+
+void parseArguments(int argc, char **argv);
+void usage(const char *name);
+
+int openSocket(const char *path);
+long long currentTick(void);
+
+void acceptSessions(void);
+void closeSession(Session *session);
+int loadGame(const Session *session, GameState *state);
+void saveGame(Session *session, const GameState *state);
+void readKeys(Session *session);
+int flushPending(Session *session);
+void expireSession(void *context, WheelTimer *timer);
+void runSession(Session *session, GameState *state, long long now);
+void scheduleSession(Session *session, const GameState *state);
+void sendHello(Session *session);
+void sendUpdate(Session *session, const GameState *state);
+int composeFrame(const GameState *state, unsigned char *looks);
+void placeLook(const GameState *state, unsigned char *looks, Point pos,
+               int look);
+int speedLevel(const GameState *state);
+void sendMessage(Session *session, const unsigned char *message, int size);
+void watchSession(Session *session, uint32_t events);
+
+
+const char *socketPath = DEFAULT_SOCKET_PATH;
+int fieldWidth = DEFAULT_FIELD_WIDTH;
+int fieldHeight = DEFAULT_FIELD_HEIGHT;
+int seedGiven;
+unsigned int seed;
+
+int listenFd;
+int epollFd;
+TimerWheel wheel;
+Random generator;
+
+
+int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+    if (!seedGiven) {
+        seed = (unsigned int)time(NULL);
+    }
+    seedRandom(&generator, seed);
+
+    listenFd = openSocket(socketPath);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0) {
+        perror(listenFd < 0 ? socketPath : "epoll_create1");
+        return 1;
+    }
+
+    /* The listening socket is the one entry without a session. */
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+
+    wheelInit(&wheel, currentTick());
+    fprintf(stderr, "serving %dx%d games on %s\n", fieldWidth - 2,
+            fieldHeight - 1, socketPath);
+
+    while (1) {
+        int timeout = wheelTimeout(&wheel);
+        if (timeout >= 0) {
+            long long wait = wheel.now + timeout - currentTick();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(epollFd, events, MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return 1;
+        }
+
+        int i;
+        for (i = 0; i < count; i++) {
+            Session *session = events[i].data.ptr;
+            if (session == NULL) {
+                acceptSessions();
+                continue;
+            }
+            if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                closeSession(session);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flushPending(session)) {
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                readKeys(session);
+            }
+        }
+
+        wheelAdvance(&wheel, currentTick(), expireSession, NULL);
+    }
+
+    return 0;
+}
+
+void parseArguments(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"socket", required_argument, NULL, 'S'},
+        {"size", required_argument, NULL, 'z'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 'S':
+                socketPath = optarg;
+                break;
+            case 'z':
+                if (!parseFieldSize(optarg, &fieldWidth, &fieldHeight)) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                seed = (unsigned int)strtoul(optarg, NULL, 0);
+                seedGiven = 1;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+    }
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--socket path] [--size WxH] [--seed n]\n",
+            name);
+    exit(1);
+}
+
+/* A socket left behind by a server that is gone would fail the bind, so
+ * whatever is at path is replaced. */
+int openSocket(const char *path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(fd, LISTEN_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* The engine's ticks since some fixed point, from the monotonic clock. */
+long long currentTick(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long)now.tv_sec*TICKS_PER_SECOND + now.tv_nsec/TICK_NSEC;
+}
+
+/* Every client gets a game of its own, dealt from the server's seed. */
+void acceptSessions(void)
+{
+    int fd;
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        int cells = (fieldWidth - 2)*(fieldHeight - 1);
+        int boardSize = packBoardSize(fieldWidth, fieldHeight);
+        Session *session = malloc(sizeof(*session) + (size_t)boardSize +
+                                  (size_t)cells);
+        if (session == NULL) {
+            close(fd);
+            continue;
+        }
+
+        memset(session, 0, sizeof(*session));
+        session->frame = session->board + boardSize;
+        /* No look is 0xff, so the first update sends every cell. */
+        memset(session->frame, 0xff, (size_t)cells);
+        timerInit(&session->timer);
+        session->fd = fd;
+        session->tick = currentTick();
+        session->sentFlags = -1;
+
+        GameState state;
+        newGame(&state, nextRandom(&generator), fieldWidth, fieldHeight);
+        saveGame(session, &state);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close(fd);
+            free(session);
+            continue;
+        }
+
+        sendHello(session);
+        sendUpdate(session, &state);
+        scheduleSession(session, &state);
+    }
+}
+
+void closeSession(Session *session)
+{
+    wheelCancel(&wheel, &session->timer);
+    close(session->fd);
+    free(session->pending);
+    free(session);
+}
+
+/* Only games the engine played are ever packed, so this fails only when
+ * the session's memory was overwritten. */
+int loadGame(const Session *session, GameState *state)
+{
+    return unpackGame(&session->game, session->board, state);
+}
+
+void saveGame(Session *session, const GameState *state)
+{
+    packGame(state, &session->game, session->board);
+}
+
+/* The game is brought up to now before the keys act, as the terminal
+ * game does with its clock. */
+void readKeys(Session *session)
+{
+    GameState state;
+    if (!loadGame(session, &state)) {
+        closeSession(session);
+        return;
+    }
+
+    unsigned char bytes[READ_CHUNK];
+    ssize_t size;
+    while ((size = read(session->fd, bytes, sizeof(bytes))) > 0) {
+        runSession(session, &state, currentTick());
+
+        Inputs inputs;
+        inputs.count = 0;
+        ssize_t i;
+        for (i = 0; i < size; i++) {
+            if (bytes[i] > InputNone && bytes[i] <= InputPause) {
+                inputs.list[inputs.count++] = (Input)bytes[i];
+            }
+            if (inputs.count == MAX_INPUT_COUNT || i == size-1) {
+                applyInputs(&state, &inputs);
+                inputs.count = 0;
+            }
+        }
+
+        sendUpdate(session, &state);
+        scheduleSession(session, &state);
+    }
+    saveGame(session, &state);
+
+    if (size == 0 || (errno != EAGAIN && errno != EINTR)) {
+        closeSession(session);
+    }
+}
+
+/* Returns 0 when the session had to be closed. */
+int flushPending(Session *session)
+{
+    while (session->pending != NULL) {
+        ssize_t size = send(session->fd,
+                            session->pending + session->pendingStart,
+                            (size_t)(session->pendingLength -
+                                     session->pendingStart), MSG_NOSIGNAL);
+        if (size < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                closeSession(session);
+                return 0;
+            }
+            return 1;
+        }
+
+        session->pendingStart += (int)size;
+        if (session->pendingStart == session->pendingLength) {
+            free(session->pending);
+            session->pending = NULL;
+            watchSession(session, EPOLLIN);
+
+            /* Whatever changed while the socket was full. */
+            GameState state;
+            if (!loadGame(session, &state)) {
+                closeSession(session);
+                return 0;
+            }
+            sendUpdate(session, &state);
+        }
+    }
+
+    return 1;
+}
+
+void expireSession(void *context, WheelTimer *timer)
+{
+    Session *session = (Session *)timer;
+    (void)context;
+
+    GameState state;
+    if (!loadGame(session, &state)) {
+        closeSession(session);
+        return;
+    }
+
+    runSession(session, &state, currentTick());
+    sendUpdate(session, &state);
+    scheduleSession(session, &state);
+    saveGame(session, &state);
+}
+
+/* Ticks only run while the game does, as in the terminal game. */
+void runSession(Session *session, GameState *state, long long now)
+{
+    if (now > session->tick) {
+        runTicks(state, now - session->tick);
+    }
+    session->tick = now;
+}
+
+/* Woken when gravity next acts; paused and lost games sleep until a key
+ * comes. */
+void scheduleSession(Session *session, const GameState *state)
+{
+    int ticks = ticksUntilGravity(state);
+    if (ticks < 0) {
+        wheelCancel(&wheel, &session->timer);
+        return;
+    }
+
+    wheelSchedule(&wheel, &session->timer, session->tick + ticks);
+}
+
+void sendHello(Session *session)
+{
+    unsigned char message[4*VARINT_MAX_SIZE];
+    unsigned char body[3*VARINT_MAX_SIZE];
+    int size = 0;
+
+    body[size++] = MessageHello;
+    size += putVarint(body + size, PROTOCOL_VERSION);
+    size += putVarint(body + size, (uint64_t)session->game.width);
+    size += putVarint(body + size, (uint64_t)session->game.height);
+
+    int length = putVarint(message, (uint64_t)size);
+    memcpy(message + length, body, (size_t)size);
+    sendMessage(session, message, length + size);
+}
+
+/* Nothing is built while an earlier message is still stuck; the next one
+ * after it goes through carries everything that changed meanwhile. */
+void sendUpdate(Session *session, const GameState *state)
+{
+    static unsigned char looks[(MAX_FIELD_WIDTH - 2)*(MAX_FIELD_HEIGHT - 1)];
+    static unsigned char cells[MAX_MESSAGE_SIZE];
+    static unsigned char message[MAX_MESSAGE_SIZE + 2*VARINT_MAX_SIZE];
+
+    if (session->pending != NULL) {
+        return;
+    }
+
+    int count = composeFrame(state, looks);
+    int changed = 0;
+    int cellsSize = 0;
+    int previous = -1;
+    int i;
+    for (i = 0; i < count; i++) {
+        if (looks[i] != session->frame[i]) {
+            cellsSize += putVarint(cells + cellsSize,
+                                   (uint64_t)(i - previous - 1));
+            cells[cellsSize++] = looks[i];
+            previous = i;
+            changed++;
+        }
+    }
+
+    int flags = (state->isGameOver ? UpdateGameOver : 0) |
+                (state->isPaused ? UpdatePaused : 0);
+    int speed = speedLevel(state);
+    if (!changed && flags == session->sentFlags &&
+        speed == session->sentSpeed &&
+        state->nextFigure + 1 == session->sentNext &&
+        state->storedFigure + 1 == session->sentStored &&
+        state->score == session->sentScore &&
+        state->lines == session->sentLines &&
+        state->seed == session->sentSeed) {
+        return;
+    }
+
+    unsigned char *body = message + VARINT_MAX_SIZE;
+    int size = 0;
+    body[size++] = MessageUpdate;
+    size += putVarint(body + size, (uint64_t)flags);
+    size += putVarint(body + size, (uint64_t)speed);
+    size += putVarint(body + size, (uint64_t)(state->nextFigure + 1));
+    size += putVarint(body + size, (uint64_t)(state->storedFigure + 1));
+    size += putVarint(body + size, (uint64_t)state->score);
+    size += putVarint(body + size, (uint64_t)state->lines);
+    size += putVarint(body + size, state->seed);
+    size += putVarint(body + size, (uint64_t)changed);
+    memcpy(body + size, cells, (size_t)cellsSize);
+    size += cellsSize;
+
+    /* The length goes right in front of the body. */
+    unsigned char length[VARINT_MAX_SIZE];
+    int lengthSize = putVarint(length, (uint64_t)size);
+    memcpy(body - lengthSize, length, (size_t)lengthSize);
+    sendMessage(session, body - lengthSize, lengthSize + size);
+
+    memcpy(session->frame, looks, (size_t)count);
+    session->sentFlags = flags;
+    session->sentSpeed = speed;
+    session->sentNext = state->nextFigure + 1;
+    session->sentStored = state->storedFigure + 1;
+    session->sentScore = state->score;
+    session->sentLines = state->lines;
+    session->sentSeed = state->seed;
+}
+
+/* The board with the shadow and the figure over it, row by row; returns
+ * the number of cells. */
+int composeFrame(const GameState *state, unsigned char *looks)
+{
+    int width = state->width - 2;
+    int x;
+    int y;
+    for (y = 0; y < state->height-1; y++) {
+        for (x = 0; x < width; x++) {
+            int color = state->colors[y][x + 1];
+            looks[y*width + x] = (unsigned char)(color > 0 ? color : 0);
+        }
+    }
+
+    if (state->figure > TetrominoNone) {
+        int i;
+        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+            placeLook(state, looks, state->shadowCellsPos[i], CellShadow);
+        }
+        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+            placeLook(state, looks, state->figureCellsPos[i], state->figure);
+        }
+    }
+
+    return width*(state->height - 1);
+}
+
+void placeLook(const GameState *state, unsigned char *looks, Point pos,
+               int look)
+{
+    if (pos.x >= 1 && pos.x < state->width-1 &&
+        pos.y >= 0 && pos.y < state->height-1) {
+        looks[pos.y*(state->width - 2) + pos.x - 1] = (unsigned char)look;
+    }
+}
+
+/* Bars of the speed meter, counted as the terminal game draws them. */
+int speedLevel(const GameState *state)
+{
+    int i;
+    for (i = 0; i < SPEEDS_COUNT; i++) {
+        if (state->speed < speedList[i]) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* Straight to the socket; only what it does not take is kept. */
+void sendMessage(Session *session, const unsigned char *message, int size)
+{
+    ssize_t sent = send(session->fd, message, (size_t)size, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            /* Left for the hang-up event to close. */
+            return;
+        }
+        sent = 0;
+    }
+    if (sent == size) {
+        return;
+    }
+
+    session->pending = malloc((size_t)(size - sent));
+    if (session->pending == NULL) {
+        /* The client got part of a message and can never make sense of
+         * what follows, so the hang-up this brings closes the session;
+         * the callers still use it. */
+        shutdown(session->fd, SHUT_RDWR);
+        return;
+    }
+    memcpy(session->pending, message + sent, (size_t)(size - sent));
+    session->pendingStart = 0;
+    session->pendingLength = (int)(size - sent);
+    watchSession(session, EPOLLIN | EPOLLOUT);
+}
+
+void watchSession(Session *session, uint32_t events)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = session;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, session->fd, &event);
+}
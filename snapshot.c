@@ -0,0 +1,105 @@
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "snapshot.h"
+
+
+#define SNAPSHOT_MAGIC      "TTSS"
+/* Bumped whenever GameState changes in a way its size does not show. */
+#define SNAPSHOT_VERSION    1
+
+
+int snapshotOpen(Snapshot *snapshot, const char *path)
+{
+    snapshot->file = NULL;
+    snapshot->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (snapshot->fd < 0) {
+        return 0;
+    }
+
+    /* Held until the file is closed, so two games never share it. */
+    if (flock(snapshot->fd, LOCK_EX | LOCK_NB) < 0) {
+        int error = errno;
+        close(snapshot->fd);
+        snapshot->fd = -1;
+        errno = error;
+        return 0;
+    }
+
+    /* A new file is all zeros, which reads as nothing saved. */
+    void *map = MAP_FAILED;
+    if (ftruncate(snapshot->fd, sizeof(SnapshotFile)) == 0) {
+        map = mmap(NULL, sizeof(SnapshotFile), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, snapshot->fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+        return 0;
+    }
+    snapshot->file = map;
+
+    return 1;
+}
+
+/* The header has to match this build; the game itself then goes through
+ * restoreGame(), so a stale or damaged file is refused rather than
+ * indexing out of bounds. */
+int snapshotLoad(const Snapshot *snapshot, GameState *state)
+{
+    const SnapshotFile *file = snapshot->file;
+
+    if (memcmp(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic)) != 0 ||
+        file->version != SNAPSHOT_VERSION ||
+        file->size != sizeof(GameState) || !file->saved) {
+        return 0;
+    }
+
+    GameState loaded;
+    memcpy(&loaded, &file->state, sizeof(loaded));
+    if (!restoreGame(&loaded)) {
+        return 0;
+    }
+    *state = loaded;
+
+    return 1;
+}
+
+/* The mapping is the page cache, so whatever got copied survives the
+ * process being killed half way; the saved mark is dropped for the copy
+ * so a torn game is never resumed. */
+int snapshotSave(Snapshot *snapshot, const GameState *state)
+{
+    SnapshotFile *file = snapshot->file;
+
+    __atomic_store_n(&file->saved, 0, __ATOMIC_RELEASE);
+    memcpy(&file->state, state, sizeof(file->state));
+    memcpy(file->magic, SNAPSHOT_MAGIC, sizeof(file->magic));
+    file->version = SNAPSHOT_VERSION;
+    file->size = sizeof(GameState);
+    __atomic_store_n(&file->saved, 1, __ATOMIC_RELEASE);
+
+    return msync(file, sizeof(*file), MS_SYNC) == 0;
+}
+
+void snapshotDiscard(Snapshot *snapshot)
+{
+    snapshot->file->saved = 0;
+    msync(snapshot->file, sizeof(*snapshot->file), MS_SYNC);
+}
+
+void snapshotClose(Snapshot *snapshot)
+{
+    if (snapshot->file != NULL) {
+        munmap(snapshot->file, sizeof(*snapshot->file));
+        snapshot->file = NULL;
+    }
+    if (snapshot->fd >= 0) {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/* The whole file: a header and the GameState as it sits in memory, so
+ * the layout is that of this build and the version and size reject any
+ * other. */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    /* 0 until a game is saved, and again once it has been quit. */
+    uint32_t saved;
+    GameState state;
+} SnapshotFile;
+
+/* The file stays mapped for the whole session, so saving is a copy and
+ * an msync(). */
+typedef struct {
+    int fd;
+    SnapshotFile *file;
+} Snapshot;
+
+
+/* Creates the file if needed, locks it and maps it; what it holds is left
+ * alone. Fails with errno EWOULDBLOCK while another game has it. */
+int snapshotOpen(Snapshot *snapshot, const char *path);
+/* Returns 0 when the file does not hold a game saved by this build. */
+int snapshotLoad(const Snapshot *snapshot, GameState *state);
+int snapshotSave(Snapshot *snapshot, const GameState *state);
+/* Marks the saved game as gone, so it is not resumed later. */
+void snapshotDiscard(Snapshot *snapshot);
+void snapshotClose(Snapshot *snapshot);
+
+#endif
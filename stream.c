@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "stream.h"
+#include "protocol.h"
+
+
+/* The longest event but a sync. */
+#define EVENT_MAX_SIZE      (1 + 3*VARINT_MAX_SIZE)
+#define SYNC_MAX_SIZE \
+    (1 + 11*VARINT_MAX_SIZE + (MAX_FIELD_WIDTH - 2)*(MAX_FIELD_HEIGHT - 1))
+
+
+static void writeSync(EventStream *stream, const GameState *state);
+static int putSpawn(unsigned char *event, const GameState *state);
+static uint64_t figureCode(Tetromino figure);
+static int putSigned(unsigned char *buffer, int value);
+static void appendEvent(EventStream *stream, const unsigned char *event,
+                        int size);
+static void remember(EventStream *stream, const GameState *state);
+
+
+int streamOpen(EventStream *stream, const char *target)
+{
+    char *end;
+    long fd = strtol(target, &end, 10);
+    stream->flags = -1;
+    if (*target != '\0' && *end == '\0' && fd >= 0) {
+        /* The terminal is on those, and curses waits on it. */
+        if (fd <= STDERR_FILENO) {
+            errno = EINVAL;
+            return 0;
+        }
+        stream->fd = (int)fd;
+        stream->flags = fcntl(stream->fd, F_GETFL);
+        if (stream->flags < 0) {
+            stream->fd = -1;
+            return 0;
+        }
+    }
+    else {
+        stream->fd = open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                          0644);
+    }
+    if (stream->fd < 0) {
+        return 0;
+    }
+
+    int flags = fcntl(stream->fd, F_GETFL);
+    if (flags < 0 || fcntl(stream->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        stream->fd = -1;
+        return 0;
+    }
+
+    stream->start = 0;
+    stream->length = 0;
+    stream->lost = 0;
+
+    return 1;
+}
+
+void streamStart(EventStream *stream, const GameState *state)
+{
+    unsigned char header[sizeof(STREAM_MAGIC) - 1 + 3*VARINT_MAX_SIZE];
+    int size = sizeof(STREAM_MAGIC) - 1;
+
+    memcpy(header, STREAM_MAGIC, (size_t)size);
+    size += putVarint(header + size, STREAM_VERSION);
+    size += putVarint(header + size, (uint64_t)state->width);
+    size += putVarint(header + size, (uint64_t)state->height);
+    appendEvent(stream, header, size);
+
+    writeSync(stream, state);
+}
+
+/* Checked from the biggest change down; one input or tick makes at most
+ * one of them. Lines are counted too, as a lock that clears rows may
+ * leave a board that hashes the same. */
+void streamObserve(EventStream *stream, const GameState *state)
+{
+    if (stream->fd < 0) {
+        return;
+    }
+    if (stream->lost) {
+        if (STREAM_BUFFER_SIZE - stream->length >= SYNC_MAX_SIZE) {
+            stream->lost = 0;
+            writeSync(stream, state);
+        }
+        return;
+    }
+
+    unsigned char event[EVENT_MAX_SIZE];
+    int size = 0;
+
+    if (state->seed != stream->seed) {
+        event[size++] = StreamNewGame;
+        size += putVarint(event + size, state->seed);
+        appendEvent(stream, event, size);
+        appendEvent(stream, event, putSpawn(event, state));
+    }
+    else if (state->boardKey != stream->boardKey ||
+             state->lines != stream->lines) {
+        event[size++] = StreamLock;
+        size += putVarint(event + size,
+                          (uint64_t)(stream->restY - stream->pos.y));
+        appendEvent(stream, event, size);
+
+        if (state->lines != stream->lines) {
+            size = 0;
+            event[size++] = StreamClear;
+            size += putVarint(event + size,
+                              (uint64_t)(state->lines - stream->lines));
+            appendEvent(stream, event, size);
+        }
+
+        if (state->isGameOver) {
+            event[0] = StreamGameOver;
+            appendEvent(stream, event, 1);
+        }
+        else {
+            appendEvent(stream, event, putSpawn(event, state));
+        }
+    }
+    else if (state->storageUsed && !stream->storageUsed) {
+        event[0] = StreamHold;
+        appendEvent(stream, event, 1);
+        appendEvent(stream, event, putSpawn(event, state));
+    }
+    else if (state->figureRotation != stream->rotation) {
+        event[size++] = StreamRotate;
+        size += putVarint(event + size, (uint64_t)state->figureRotation);
+        size += putSigned(event + size, state->figurePos.x - stream->pos.x);
+        size += putSigned(event + size, state->figurePos.y - stream->pos.y);
+        appendEvent(stream, event, size);
+    }
+    else if (state->figurePos.x != stream->pos.x ||
+             state->figurePos.y != stream->pos.y) {
+        event[size++] = StreamMove;
+        size += putSigned(event + size, state->figurePos.x - stream->pos.x);
+        size += putSigned(event + size, state->figurePos.y - stream->pos.y);
+        appendEvent(stream, event, size);
+    }
+    else {
+        return;
+    }
+
+    remember(stream, state);
+}
+
+int streamFlush(EventStream *stream)
+{
+    while (stream->fd >= 0 && stream->length > 0) {
+        ssize_t size = write(stream->fd, stream->buffer + stream->start,
+                             (size_t)stream->length);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* A consumer that went away is not the game's problem. */
+            if (errno != EAGAIN) {
+                streamClose(stream);
+            }
+            break;
+        }
+
+        stream->start += (int)size;
+        stream->length -= (int)size;
+    }
+
+    if (!stream->length) {
+        stream->start = 0;
+    }
+
+    return stream->fd >= 0 && stream->length > 0;
+}
+
+void streamClose(EventStream *stream)
+{
+    if (stream->fd >= 0) {
+        /* Whoever else has the description open sees its flags. */
+        if (stream->flags >= 0) {
+            fcntl(stream->fd, F_SETFL, stream->flags);
+        }
+        close(stream->fd);
+        stream->fd = -1;
+    }
+}
+
+static void writeSync(EventStream *stream, const GameState *state)
+{
+    unsigned char event[SYNC_MAX_SIZE];
+    int size = 0;
+
+    event[size++] = StreamSync;
+    size += putVarint(event + size, state->seed);
+    size += putVarint(event + size, (uint64_t)state->lines);
+    size += putVarint(event + size, figureCode(state->figure));
+    size += putVarint(event + size, (uint64_t)state->figureRotation);
+    size += putSigned(event + size, state->figurePos.x);
+    size += putSigned(event + size, state->figurePos.y);
+    size += putVarint(event + size, figureCode(state->nextFigure));
+    size += putVarint(event + size, figureCode(state->storedFigure));
+    size += putVarint(event + size, (uint64_t)state->isGameOver);
+    size += putVarint(event + size,
+                      (uint64_t)(state->height-1 - state->stackTop));
+
+    int x;
+    int y;
+    for (y = state->stackTop; y < state->height-1; y++) {
+        for (x = 1; x < state->width-1; x++) {
+            int color = state->colors[y][x];
+            event[size++] = (unsigned char)(color > 0 ? color : 0);
+        }
+    }
+
+    appendEvent(stream, event, size);
+    remember(stream, state);
+}
+
+static int putSpawn(unsigned char *event, const GameState *state)
+{
+    int size = 0;
+
+    event[size++] = StreamSpawn;
+    size += putVarint(event + size, figureCode(state->figure));
+    size += putVarint(event + size, figureCode(state->nextFigure));
+
+    return size;
+}
+
+static uint64_t figureCode(Tetromino figure)
+{
+    return figure > TetrominoNone ? (uint64_t)figure : 0;
+}
+
+static int putSigned(unsigned char *buffer, int value)
+{
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+    return putVarint(buffer, zigzag);
+}
+
+/* Whole events or nothing, so the consumer never sees half of one. */
+static void appendEvent(EventStream *stream, const unsigned char *event,
+                        int size)
+{
+    if (stream->lost) {
+        return;
+    }
+    if (stream->length + size > STREAM_BUFFER_SIZE) {
+        stream->lost = 1;
+        return;
+    }
+
+    if (stream->start + stream->length + size > STREAM_BUFFER_SIZE) {
+        memmove(stream->buffer, stream->buffer + stream->start,
+                (size_t)stream->length);
+        stream->start = 0;
+    }
+    memcpy(stream->buffer + stream->start + stream->length, event,
+           (size_t)size);
+    stream->length += size;
+}
+
+static void remember(EventStream *stream, const GameState *state)
+{
+    stream->seed = state->seed;
+    stream->boardKey = state->boardKey;
+    stream->lines = state->lines;
+    stream->figure = state->figure;
+    stream->rotation = state->figureRotation;
+    stream->pos = state->figurePos;
+    stream->restY = state->figurePos.y +
+                    dropDistance(state, &state->figureMask);
+    stream->storageUsed = state->storageUsed;
+    stream->isGameOver = state->isGameOver;
+}
@@ -0,0 +1,83 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/* The stream opens with STREAM_MAGIC, the version, the field width and
+ * height (walls included) and a sync event; after that come events, each
+ * a type byte and its numbers as varints, see protocol.h. Figures go as
+ * their Tetromino, 0 for none, and offsets zigzag encoded. */
+#define STREAM_MAGIC        "TTEV"
+#define STREAM_VERSION      1
+
+/* Room for a few seconds of a consumer that stalls; past that events are
+ * dropped and a sync follows once the consumer catches up. */
+#define STREAM_BUFFER_SIZE  65536
+
+
+typedef enum {
+    /* Seed, lines, figure, its rotation, x and y, next and stored figure,
+     * game over, then the number of rows down from the top of the stack
+     * and a colour per cell inside the walls for each of them. */
+    StreamSync = 'Y',
+    /* The figure, at its spawn position and rotation 0, and the next. */
+    StreamSpawn = 'S',
+    /* Offset in x and y. */
+    StreamMove = 'M',
+    /* New rotation, then the kick as offsets in x and y. */
+    StreamRotate = 'R',
+    /* How far the figure fell first; it is then part of the board. */
+    StreamLock = 'L',
+    /* How many rows the lock filled and cleared. */
+    StreamClear = 'C',
+    /* The figure went to storage, swapped with the stored one; a spawn of
+     * the figure that came out follows. */
+    StreamHold = 'H',
+    /* Empty board and storage, and the new seed; a spawn follows. */
+    StreamNewGame = 'N',
+    StreamGameOver = 'O',
+} StreamEvent;
+
+typedef struct {
+    /* -1 once writing to it failed. */
+    int fd;
+    /* What an inherited fd had before O_NONBLOCK, -1 for a file opened
+     * here. */
+    int flags;
+    int start;
+    int length;
+    /* Events were dropped, so a sync is owed. */
+    int lost;
+
+    /* The game as the stream has told it so far. */
+    unsigned int seed;
+    uint64_t boardKey;
+    int lines;
+    Tetromino figure;
+    int rotation;
+    Point pos;
+    /* Where the figure would lock if it went straight down. */
+    int restY;
+    int storageUsed;
+    int isGameOver;
+
+    unsigned char buffer[STREAM_BUFFER_SIZE];
+} EventStream;
+
+
+/* target is either a file descriptor number above 2 or a path to create.
+ * An inherited fd gets its file status flags back on streamClose(). */
+int streamOpen(EventStream *stream, const char *target);
+void streamStart(EventStream *stream, const GameState *state);
+/* Tells what state changed since the last call. Called after every single
+ * input and tick, so the figure locks where it would have come to rest. */
+void streamObserve(EventStream *stream, const GameState *state);
+/* Writes what the consumer takes without waiting; returns 1 while bytes
+ * are left over. */
+int streamFlush(EventStream *stream);
+void streamClose(EventStream *stream);
+
+#endif
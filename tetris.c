@@ -2,14 +2,64 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <ncurses.h>
 #include <time.h>
-
-
-#define MAX_KEY_COUNT 10
-
-#define FIELD_WIDTH 12
-#define FIELD_HEIGHT 22
+#include <poll.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#include "engine.h"
+#include "profile.h"
+#include "replay.h"
+#include "bot.h"
+#include "search.h"
+#include "snapshot.h"
+#include "stream.h"
+#include "framering.h"
+#include "ansi.h"
+
+
+/* Keys taken in one read; more than anyone presses between two polls. */
+#define MAX_KEY_COUNT 64
+/* Longer than any key's escape sequence, several times over. */
+#define KEY_BUFFER_SIZE 256
+#define MAX_KEY_SEQUENCE_LENGTH 15
+#define MAX_KEY_SEQUENCE_COUNT 16
+
+/* Terminals send no key releases, only the key again at their repeat rate
+ * for as long as it is held. Presses of a key closer together than this
+ * are that repeat, and a held key is let go once the repeat stops. */
+#define KEY_REPEAT_NSEC 80000000LL
+/* Longer than any terminal waits before it starts to repeat. Its first
+ * repeat looks like another press, so a hold only shows with the second,
+ * and presses this close together count as one run. */
+#define KEY_DELAY_NSEC 1000000000LL
+/* Delayed auto-shift and auto-repeat rate of the moves, the delay counted
+ * from the first press of the run. */
+#define DAS_NSEC 170000000LL
+#define ARR_NSEC 50000000LL
+
+#define INPUT_COUNT (InputPause + 1)
+
+#define TICK_NSEC (1000000000L/TICKS_PER_SECOND)
+
+#define PROFILE_REFRESH_NSEC 250000000LL
+
+/* How soon a frame the render thread had no room for is offered again. */
+#define FRAME_RETRY_MSEC 15
+
+#define BOT_MOVE_NSEC 100000000LL
+#define DEFAULT_BOT_PIECES 10000
+
+#define SNAPSHOT_NAME ".tetris-snapshot"
 
 
 #define COLOR_PAIR_I        1
@@ -21,10 +71,11 @@
 #define COLOR_PAIR_Z        7
 #define COLOR_PAIR_SHADOW   8
 #define COLOR_PAIR_SPEED    9
+#define COLOR_PAIR_COUNT    10
 
-#define FIGURE_CELL_COUNT   4
-
-#define SPEEDS_COUNT        6
+/* A field cell shows a character, or a block in a colour pair when this
+ * is set; pair 0 is a block with no colour of its own. */
+#define LOOK_BLOCK          0x1000
 
 #define CBUTTON_DROP        KEY_UP
 #define CBUTTON_RIGHT       KEY_RIGHT
@@ -38,1423 +89,1728 @@
 #define CBUTTON_PAUSE       'p'
 
 
-typedef struct {
-    int x;
-    int y;
-} Point;
-
 typedef struct {
     int height;
     int width;
 } Size;
 
-typedef enum {
-    TetrominoInit = -1,
-    TetrominoNone = 0,
-    TetrominoI = 1,
-    TetrominoO = 2,
-    TetrominoT = 3,
-    TetrominoJ = 4,
-    TetrominoL = 5,
-    TetrominoS = 6,
-    TetrominoZ = 7,
-} Tetromino;
-
-typedef enum {
-    Clockwise,
-    Counterclockwise,
-} Rotation;
+typedef struct {
+    int y;
+    int x;
+    int height;
+    int width;
+} Area;
 
+typedef struct {
+    int key;
+    uint64_t time;
+} KeyEvent;
 
+typedef struct {
+    int key;
+    int length;
+    char text[MAX_KEY_SEQUENCE_LENGTH + 1];
+} KeySequence;
+
+
+void parseArguments(int argc, char **argv);
+void usage(const char *name);
+int replayGame(void);
+int botGame(void);
+int botMove(void);
+void playBot(void);
+int botTimeout(void);
+void initSignals(void);
+void openSnapshot(void);
+void openStream(void);
 void init(void);
+void initTerminal(void);
+void layout(void);
+void initKeys(void);
+void addKeySequence(int key, const char *text);
+void startRender(void);
+void stopRender(void);
+void *renderLoop(void *unused);
+int publishFrame(void);
 void work(void);
-void draw(void);
+void playInputs(const Inputs *inputs);
+void draw(const Frame *frame);
 void kbin(void);
-
+int decodeKey(const unsigned char *bytes, int length, int *key);
+void pressKey(const KeyEvent *event, Inputs *inputs);
+void autoRepeat(void);
+long long repeatWait(void);
+Input keyInput(int key);
+int inputRepeats(Input input);
+void queueInput(Inputs *inputs, Input input);
+void advanceClock(void);
+void updateTimer(void);
+
+void composeField(void);
 void drawField(void);
 void drawScore(void);
+void drawSeed(void);
 void drawSpeed(void);
 void drawShadow(void);
 void drawFigure(void);
 void drawNextFigure(void);
 void drawStoredFigure(void);
+void drawPreview(WINDOW *window, Tetromino figure);
+void drawFieldCell(Point pos, int look);
+void drawFieldText(int y, int x, const char *text);
+int blockLook(int colorPair);
+chtype cursesLook(int look);
+int figureColorPair(Tetromino figure);
+int speedBars(void);
+Point previewPivot(Tetromino figure);
+void drawProfile(const Frame *frame);
+void formatProfileLine(char *buffer, size_t size, int section,
+                       const ProfileStats *stats);
+void drawAnsi(const Frame *frame);
+void drawAnsiLook(int y, int x, int look);
+void drawAnsiPreview(const Area *area, Tetromino figure, const char *title,
+                     int titleX);
+void formatNsec(char *buffer, size_t size, uint64_t nsec);
 
-int keyWasPressed(int key);
-
-void setNewRotationClockwise(void);
-void setNewRotationCounterclockwise(void);
-Point rotatePoint(Point point, Point origin, Rotation direction);
-void rotateClockwise(void);
-void rotateCounterclockwise(void);
-int canBeRotatedClockwise(void);
-int canBeRotatedCounterclockwise(void);
-
-
-int moveUp(void);
-int moveRight(void);
-int moveDown(void);
-int moveLeft(void);
-void dropDown(void);
-int canBeMovedUp(void);
-int canBeMovedRight(void);
-int canBeMovedDown(void);
-int canBeMovedLeft(void);
-
-void deployFigure(void);
-void newFigure(void);
-Tetromino randomTetromino(void);
-
-void checkForFilledLines(void);
-void updateSpeed(void);
-
-int isCellFilled(int x, int y);
-void setCellFilling(int x, int y, int filling);
-
-void newGame(void);
 void exitGame(void);
-void storageFigure(void);
-int moveFigureToDefaultPosition(void);
-void updateShadowPosition(void);
-
-void pauseGame(void);
-
-int *keys;
+void suspendGame(void);
+void closeGame(void);
+void closeScreen(void);
+
+KeyEvent keys[MAX_KEY_COUNT];
+int keyCount;
+/* Bytes of a sequence whose end has not been read yet. */
+unsigned char keyBytes[KEY_BUFFER_SIZE];
+int keyByteCount;
+KeySequence keySequences[MAX_KEY_SEQUENCE_COUNT];
+int keySequenceCount;
+/* Bit per Input whose key the terminal is repeating. */
+uint32_t heldKeys;
+/* Start of the run of presses. */
+uint64_t keyPressed[INPUT_COUNT];
+uint64_t keySeen[INPUT_COUNT];
+uint64_t keyRepeat[INPUT_COUNT];
 
 WINDOW *wField;
 WINDOW *wScore;
 WINDOW *wSpeed;
 WINDOW *wNextFigure;
 WINDOW *wStoredFigure;
+WINDOW *wSeed;
+WINDOW *wProfile;
 
 Size mainWindowSize = {0, 0};
-Size keysWindowSize = {0, 0};
-Size fieldWindowSize = {0, 0};
-Size scoreWindowSize = {0, 0};
-Size speedWindowSize = {0, 0};
-Size nextFigureWindowSize = {0, 0};
-Size storedFigureWindowSize = {0, 0};
 
-int filledCells[FIELD_WIDTH][FIELD_HEIGHT];
+/* Where everything goes on the terminal, for either renderer. */
+Area fieldArea;
+Area scoreArea;
+Area speedArea;
+Area nextFigureArea;
+Area storedFigureArea;
+Area seedArea;
+Area profileArea;
+
+GameState game;
+
+FrameRing frames;
+pthread_t renderThread;
+int renderWake = -1;
+int renderStop;
+/* The game changed but the ring was full. */
+int framePending;
+/* The state in the frame being drawn; the render thread's alone. */
+const GameState *shown;
+
+int fieldLooks[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
+chtype renderedField[MAX_FIELD_HEIGHT][MAX_FIELD_WIDTH];
 
-Tetromino figure;
-Tetromino nextFigure;
-Tetromino storedFigure;
-Point figureCellsPos[FIGURE_CELL_COUNT];
-Point shadowCellsPos[FIGURE_CELL_COUNT];
+int hasColors;
+/* Block colour per pair, the same for curses and ANSI, which number their
+ * colours alike. */
+const short pairColors[COLOR_PAIR_COUNT] = {
+    [COLOR_PAIR_I] = COLOR_CYAN,
+    [COLOR_PAIR_O] = COLOR_YELLOW,
+    [COLOR_PAIR_T] = COLOR_MAGENTA,
+    [COLOR_PAIR_J] = COLOR_BLUE,
+    [COLOR_PAIR_L] = COLOR_WHITE,
+    [COLOR_PAIR_S] = COLOR_GREEN,
+    [COLOR_PAIR_Z] = COLOR_RED,
+    [COLOR_PAIR_SHADOW] = COLOR_BLACK,
+    [COLOR_PAIR_SPEED] = COLOR_RED,
+};
+
+int ansiEnabled;
+AnsiScreen screen;
+struct termios savedTerminal;
+/* Frames the render thread drew. */
+uint64_t renderedFrames;
+
+int timerFd;
+int signalFd = -1;
+
+struct timespec lastClock;
+long clockRemainder;
+long long tickCount;
+
+FILE *profileFile;
+
+int seedGiven;
+unsigned int seed;
+int sizeGiven;
+int fieldWidth = DEFAULT_FIELD_WIDTH;
+int fieldHeight = DEFAULT_FIELD_HEIGHT;
+const char *recordPath;
+const char *replayPath;
+int headless;
+Replay recording;
+
+int botEnabled;
+long botPieces = DEFAULT_BOT_PIECES;
+uint64_t nextBotMove;
+int threadCount;
+/* The beam search instead of the best placement of the current figure
+ * alone, as in tetris-batch. */
+int lookahead;
+Planner *planner;
+
+const char *snapshotPath;
+int resumeGiven;
+Snapshot snapshot = {-1, NULL};
+
+const char *streamTarget;
+EventStream stream = {.fd = -1};
+
+
+int main(int argc, char **argv) {
+    parseArguments(argc, argv);
+    if (replayPath != NULL) {
+        return replayGame();
+    }
+
+    if (!seedGiven) {
+        seed = (unsigned int)time(NULL);
+    }
+    if (!headless) {
+        /* Before the bot's threads start, so they inherit the mask. */
+        initSignals();
+        openSnapshot();
+        openStream();
+    }
+    if (botEnabled && lookahead) {
+        if (!threadCount) {
+            threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        planner = plannerCreate(threadCount);
+        if (planner == NULL) {
+            fprintf(stderr, "cannot start the bot's threads\n");
+            exit(1);
+        }
+    }
+    if (headless) {
+        return botGame();
+    }
+    if (recordPath != NULL &&
+        !replayCreate(&recording, recordPath, seed, fieldWidth, fieldHeight)) {
+        perror(recordPath);
+        exit(1);
+    }
 
-int isGameOver;
-int isPaused;
+    init();
+    if (!resumeGiven) {
+        newGame(&game, seed, fieldWidth, fieldHeight);
+    }
+    if (stream.fd >= 0) {
+        streamStart(&stream, &game);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &lastClock);
+    startRender();
+    /* The first frame puts up everything. */
+    game.fieldRedrawNeeded = 1;
+    framePending = !publishFrame();
+
+    struct pollfd fds[4];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = timerFd;
+    fds[1].events = POLLIN;
+    fds[2].fd = signalFd;
+    fds[2].events = POLLIN;
+    fds[3].events = POLLOUT;
 
-int speed;
-int score;
+    while (1) {
+        updateTimer();
+        /* Only waited on while the consumer is behind. */
+        fds[3].fd = streamFlush(&stream) ? stream.fd : -1;
 
-int fieldRedrawNeeded;
+        int timeout = botEnabled ? botTimeout() : -1;
+        if (framePending && (timeout < 0 || timeout > FRAME_RETRY_MSEC)) {
+            timeout = FRAME_RETRY_MSEC;
+        }
 
-int chanceI;
-int chanceO;
-int chanceT;
-int chanceJ;
-int chanceL;
-int chanceS;
-int chanceZ;
+        if (poll(fds, 4, timeout) < 0) {
+            continue;
+        }
 
-int isMoving;
+        advanceClock();
 
-int storageUsed;
+        /* A dropped connection shows up as either. */
+        if ((fds[0].revents & (POLLHUP | POLLERR)) ||
+            (fds[2].revents & POLLIN)) {
+            suspendGame();
+        }
+        if (fds[0].revents & POLLIN) {
+            PROFILE_BEGIN(kbinStart);
+            kbin();
+            PROFILE_END(ProfileKbin, kbinStart);
+
+            PROFILE_BEGIN(workStart);
+            work();
+            PROFILE_END(ProfileWork, workStart);
+        }
+        autoRepeat();
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+                expirations = 0;
+            }
+        }
+        if (botEnabled) {
+            playBot();
+        }
 
-int hasColors;
+        /* Only the hand-over; the drawing itself is the render thread's
+         * and never holds up the game. */
+        PROFILE_BEGIN(frameStart);
+        framePending = !publishFrame();
+        PROFILE_END(ProfileFrame, frameStart);
+    }
 
-unsigned long workCount = 0;
+    return 0;
+}
 
-int *chances[7] = {&chanceI, &chanceO, &chanceT,
-                   &chanceJ, &chanceL, &chanceS, &chanceZ};
+void parseArguments(int argc, char **argv)
+{
+    static const struct option options[] = {
+        {"profile", required_argument, NULL, 'P'},
+        {"record", required_argument, NULL, 'r'},
+        {"replay", required_argument, NULL, 'R'},
+        {"headless", no_argument, NULL, 'H'},
+        {"seed", required_argument, NULL, 's'},
+        {"bot", no_argument, NULL, 'b'},
+        {"pieces", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 't'},
+        {"lookahead", no_argument, NULL, 'l'},
+        {"size", required_argument, NULL, 'S'},
+        {"resume", no_argument, NULL, 'u'},
+        {"snapshot", required_argument, NULL, 'f'},
+        {"stream", required_argument, NULL, 'e'},
+        {"ansi", no_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 'P':
+                profileFile = fopen(optarg, "w");
+                if (profileFile == NULL) {
+                    perror(optarg);
+                    exit(1);
+                }
+                profilingEnabled = 1;
+                break;
+            case 'r':
+                recordPath = optarg;
+                break;
+            case 'R':
+                replayPath = optarg;
+                break;
+            case 'H':
+                headless = 1;
+                break;
+            case 's':
+                seed = (unsigned int)strtoul(optarg, NULL, 0);
+                seedGiven = 1;
+                break;
+            case 'b':
+                botEnabled = 1;
+                break;
+            case 'n':
+                botPieces = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                threadCount = (int)strtol(optarg, NULL, 0);
+                if (threadCount <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'l':
+                lookahead = 1;
+                break;
+            case 'S':
+                if (!parseFieldSize(optarg, &fieldWidth, &fieldHeight)) {
+                    usage(argv[0]);
+                }
+                sizeGiven = 1;
+                break;
+            case 'u':
+                resumeGiven = 1;
+                break;
+            case 'f':
+                snapshotPath = optarg;
+                break;
+            case 'e':
+                streamTarget = optarg;
+                break;
+            case 'A':
+                ansiEnabled = 1;
+                break;
+            default:
+                usage(argv[0]);
+                break;
+        }
+    }
 
-int speedList[SPEEDS_COUNT] = {25, 20,  15,  10,   5,    1};
-int scoreList[SPEEDS_COUNT] = { 0, 10, 100, 250, 500, 1000};
+    /* Replays always run headless and the bot may. Replays are never
+     * recorded again, and neither are the bot's games.
+     * Only games on a terminal are saved, and a resumed game brings its
+     * own seed and size but not the keys that led up to it. */
+    if (optind < argc || botPieces <= 0 ||
+        (headless && replayPath == NULL && !botEnabled) ||
+        (replayPath != NULL && (!headless || recordPath != NULL ||
+                                seedGiven || sizeGiven || botEnabled)) ||
+        (botEnabled && recordPath != NULL) ||
+        (lookahead && !botEnabled) || (threadCount && !lookahead) ||
+        (headless && (resumeGiven || snapshotPath != NULL ||
+                      streamTarget != NULL || ansiEnabled)) ||
+        (resumeGiven && (seedGiven || sizeGiven || recordPath != NULL))) {
+        usage(argv[0]);
+    }
+}
 
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--seed n] [--size WxH] [--profile file] "
+                    "[--snapshot file]\n"
+                    "           [--stream fd|file] [--ansi] "
+                    "[--record file | --bot [bot options]]\n"
+                    "       %s --resume [--snapshot file] [--profile file] "
+                    "[--stream fd|file]\n"
+                    "           [--ansi] [--bot [bot options]]\n"
+                    "       %s --bot --headless [--seed n] [--size WxH] "
+                    "[--pieces n] [bot options]\n"
+                    "           [--profile file]\n"
+                    "       %s --replay file --headless [--profile file]\n"
+                    "bot options are --lookahead for the beam search, and "
+                    "--threads n for its threads\n"
+                    "sizes are inside the walls, from %dx%d to %dx%d; "
+                    "the default is %dx%d\n",
+            name, name, name, name, MIN_FIELD_WIDTH - 2, MIN_FIELD_HEIGHT - 1,
+            MAX_FIELD_WIDTH - 2, MAX_FIELD_HEIGHT - 1,
+            DEFAULT_FIELD_WIDTH - 2, DEFAULT_FIELD_HEIGHT - 1);
+    exit(1);
+}
 
-int main(void) {
-    init();
-    newGame();
+/* Lets the bot play up to botPieces pieces as fast as it can think, for
+ * soak tests and as a measure of its speed. */
+int botGame(void)
+{
+    newGame(&game, seed, fieldWidth, fieldHeight);
 
-    while (1) {
-        kbin();
-        work();
-        draw();
+    long pieces = 0;
+    uint64_t start = profileClock();
+    while (pieces < botPieces && !game.isGameOver && botMove()) {
+        pieces++;
+    }
+    uint64_t elapsed = profileClock() - start;
+
+    printf("seed %u, %dx%d, %d threads, %ld pieces in %.3f ms, "
+           "%.0f pieces/s\n", seed, fieldWidth - 2, fieldHeight - 1,
+           planner != NULL ? plannerThreadCount(planner) : 1, pieces,
+           (double)elapsed/1e6,
+           elapsed ? (double)pieces*1e9/(double)elapsed : 0.0);
+    printf("score %d, %s\n", game.score,
+           game.isGameOver ? "game over" : "still playing");
 
-        usleep(50000);
+    if (planner != NULL) {
+        TableStats stats;
+        plannerTableStats(planner, &stats);
+        printf("board table: %llu probes, %.1f%% hits, %llu stores\n",
+               (unsigned long long)stats.probes,
+               stats.probes ?
+               100.0*(double)stats.hits/(double)stats.probes : 0.0,
+               (unsigned long long)stats.stores);
     }
 
+    if (profileFile != NULL) {
+        profileWriteHistograms(profileFile);
+        fclose(profileFile);
+    }
+    plannerDestroy(planner);
+
     return 0;
 }
 
-void init(void)
+/* Plays the bot's pick through applyInputs(), as keys would. */
+int botMove(void)
 {
-    srand((unsigned int)time(NULL));
-    initscr();
-    nodelay(stdscr, TRUE);
-    cbreak();
-    curs_set(FALSE);
-    keypad(stdscr, TRUE);
-    noecho();
-
-    keys = malloc(sizeof(*keys)*MAX_KEY_COUNT);
-
-    getmaxyx(stdscr, mainWindowSize.height, mainWindowSize.width);
-
-    Size realFieldSize;
-    realFieldSize.height = 22;
-    realFieldSize.width = 12;
-    wField = newwin(realFieldSize.height, realFieldSize.width,
-                    1, mainWindowSize.width/2 - realFieldSize.width/2);
-    getmaxyx(wField, fieldWindowSize.height, fieldWindowSize.width);
-
-    Size realScoreSize;
-    realScoreSize.height = 3;
-    realScoreSize.width = 8;
-    wScore = newwin(realScoreSize.height, realScoreSize.width,
-            1, mainWindowSize.width/2 -
-            realScoreSize.width/2 +fieldWindowSize.width);
-    getmaxyx(wScore, scoreWindowSize.height, scoreWindowSize.width);
-
-    Size realSpeedSize;
-    realSpeedSize.height = 3;
-    realSpeedSize.width = 8;
-    wSpeed = newwin(realSpeedSize.height, realSpeedSize.width,
-            1, mainWindowSize.width/2 - realSpeedSize.width/2 -
-            fieldWindowSize.width);
-    getmaxyx(wSpeed, speedWindowSize.height, speedWindowSize.width);
-
-    Size realNextFigureSize;
-    realNextFigureSize.height = 6;
-    realNextFigureSize.width = 8;
-    wNextFigure = newwin(realNextFigureSize.height, realNextFigureSize.width,
-            scoreWindowSize.height+1, mainWindowSize.width/2 -
-            realNextFigureSize.width/2 + fieldWindowSize.width);
-    getmaxyx(wNextFigure, nextFigureWindowSize.height,
-             nextFigureWindowSize.width);
-
-    Size realStoredFigureSize;
-    realStoredFigureSize.height = 6;
-    realStoredFigureSize.width = 8;
-    wStoredFigure = newwin(realStoredFigureSize.height, realStoredFigureSize.width,
-            speedWindowSize.height+1, mainWindowSize.width/2 -
-            realStoredFigureSize.width/2 - fieldWindowSize.width);
-    getmaxyx(wStoredFigure, storedFigureWindowSize.height,
-            storedFigureWindowSize.width);
-
-    hasColors = has_colors() == TRUE;
+    Input list[PLACEMENT_INPUT_COUNT + 1];
+    int count;
+    if (planner != NULL) {
+        Plan plan;
+        if (!plannerFindMove(planner, &game, &plan)) {
+            return 0;
+        }
+        count = planInputs(&plan, list);
+    }
+    else {
+        Placement placement;
+        if (!findBestPlacement(&game, &placement)) {
+            return 0;
+        }
+        count = placementInputs(&placement, list);
+    }
 
-    if (hasColors) {
-        start_color();
-        init_pair(COLOR_PAIR_I, COLOR_CYAN, COLOR_CYAN);
-        init_pair(COLOR_PAIR_O, COLOR_YELLOW, COLOR_YELLOW);
-        init_pair(COLOR_PAIR_T, COLOR_MAGENTA, COLOR_MAGENTA);
-        init_pair(COLOR_PAIR_J, COLOR_BLUE, COLOR_BLUE);
-        init_pair(COLOR_PAIR_L, COLOR_WHITE, COLOR_WHITE);
-        init_pair(COLOR_PAIR_S, COLOR_GREEN, COLOR_GREEN);
-        init_pair(COLOR_PAIR_Z, COLOR_RED, COLOR_RED);
-        init_pair(COLOR_PAIR_SHADOW, COLOR_BLACK, COLOR_BLACK);
-        init_pair(COLOR_PAIR_SPEED, COLOR_RED, COLOR_RED);
+    Inputs inputs;
+    inputs.count = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        inputs.list[inputs.count++] = list[i];
+        if (inputs.count == MAX_INPUT_COUNT || i == count-1) {
+            playInputs(&inputs);
+            inputs.count = 0;
+        }
     }
+
+    return 1;
 }
 
-void kbin(void)
+/* One placement every BOT_MOVE_NSEC so the game can be watched; a lost
+ * game is followed by a new one. */
+void playBot(void)
 {
-    memset(keys, 0, sizeof(*keys)*MAX_KEY_COUNT);
+    uint64_t now = profileClock();
+    if (now < nextBotMove || game.isPaused) {
+        return;
+    }
+    nextBotMove = now + BOT_MOVE_NSEC;
 
-    int key;
-    int keyPointer = 0;
-    while ((key = getch()) != ERR) {
-        if (keyPointer < MAX_KEY_COUNT && !keyWasPressed(key)) {
-            switch (key) {
-                case CBUTTON_DROP:
-                case CBUTTON_RIGHT:
-                case CBUTTON_DOWN:
-                case CBUTTON_LEFT:
-                case CBUTTON_ROTCW:
-                case CBUTTON_ROTCCW:
-                case CBUTTON_NEWGAME:
-                case CBUTTON_STORAGE:
-                case CBUTTON_EXIT:
-                case CBUTTON_PAUSE:
-                    keys[keyPointer++] = key;
-                    break;
-            }
-        }
+    if (game.isGameOver) {
+        Inputs inputs;
+        inputs.list[0] = InputNewGame;
+        inputs.count = 1;
+        playInputs(&inputs);
+    }
+    else {
+        PROFILE_BEGIN(start);
+        botMove();
+        PROFILE_END(ProfileWork, start);
     }
 }
 
-
-void draw(void)
+/* Milliseconds poll() may sleep before the bot is due again. */
+int botTimeout(void)
 {
-    drawField();
-    drawScore();
-    drawSpeed();
-    drawNextFigure();
-    drawStoredFigure();
+    uint64_t now = profileClock();
+    if (now >= nextBotMove) {
+        return 0;
+    }
+
+    return (int)((nextBotMove - now + 999999)/1000000);
 }
 
-void drawField(void)
+/* Re-runs a recording through work() as fast as it goes, with no curses
+ * and no waiting, and checks it ends the way the recorded game did. */
+int replayGame(void)
 {
-    if (fieldRedrawNeeded) {
-        wclear(wField);
-        box(wField, ACS_VLINE, ACS_HLINE);
-
-        int x;
-        int y;
-        for (x = 1; x < FIELD_WIDTH-1; x++) {
-            for (y = 0; y < FIELD_HEIGHT-1; y++) {
-                if (isCellFilled(x, y) > 0) {
-                    if (hasColors) {
-                        wattron(wField, COLOR_PAIR(isCellFilled(x, y)));
-                    }
-                    mvwaddch(wField, y, x, ACS_BLOCK);
-                    if (hasColors) {
-                        wattroff(wField, COLOR_PAIR(isCellFilled(x, y)));
-                    }
-                }
-                else if (isCellFilled(x, y) < 0) {
-                    mvwaddch(wField, y, x, ACS_BLOCK);
-                }
-                else {
-                    mvwaddch(wField, y, x, '.');
-                }
-            }
-        }
-        drawShadow();
-        drawFigure();
+    Replay replay;
+    if (!replayOpen(&replay, replayPath, &seed, &fieldWidth, &fieldHeight)) {
+        fprintf(stderr, "%s: not a replay file\n", replayPath);
+        return 1;
+    }
+
+    newGame(&game, seed, fieldWidth, fieldHeight);
 
-        if (isGameOver) {
-            mvwprintw(wField, 0, 2, "GAME OVER");
+    ReplayEvent event;
+    int complete = 0;
+    uint64_t start = profileClock();
+    while (replayRead(&replay, &event)) {
+        while (tickCount < event.tick) {
+            tick(&game);
+            tickCount++;
         }
-        else if (isPaused) {
-            mvwprintw(wField, 0, 3, "PAUSED");
+        if (!event.inputCount) {
+            complete = 1;
+            break;
         }
 
-        touchwin(wField);
-        wrefresh(wField);
+        Inputs inputs;
+        memcpy(inputs.list, event.inputs,
+               sizeof(*event.inputs)*(size_t)event.inputCount);
+        inputs.count = event.inputCount;
+        playInputs(&inputs);
+    }
+    uint64_t elapsed = profileClock() - start;
+    replayClose(&replay);
 
-        fieldRedrawNeeded = 0;
+    if (!complete) {
+        fprintf(stderr, "%s: truncated or corrupt at tick %lld\n",
+                replayPath, tickCount);
+        return 1;
     }
+
+    uint64_t hash = boardHash(&game);
+    int matches = game.score == event.score && hash == event.hash;
+    printf("seed %u, %lld ticks (%.1f s of play) replayed in %.3f ms, "
+           "%.0fx real time\n", seed, tickCount,
+           (double)tickCount/TICKS_PER_SECOND, (double)elapsed/1e6,
+           elapsed ? (double)tickCount*TICK_NSEC/(double)elapsed : 0.0);
+    printf("score %d, board hash %016llx: %s\n", game.score,
+           (unsigned long long)hash, matches ? "match" : "MISMATCH");
+    if (!matches) {
+        printf("recorded score %d, board hash %016llx\n", event.score,
+               (unsigned long long)event.hash);
+    }
+
+    if (profileFile != NULL) {
+        profileWriteHistograms(profileFile);
+        fclose(profileFile);
+    }
+
+    return matches ? 0 : 2;
 }
 
-void drawScore(void)
+/* SIGHUP and SIGTERM are read from signalFd by the main loop rather than
+ * handled, so the game is saved from a known point between inputs. With
+ * no curses to catch it, so is SIGINT under --ansi, for the terminal to
+ * be put back. */
+void initSignals(void)
 {
-    static int oldScore = -1;
-    if (oldScore != score) {
-        oldScore = score;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    if (ansiEnabled) {
+        sigaddset(&signals, SIGINT);
+    }
 
-        wclear(wScore);
-        box(wScore, ACS_VLINE, ACS_HLINE);
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0 ||
+        (signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+}
+
+/* Maps the snapshot file, ~/.tetris-snapshot unless --snapshot names
+ * another, and takes the game from it for --resume. A file another game
+ * has open stops this one, as each would save over and discard the
+ * other's game. Without --resume a file that cannot be opened for any
+ * other reason only means the game will not be saved. */
+void openSnapshot(void)
+{
+    static char defaultPath[4096];
+    if (snapshotPath == NULL) {
+        const char *home = getenv("HOME");
+        snprintf(defaultPath, sizeof(defaultPath), "%s/%s",
+                 home != NULL ? home : ".", SNAPSHOT_NAME);
+        snapshotPath = defaultPath;
+    }
+
+    if (!snapshotOpen(&snapshot, snapshotPath)) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "%s: another game is using it; give this one "
+                            "its own with --snapshot\n", snapshotPath);
+            exit(1);
+        }
+        perror(snapshotPath);
+        if (resumeGiven) {
+            exit(1);
+        }
+        return;
+    }
 
-        mvwprintw(wScore, 1, 1, "%6d", score);
+    if (resumeGiven) {
+        if (!snapshotLoad(&snapshot, &game)) {
+            fprintf(stderr, "%s: no saved game to resume\n", snapshotPath);
+            exit(1);
+        }
+        seed = game.seed;
+        fieldWidth = game.width;
+        fieldHeight = game.height;
+    }
+}
 
-        mvwprintw(wScore, 0, 2, "SCORE");
+/* A consumer that goes away must not take the game with it, so SIGPIPE
+ * is ignored and the write fails instead. */
+void openStream(void)
+{
+    if (streamTarget == NULL) {
+        return;
+    }
 
-        touchwin(wScore);
-        wrefresh(wScore);
+    if (!streamOpen(&stream, streamTarget)) {
+        perror(streamTarget);
+        exit(1);
     }
+    signal(SIGPIPE, SIG_IGN);
 }
 
-void drawSpeed(void)
+void init(void)
 {
-    static int oldSpeed = -1;
-    if (oldSpeed != speed) {
-        oldSpeed = speed;
+    if (ansiEnabled) {
+        initTerminal();
+        hasColors = 1;
+    }
+    else {
+        initscr();
+        cbreak();
+        curs_set(FALSE);
+        keypad(stdscr, TRUE);
+        noecho();
+        /* Clears the terminal once, before any of the game windows go
+         * up. */
+        refresh();
+        getmaxyx(stdscr, mainWindowSize.height, mainWindowSize.width);
+        hasColors = has_colors() == TRUE;
+    }
+    initKeys();
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+        closeScreen();
+        perror("timerfd_create");
+        exit(1);
+    }
+
+    layout();
+    if (fieldArea.x < 0 ||
+        fieldArea.x + fieldArea.width > mainWindowSize.width ||
+        fieldArea.y + fieldArea.height > mainWindowSize.height) {
+        closeScreen();
+        fprintf(stderr, "the terminal is too small for the field\n");
+        exit(1);
+    }
+
+    if (ansiEnabled) {
+        return;
+    }
 
-        wclear(wSpeed);
-        box(wSpeed, ACS_VLINE, ACS_HLINE);
+    wField = newwin(fieldArea.height, fieldArea.width,
+                    fieldArea.y, fieldArea.x);
+    box(wField, ACS_VLINE, ACS_HLINE);
+    wScore = newwin(scoreArea.height, scoreArea.width,
+                    scoreArea.y, scoreArea.x);
+    wSpeed = newwin(speedArea.height, speedArea.width,
+                    speedArea.y, speedArea.x);
+    wNextFigure = newwin(nextFigureArea.height, nextFigureArea.width,
+                         nextFigureArea.y, nextFigureArea.x);
+    wStoredFigure = newwin(storedFigureArea.height, storedFigureArea.width,
+                           storedFigureArea.y, storedFigureArea.x);
+    wSeed = newwin(seedArea.height, seedArea.width, seedArea.y, seedArea.x);
+    if (profilingEnabled) {
+        wProfile = newwin(profileArea.height, profileArea.width,
+                          profileArea.y, profileArea.x);
+    }
 
-        if (hasColors) {
-            wattron(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
-        }
+    if (hasColors) {
+        start_color();
 
         int i;
-        for (i = 0; i < SPEEDS_COUNT; i++) {
-            if (speed <= speedList[i]) {
-                mvwaddch(wSpeed, 1, 1+i, ACS_BLOCK);
-            }
-            else {
-                break;
-            }
+        for (i = 1; i < COLOR_PAIR_COUNT; i++) {
+            init_pair((short)i, pairColors[i], pairColors[i]);
         }
+    }
+}
 
-        if (hasColors) {
-            wattroff(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
+/* The terminal set up by hand for --ansi the way curses does it: keys as
+ * they are typed, not echoed. */
+void initTerminal(void)
+{
+    if (tcgetattr(STDIN_FILENO, &savedTerminal) < 0) {
+        perror("tcgetattr");
+        exit(1);
+    }
+
+    struct termios terminal = savedTerminal;
+    terminal.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+    terminal.c_cc[VMIN] = 1;
+    terminal.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &terminal) < 0) {
+        perror("tcsetattr");
+        exit(1);
+    }
+
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || !size.ws_row) {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+    mainWindowSize.height = size.ws_row;
+    mainWindowSize.width = size.ws_col;
+
+    if (!ansiOpen(&screen, STDOUT_FILENO, mainWindowSize.height,
+                  mainWindowSize.width)) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+        fprintf(stderr, "cannot draw on the terminal\n");
+        exit(1);
+    }
+}
+
+/* The field in the middle, score and next figure to its right, speed and
+ * stored figure to its left. */
+void layout(void)
+{
+    int middle = mainWindowSize.width/2;
+
+    fieldArea = (Area){1, middle - fieldWidth/2, fieldHeight, fieldWidth};
+    scoreArea = (Area){1, middle - 4 + fieldWidth, 3, 8};
+    speedArea = (Area){1, middle - 4 - fieldWidth, 3, 8};
+    nextFigureArea = (Area){scoreArea.y + scoreArea.height,
+                            middle - 4 + fieldWidth, 6, 8};
+    storedFigureArea = (Area){speedArea.y + speedArea.height,
+                              middle - 4 - fieldWidth, 6, 8};
+    seedArea = (Area){fieldHeight + 1, middle - 8, 1, 16};
+    profileArea = (Area){1, middle + fieldWidth/2 + scoreArea.width + 2,
+                         PROFILE_SECTION_COUNT + 3, 23};
+}
+
+/* Escape sequences of the keys that are not plain characters, both from
+ * terminfo and as most terminals send them in either cursor key mode. */
+void initKeys(void)
+{
+    static const struct {
+        int key;
+        const char *capability;
+        const char *fallbacks[2];
+    } names[] = {
+        {KEY_UP, "kcuu1", {"\033[A", "\033OA"}},
+        {KEY_DOWN, "kcud1", {"\033[B", "\033OB"}},
+        {KEY_RIGHT, "kcuf1", {"\033[C", "\033OC"}},
+        {KEY_LEFT, "kcub1", {"\033[D", "\033OD"}},
+        {KEY_F(10), "kf10", {"\033[21~", NULL}},
+    };
+
+    size_t i;
+    for (i = 0; i < sizeof(names)/sizeof(*names); i++) {
+        /* --ansi loads no terminfo and goes by the fallbacks. */
+        const char *text = ansiEnabled ? NULL :
+                           tigetstr(names[i].capability);
+        if (text != NULL && text != (char *)-1) {
+            addKeySequence(names[i].key, text);
         }
 
-        mvwprintw(wSpeed, 0, 2, "SPEED");
+        int j;
+        for (j = 0; j < 2 && names[i].fallbacks[j] != NULL; j++) {
+            addKeySequence(names[i].key, names[i].fallbacks[j]);
+        }
+    }
+}
 
-        touchwin(wSpeed);
-        wrefresh(wSpeed);
+void addKeySequence(int key, const char *text)
+{
+    size_t length = strlen(text);
+    if (keySequenceCount == MAX_KEY_SEQUENCE_COUNT || length < 2 ||
+        length > MAX_KEY_SEQUENCE_LENGTH) {
+        return;
     }
+
+    KeySequence *sequence = &keySequences[keySequenceCount++];
+    sequence->key = key;
+    sequence->length = (int)length;
+    memcpy(sequence->text, text, length + 1);
 }
 
-void drawShadow(void)
+/* Once the game runs, curses belongs to the render thread alone, as it is
+ * not made to be called from two threads; the main loop reads the keys
+ * itself. The thread inherits the blocked signals. */
+void startRender(void)
 {
-    if (hasColors) {
-        wattron(wField, COLOR_PAIR(COLOR_PAIR_SHADOW));
+    frameRingInit(&frames);
+
+    renderWake = eventfd(0, EFD_CLOEXEC);
+    if (renderWake < 0 ||
+        pthread_create(&renderThread, NULL, renderLoop, NULL) != 0) {
+        closeScreen();
+        fprintf(stderr, "cannot start the render thread\n");
+        exit(1);
     }
+}
 
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (shadowCellsPos[i].x >= 0 && shadowCellsPos[i].x >= 0) {
-            mvwaddch(wField, shadowCellsPos[i].y,
-                    shadowCellsPos[i].x, ACS_BLOCK);
-        }
+void stopRender(void)
+{
+    if (renderWake < 0) {
+        return;
     }
 
-    if (hasColors) {
-        wattroff(wField, COLOR_PAIR(COLOR_PAIR_SHADOW));
+    uint64_t wake = 1;
+    __atomic_store_n(&renderStop, 1, __ATOMIC_RELEASE);
+    if (write(renderWake, &wake, sizeof(wake)) < 0) {
+        perror("eventfd");
     }
+    pthread_join(renderThread, NULL);
+
+    close(renderWake);
+    renderWake = -1;
 }
 
-void drawFigure()
+/* Draws only the newest frame there is, so a terminal that falls behind
+ * skips the ones it had no time for. */
+void *renderLoop(void *unused)
 {
-    int colorPair;
+    (void)unused;
 
-    switch (figure) {
-        case TetrominoI:
-            colorPair = COLOR_PAIR_I;
-            break;
-        case TetrominoO:
-            colorPair = COLOR_PAIR_O;
-            break;
-        case TetrominoT:
-            colorPair = COLOR_PAIR_T;
-            break;
-        case TetrominoJ:
-            colorPair = COLOR_PAIR_J;
-            break;
-        case TetrominoL:
-            colorPair = COLOR_PAIR_L;
-            break;
-        case TetrominoS:
-            colorPair = COLOR_PAIR_S;
-            break;
-        case TetrominoZ:
-            colorPair = COLOR_PAIR_Z;
-            break;
-        case TetrominoNone:
-        case TetrominoInit:
-            return;
+    while (!__atomic_load_n(&renderStop, __ATOMIC_ACQUIRE)) {
+        uint64_t wakes;
+        if (read(renderWake, &wakes, sizeof(wakes)) < 0) {
+            continue;
+        }
+
+        const Frame *frame;
+        while (!__atomic_load_n(&renderStop, __ATOMIC_ACQUIRE) &&
+               (frame = frameRingLatest(&frames)) != NULL) {
+            PROFILE_BEGIN(drawStart);
+            draw(frame);
+            PROFILE_END(ProfileDraw, drawStart);
+            frameRingRelease(&frames);
+        }
     }
 
-    if (hasColors) {
-        wattron(wField, COLOR_PAIR(colorPair));
+    return NULL;
+}
+
+/* Copies the game out to the render thread when it changed, with the
+ * profile a few times a second. Returns 0 while every slot is taken; the
+ * change is then still owed. */
+int publishFrame(void)
+{
+    static uint64_t lastRefresh = 0;
+
+    uint64_t now = profileClock();
+    int profileDue = profilingEnabled &&
+                     now - lastRefresh >= PROFILE_REFRESH_NSEC;
+    if (!game.fieldRedrawNeeded && !profileDue) {
+        return 1;
     }
 
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (figureCellsPos[i].x >= 0 && figureCellsPos[i].x >= 0) {
-            mvwaddch(wField, figureCellsPos[i].y,
-                     figureCellsPos[i].x, ACS_BLOCK);
+    Frame *frame = frameRingReserve(&frames);
+    if (frame == NULL) {
+        return 0;
+    }
+
+    frame->state = game;
+    frame->profiled = profileDue;
+    if (profileDue) {
+        lastRefresh = now;
+
+        int i;
+        for (i = 0; i < PROFILE_SECTION_COUNT; i++) {
+            profileGetStats((ProfileSection)i, &frame->profile[i]);
         }
     }
+    frameRingPublish(&frames);
+    game.fieldRedrawNeeded = 0;
 
-    if (hasColors) {
-        wattroff(wField, COLOR_PAIR(colorPair));
+    /* Fails only with the counter about to overflow, when the thread has
+     * plenty of wake-ups waiting already. */
+    uint64_t wake = 1;
+    if (write(renderWake, &wake, sizeof(wake)) < 0) {
+        wake = 0;
     }
+
+    return 1;
 }
 
-void drawNextFigure(void)
+/* Every key counts, the same one pressed twice in a read included; they
+ * all get the time they were read at. A sequence the read cut in two
+ * waits in keyBytes for the rest. */
+void kbin(void)
 {
-    static Tetromino oldNextFigure = TetrominoNone;
-    if (nextFigure != oldNextFigure) {
-        oldNextFigure = nextFigure;
-
-        wclear(wNextFigure);
-        box(wNextFigure, ACS_VLINE, ACS_HLINE);
-
-        int colorPair = -1;
-        Point pos[FIGURE_CELL_COUNT];
-
-        switch (nextFigure) {
-            case TetrominoI:
-                colorPair = COLOR_PAIR_I;
-                pos[0].x = 2;
-                pos[0].y = 3;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoO:
-                colorPair = COLOR_PAIR_O;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 4;
-                pos[1].y = 2;
-                pos[2].x = 3;
-                pos[2].y = 3;
-                pos[3].x = 4;
-                pos[3].y = 3;
-                break;
-            case TetrominoT:
-                colorPair = COLOR_PAIR_T;
-                pos[0].x = 4;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoJ:
-                colorPair = COLOR_PAIR_J;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoL:
-                colorPair = COLOR_PAIR_L;
-                pos[0].x = 5;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoS:
-                colorPair = COLOR_PAIR_S;
-                pos[0].x = 4;
-                pos[0].y = 2;
-                pos[1].x = 5;
-                pos[1].y = 2;
-                pos[2].x = 3;
-                pos[2].y = 3;
-                pos[3].x = 4;
-                pos[3].y = 3;
-                break;
-            case TetrominoZ:
-                colorPair = COLOR_PAIR_Z;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 4;
-                pos[1].y = 2;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoNone:
-            case TetrominoInit:
-                break;
+    uint64_t now = profileClock();
+    keyCount = 0;
+
+    ssize_t size = read(STDIN_FILENO, keyBytes + keyByteCount,
+                        sizeof(keyBytes) - (size_t)keyByteCount);
+    if (size == 0) {
+        suspendGame();
+    }
+    if (size < 0) {
+        return;
+    }
+    keyByteCount += (int)size;
+
+    int start = 0;
+    while (start < keyByteCount) {
+        int key;
+        int used = decodeKey(keyBytes + start, keyByteCount - start, &key);
+        if (!used) {
+            break;
         }
+        start += used;
 
-        if (colorPair >= 0) {
-            if (hasColors) {
-                wattron(wNextFigure, COLOR_PAIR(colorPair));
-            }
+        if (key != ERR && keyCount < MAX_KEY_COUNT) {
+            keys[keyCount].key = key;
+            keys[keyCount].time = now;
+            keyCount++;
+        }
+    }
 
-            int i;
-            for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-                mvwaddch(wNextFigure, pos[i].y, pos[i].x, ACS_BLOCK);
-            }
+    keyByteCount -= start;
+    memmove(keyBytes, keyBytes + start, (size_t)keyByteCount);
+}
 
-            if (hasColors) {
-                wattroff(wNextFigure, COLOR_PAIR(colorPair));
+/* Returns how many bytes the key at the start took, or 0 when they may be
+ * a sequence still coming in. An escape that starts no known sequence is
+ * dropped on its own as ERR. */
+int decodeKey(const unsigned char *bytes, int length, int *key)
+{
+    if (bytes[0] != '\033') {
+        *key = bytes[0];
+        return 1;
+    }
+
+    int partial = 0;
+    int i;
+    for (i = 0; i < keySequenceCount; i++) {
+        const KeySequence *sequence = &keySequences[i];
+        if (sequence->length > length) {
+            if (!memcmp(bytes, sequence->text, (size_t)length)) {
+                partial = 1;
             }
         }
+        else if (!memcmp(bytes, sequence->text, (size_t)sequence->length)) {
+            *key = sequence->key;
+            return sequence->length;
+        }
+    }
+    if (partial) {
+        return 0;
+    }
 
-        mvwprintw(wNextFigure, 0, 2, "NEXT");
+    *key = ERR;
+    return 1;
+}
 
-        touchwin(wNextFigure);
-        wrefresh(wNextFigure);
+/* Runs on the render thread. */
+void draw(const Frame *frame)
+{
+    shown = &frame->state;
+    renderedFrames++;
+
+    composeField();
+    if (ansiEnabled) {
+        drawAnsi(frame);
+        return;
     }
+
+    drawField();
+    drawScore();
+    drawSeed();
+    drawSpeed();
+    drawNextFigure();
+    drawStoredFigure();
+    drawProfile(frame);
+
+    doupdate();
 }
 
-void drawStoredFigure(void)
+/* Lays the field out in fieldLooks, for whichever renderer draws it. */
+void composeField(void)
 {
-    static Tetromino oldStoredFigure = TetrominoNone;
-    if (storedFigure != oldStoredFigure) {
-        oldStoredFigure = storedFigure;
-
-        wclear(wStoredFigure);
-        box(wStoredFigure, ACS_VLINE, ACS_HLINE);
-
-        int colorPair = -1;
-        Point pos[FIGURE_CELL_COUNT];
-
-        switch (storedFigure) {
-            case TetrominoI:
-                colorPair = COLOR_PAIR_I;
-                pos[0].x = 2;
-                pos[0].y = 3;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoO:
-                colorPair = COLOR_PAIR_O;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 4;
-                pos[1].y = 2;
-                pos[2].x = 3;
-                pos[2].y = 3;
-                pos[3].x = 4;
-                pos[3].y = 3;
-                break;
-            case TetrominoT:
-                colorPair = COLOR_PAIR_T;
-                pos[0].x = 4;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoJ:
-                colorPair = COLOR_PAIR_J;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoL:
-                colorPair = COLOR_PAIR_L;
-                pos[0].x = 5;
-                pos[0].y = 2;
-                pos[1].x = 3;
-                pos[1].y = 3;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoS:
-                colorPair = COLOR_PAIR_S;
-                pos[0].x = 4;
-                pos[0].y = 2;
-                pos[1].x = 5;
-                pos[1].y = 2;
-                pos[2].x = 3;
-                pos[2].y = 3;
-                pos[3].x = 4;
-                pos[3].y = 3;
-                break;
-            case TetrominoZ:
-                colorPair = COLOR_PAIR_Z;
-                pos[0].x = 3;
-                pos[0].y = 2;
-                pos[1].x = 4;
-                pos[1].y = 2;
-                pos[2].x = 4;
-                pos[2].y = 3;
-                pos[3].x = 5;
-                pos[3].y = 3;
-                break;
-            case TetrominoNone:
-            case TetrominoInit:
-                break;
-        }
-
-        if (colorPair >= 0) {
-            if (hasColors) {
-                wattron(wStoredFigure, COLOR_PAIR(colorPair));
+    int x;
+    int y;
+    for (y = 0; y < shown->height-1; y++) {
+        for (x = 1; x < shown->width-1; x++) {
+            int color = isCellFilled(shown, x, y);
+            if (color > 0) {
+                fieldLooks[y][x] = blockLook(color);
             }
-
-            int i;
-            for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-                mvwaddch(wStoredFigure, pos[i].y, pos[i].x, ACS_BLOCK);
+            else if (color < 0) {
+                fieldLooks[y][x] = blockLook(0);
             }
-
-            if (hasColors) {
-                wattroff(wStoredFigure, COLOR_PAIR(colorPair));
+            else {
+                fieldLooks[y][x] = '.';
             }
         }
+    }
+    drawShadow();
+    drawFigure();
 
-        mvwprintw(wStoredFigure, 0, 1, "STORED");
-
-        touchwin(wStoredFigure);
-        wrefresh(wStoredFigure);
+    if (shown->isGameOver) {
+        drawFieldText(0, 2, "GAME OVER");
+    }
+    else if (shown->isPaused) {
+        drawFieldText(0, 3, "PAUSED");
     }
 }
 
-void work(void)
+/* Sends only the cells that differ from what is already on the
+ * terminal. */
+void drawField(void)
 {
-    int i = 0;
-    while (i < MAX_KEY_COUNT && keys[i] != 0) {
-        switch (keys[i]) {
-            case CBUTTON_EXIT:
-                exitGame();
-                break;
-            case CBUTTON_ROTCCW:
-                rotateCounterclockwise();
-                break;
-            case CBUTTON_ROTCW:
-                rotateClockwise();
-                break;
-            case CBUTTON_DROP:
-                dropDown();
-                break;
-            case CBUTTON_LEFT:
-                moveLeft();
-                break;
-            case CBUTTON_DOWN:
-                moveDown();
-                break;
-            case CBUTTON_RIGHT:
-                moveRight();
-                break;
-            case CBUTTON_PAUSE:
-                pauseGame();
-                break;
-            case CBUTTON_NEWGAME:
-                newGame();
-                break;
-            case CBUTTON_STORAGE:
-                storageFigure();
-                break;
+    int x;
+    int y;
+    for (y = 0; y < shown->height-1; y++) {
+        for (x = 1; x < shown->width-1; x++) {
+            chtype look = cursesLook(fieldLooks[y][x]);
+            if (look != renderedField[y][x]) {
+                mvwaddch(wField, y, x, look);
+                renderedField[y][x] = look;
+            }
         }
-        i++;
     }
 
-    if (!isGameOver && !isPaused && !(workCount%speed)) {
-        if (!moveDown() && !isMoving) {
-            deployFigure();
-        }
+    wnoutrefresh(wField);
+}
+
+void drawScore(void)
+{
+    static int oldScore = -1;
+    if (oldScore != shown->score) {
+        oldScore = shown->score;
+
+        werase(wScore);
+        box(wScore, ACS_VLINE, ACS_HLINE);
+
+        mvwprintw(wScore, 1, 1, "%6d", shown->score);
+
+        mvwprintw(wScore, 0, 2, "SCORE");
+
+        wnoutrefresh(wScore);
     }
+}
+
+/* The seed of the game on screen; a new game shows the one it got. */
+void drawSeed(void)
+{
+    static long long oldSeed = -1;
+    if (oldSeed != shown->seed) {
+        oldSeed = shown->seed;
+
+        werase(wSeed);
+        mvwprintw(wSeed, 0, 0, "SEED %u", shown->seed);
 
-    if (isMoving > 0) {
-        isMoving--;
+        wnoutrefresh(wSeed);
     }
+}
 
-    workCount++;
+void drawSpeed(void)
+{
+    static int oldSpeed = -1;
+    if (oldSpeed != shown->speed) {
+        oldSpeed = shown->speed;
+
+        werase(wSpeed);
+        box(wSpeed, ACS_VLINE, ACS_HLINE);
+
+        if (hasColors) {
+            wattron(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
+        }
+
+        int bars = speedBars();
+        int i;
+        for (i = 0; i < bars; i++) {
+            mvwaddch(wSpeed, 1, 1+i, ACS_BLOCK);
+        }
+
+        if (hasColors) {
+            wattroff(wSpeed, COLOR_PAIR(COLOR_PAIR_SPEED));
+        }
+
+        mvwprintw(wSpeed, 0, 2, "SPEED");
+
+        wnoutrefresh(wSpeed);
+    }
 }
 
-void setNewRotationClockwise(void)
+void drawShadow(void)
 {
     int i;
-    for (i = 1; i < FIGURE_CELL_COUNT; i++) {
-        figureCellsPos[i] = rotatePoint(figureCellsPos[i], figureCellsPos[0],
-                                        Clockwise);
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        drawFieldCell(shown->shadowCellsPos[i], blockLook(COLOR_PAIR_SHADOW));
     }
-
-    updateShadowPosition();
-
-    isMoving = 15;
-    fieldRedrawNeeded = 1;
 }
 
-void setNewRotationCounterclockwise(void)
+void drawFigure(void)
 {
+    int colorPair = figureColorPair(shown->figure);
+    if (colorPair < 0) {
+        return;
+    }
+
     int i;
-    for (i = 1; i < FIGURE_CELL_COUNT; i++) {
-        figureCellsPos[i] = rotatePoint(figureCellsPos[i], figureCellsPos[0],
-                                        Counterclockwise);
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        drawFieldCell(shown->figureCellsPos[i], blockLook(colorPair));
     }
+}
 
-    updateShadowPosition();
+void drawFieldCell(Point pos, int look)
+{
+    if (pos.x >= 1 && pos.x < shown->width-1 &&
+        pos.y >= 0 && pos.y < shown->height-1) {
+        fieldLooks[pos.y][pos.x] = look;
+    }
+}
 
-    isMoving = 15;
-    fieldRedrawNeeded = 1;
+void drawFieldText(int y, int x, const char *text)
+{
+    for (; *text && x < shown->width-1; text++, x++) {
+        fieldLooks[y][x] = (unsigned char)*text;
+    }
 }
 
-Point rotatePoint(Point point, Point origin, Rotation direction)
+int blockLook(int colorPair)
 {
-    Point retVal;
-
-    retVal.x = origin.y - point.y;
-    retVal.y = origin.x - point.x;
+    return LOOK_BLOCK | colorPair;
+}
 
-    switch (direction) {
-        case Clockwise:
-            retVal.y = -retVal.y;
-            break;
-        case Counterclockwise:
-            retVal.x = -retVal.x;
-            break;
+chtype cursesLook(int look)
+{
+    if (!(look & LOOK_BLOCK)) {
+        return (chtype)look;
     }
 
-    retVal.x += origin.x;
-    retVal.y += origin.y;
+    int colorPair = look & ~LOOK_BLOCK;
+    if (hasColors && colorPair) {
+        return ACS_BLOCK | COLOR_PAIR(colorPair);
+    }
 
-    return retVal;
+    return ACS_BLOCK;
 }
 
-void rotateClockwise(void)
+void drawNextFigure(void)
 {
-    if (isGameOver || isPaused) {
-        return;
-    }
+    static Tetromino oldNextFigure = TetrominoNone;
+    if (shown->nextFigure != oldNextFigure) {
+        oldNextFigure = shown->nextFigure;
 
-    if (figure == TetrominoO) {
-        return;
-    }
+        drawPreview(wNextFigure, shown->nextFigure);
+        mvwprintw(wNextFigure, 0, 2, "NEXT");
 
-    if (canBeRotatedClockwise()) {
-        setNewRotationClockwise();
-        return;
+        wnoutrefresh(wNextFigure);
     }
+}
 
-    moveLeft();
-    if (canBeRotatedClockwise()) {
-        setNewRotationClockwise();
-        return;
-    }
-    moveRight();
+void drawStoredFigure(void)
+{
+    static Tetromino oldStoredFigure = TetrominoNone;
+    if (shown->storedFigure != oldStoredFigure) {
+        oldStoredFigure = shown->storedFigure;
 
-    moveRight();
-    if (canBeRotatedClockwise()) {
-        setNewRotationClockwise();
-        return;
-    }
-    moveLeft();
+        drawPreview(wStoredFigure, shown->storedFigure);
+        mvwprintw(wStoredFigure, 0, 1, "STORED");
 
-    moveUp();
-    if (canBeRotatedClockwise()) {
-        setNewRotationClockwise();
-        return;
+        wnoutrefresh(wStoredFigure);
     }
-    moveDown();
 }
 
-void rotateCounterclockwise(void)
+void drawPreview(WINDOW *window, Tetromino figure)
 {
-    if (isGameOver || isPaused) {
-        return;
-    }
+    werase(window);
+    box(window, ACS_VLINE, ACS_HLINE);
 
-    if (figure == TetrominoO) {
+    int colorPair = figureColorPair(figure);
+    if (colorPair < 0) {
         return;
     }
 
-    if (canBeRotatedCounterclockwise()) {
-        setNewRotationCounterclockwise();
-        return;
-    }
+    const Point *shape = figureShape(figure, 0);
+    Point pivot = previewPivot(figure);
 
-    moveLeft();
-    if (canBeRotatedCounterclockwise()) {
-        setNewRotationCounterclockwise();
-        return;
+    if (hasColors) {
+        wattron(window, COLOR_PAIR(colorPair));
     }
-    moveRight();
 
-    moveRight();
-    if (canBeRotatedCounterclockwise()) {
-        setNewRotationCounterclockwise();
-        return;
+    int i;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        mvwaddch(window, pivot.y + shape[i].y, pivot.x + shape[i].x,
+                 ACS_BLOCK);
     }
-    moveLeft();
 
-    moveUp();
-    if (canBeRotatedCounterclockwise()) {
-        setNewRotationCounterclockwise();
-        return;
+    if (hasColors) {
+        wattroff(window, COLOR_PAIR(colorPair));
     }
-    moveDown();
 }
 
-int canBeRotatedClockwise(void)
+/* Spawn orientation, shifted from the field's spawn point into the middle
+ * of the preview window. */
+Point previewPivot(Tetromino figure)
 {
-    int i;
-    for (i = 1; i < FIGURE_CELL_COUNT; i++) {
-        Point p = rotatePoint(figureCellsPos[i], figureCellsPos[0],
-                              Clockwise);
-        if (isCellFilled(p.x, p.y)) {
-            return 0;
-        }
-    }
+    Point pivot = figureSpawnPosition(figure, DEFAULT_FIELD_WIDTH);
+    pivot.x -= 2;
+    pivot.y = 3;
 
-    return 1;
+    return pivot;
 }
 
-int canBeRotatedCounterclockwise(void)
+int figureColorPair(Tetromino figure)
 {
-    int i;
-    for (i = 1; i < FIGURE_CELL_COUNT; i++) {
-        Point p = rotatePoint(figureCellsPos[i], figureCellsPos[0],
-                              Counterclockwise);
-        if (isCellFilled(p.x, p.y)) {
-            return 0;
-        }
+    switch (figure) {
+        case TetrominoI:
+            return COLOR_PAIR_I;
+        case TetrominoO:
+            return COLOR_PAIR_O;
+        case TetrominoT:
+            return COLOR_PAIR_T;
+        case TetrominoJ:
+            return COLOR_PAIR_J;
+        case TetrominoL:
+            return COLOR_PAIR_L;
+        case TetrominoS:
+            return COLOR_PAIR_S;
+        case TetrominoZ:
+            return COLOR_PAIR_Z;
+        case TetrominoNone:
+        case TetrominoInit:
+            break;
     }
 
-    return 1;
+    return -1;
 }
 
-int moveUp(void)
+/* The speed meter fills a bar per speed reached. */
+int speedBars(void)
 {
-    if (isGameOver || isPaused) {
-        return 0;
-    }
-
-    if (canBeMovedUp()) {
-        int i;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            figureCellsPos[i].y--;
+    int i;
+    for (i = 0; i < SPEEDS_COUNT; i++) {
+        if (shown->speed < speedList[i]) {
+            break;
         }
-
-        isMoving = 15;
-        fieldRedrawNeeded = 1;
-        return 1;
     }
 
-    return 0;
+    return i;
 }
 
-int moveRight(void)
+void work(void)
 {
-    if (isGameOver || isPaused) {
-        return 0;
-    }
+    Inputs inputs;
+    inputs.count = 0;
 
-    if (canBeMovedRight()) {
-        int i;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            figureCellsPos[i].x++;
+    int i;
+    for (i = 0; i < keyCount; i++) {
+        if (keys[i].key == CBUTTON_EXIT) {
+            exitGame();
         }
-
-        updateShadowPosition();
-
-        isMoving = 15;
-        fieldRedrawNeeded = 1;
-        return 1;
+        pressKey(&keys[i], &inputs);
     }
 
-    return 0;
+    playInputs(&inputs);
 }
 
-int moveDown(void)
+/* A press acts at once. A repeat of a move starts its auto-shift; repeats
+ * of the other keys do nothing. Twice in the same read is two presses,
+ * unless the key is already held. */
+void pressKey(const KeyEvent *event, Inputs *inputs)
 {
-    if (isGameOver || isPaused) {
-        return 0;
+    Input input = keyInput(event->key);
+    if (input == InputNone) {
+        return;
     }
 
-    if (canBeMovedDown()) {
-        int i;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            figureCellsPos[i].y++;
+    uint32_t bit = 1u << input;
+    uint64_t gap = event->time - keySeen[input];
+    keySeen[input] = event->time;
+    if (gap > KEY_REPEAT_NSEC || (!gap && !(heldKeys & bit))) {
+        heldKeys &= ~bit;
+        if (gap > KEY_DELAY_NSEC) {
+            keyPressed[input] = event->time;
         }
-
-        isMoving = 15;
-        fieldRedrawNeeded = 1;
-        return 1;
-    }
-
-    return 0;
-}
-
-int moveLeft(void)
-{
-    if (isGameOver || isPaused) {
-        return 0;
+        queueInput(inputs, input);
+        return;
     }
 
-    if (canBeMovedLeft()) {
-        int i;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            figureCellsPos[i].x--;
+    if (inputRepeats(input) && !(heldKeys & bit)) {
+        heldKeys |= bit;
+        keyRepeat[input] = keyPressed[input] + DAS_NSEC;
+        if (keyRepeat[input] < event->time) {
+            keyRepeat[input] = event->time;
         }
-
-        updateShadowPosition();
-
-        isMoving = 15;
-        fieldRedrawNeeded = 1;
-        return 1;
     }
-
-    return 0;
 }
 
-void dropDown(void)
+/* Held moves fall due on the clock rather than with the next key the
+ * terminal sends, and updateTimer() wakes the loop for them. */
+void autoRepeat(void)
 {
-    if (isGameOver || isPaused) {
+    if (!heldKeys) {
         return;
     }
 
-    if (isGameOver || isPaused) {
-        return;
-    }
+    uint64_t now = profileClock();
+    Inputs inputs;
+    inputs.count = 0;
 
-    while (canBeMovedDown()) {
-        int i;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            figureCellsPos[i].y++;
+    int input;
+    for (input = 0; input < INPUT_COUNT; input++) {
+        uint32_t bit = 1u << input;
+        if (!(heldKeys & bit)) {
+            continue;
+        }
+        if (now - keySeen[input] > KEY_REPEAT_NSEC) {
+            heldKeys &= ~bit;
+            continue;
+        }
+        while (keyRepeat[input] <= now) {
+            queueInput(&inputs, (Input)input);
+            keyRepeat[input] += ARR_NSEC;
         }
-
-        fieldRedrawNeeded = 1;
     }
 
-    deployFigure();
+    playInputs(&inputs);
 }
 
-int canBeMovedUp(void)
+/* Nanoseconds until the next held move, or -1 with no key held. */
+long long repeatWait(void)
 {
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (figureCellsPos[i].y-1 < 0) {
-            return 0;
-        }
-
-        if (isCellFilled(figureCellsPos[i].x, figureCellsPos[i].y-1)) {
-            return 0;
+    uint64_t now = profileClock();
+    long long wait = -1;
+
+    int input;
+    for (input = 0; input < INPUT_COUNT; input++) {
+        if (heldKeys & 1u << input) {
+            long long left = keyRepeat[input] > now ?
+                             (long long)(keyRepeat[input] - now) : 0;
+            if (wait < 0 || left < wait) {
+                wait = left;
+            }
         }
     }
-    return 1;
+
+    return wait;
 }
 
-int canBeMovedRight(void)
+Input keyInput(int key)
 {
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (figureCellsPos[i].x+1 >= FIELD_WIDTH) {
-            return 0;
-        }
-        if (isCellFilled(figureCellsPos[i].x+1, figureCellsPos[i].y)) {
-            return 0;
-        }
-    }
-    return 1;
+    switch (key) {
+        case CBUTTON_ROTCCW:
+            return InputRotateCounterclockwise;
+        case CBUTTON_ROTCW:
+            return InputRotateClockwise;
+        case CBUTTON_DROP:
+            return InputDrop;
+        case CBUTTON_LEFT:
+            return InputLeft;
+        case CBUTTON_DOWN:
+            return InputDown;
+        case CBUTTON_RIGHT:
+            return InputRight;
+        case CBUTTON_PAUSE:
+            return InputPause;
+        case CBUTTON_NEWGAME:
+            return InputNewGame;
+        case CBUTTON_STORAGE:
+            return InputStorage;
+    }
+
+    return InputNone;
 }
 
-int canBeMovedDown(void)
+int inputRepeats(Input input)
 {
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (figureCellsPos[i].y-1 >= FIELD_HEIGHT) {
-            return 0;
-        }
-        if (isCellFilled(figureCellsPos[i].x, figureCellsPos[i].y+1)) {
-            return 0;
-        }
-    }
-    return 1;
+    return input == InputLeft || input == InputRight || input == InputDown;
 }
 
-int canBeMovedLeft(void)
+/* Full batches are played right away, so none is ever dropped. */
+void queueInput(Inputs *inputs, Input input)
 {
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (figureCellsPos[i].x-1 < 0) {
-            return 0;
-        }
-        if (isCellFilled(figureCellsPos[i].x-1, figureCellsPos[i].y)) {
-            return 0;
-        }
+    inputs->list[inputs->count++] = input;
+    if (inputs->count == MAX_INPUT_COUNT) {
+        playInputs(inputs);
+        inputs->count = 0;
     }
-    return 1;
 }
 
-
-int keyWasPressed(int key)
+/* Where every input of a live game goes, to be recorded. A streamed game
+ * takes them one at a time, for the stream to see what each of them did. */
+void playInputs(const Inputs *inputs)
 {
-    int i = 0;
-    while (i < MAX_KEY_COUNT && keys[i] != 0) {
-        if (keys[i] == key) {
-            return 1;
-        }
-        i++;
+    if (recording.file != NULL) {
+        replayWriteInputs(&recording, tickCount, inputs->list,
+                          inputs->count);
     }
 
-    return 0;
-}
+    if (stream.fd < 0) {
+        applyInputs(&game, inputs);
+        return;
+    }
 
-void deployFigure(void)
-{
     int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        setCellFilling(figureCellsPos[i].x, figureCellsPos[i].y, figure);
+    for (i = 0; i < inputs->count; i++) {
+        Inputs single;
+        single.list[0] = inputs->list[i];
+        single.count = 1;
+        applyInputs(&game, &single);
+        streamObserve(&stream, &game);
     }
-    storageUsed = 0;
-    workCount = 0;
-    checkForFilledLines();
-    newFigure();
 }
 
-void newFigure(void)
+/* Runs as many fixed ticks as real time has passed since the last call,
+ * carrying the sub-tick remainder over. */
+void advanceClock(void)
 {
-    if (nextFigure == TetrominoInit || nextFigure == TetrominoNone) {
-        nextFigure = randomTetromino();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long elapsed = (now.tv_sec - lastClock.tv_sec)*1000000000LL +
+                        (now.tv_nsec - lastClock.tv_nsec) + clockRemainder;
+    lastClock = now;
+    clockRemainder = 0;
+
+    if (elapsed >= TICK_NSEC && ticksUntilGravity(&game) >= 0) {
+        PROFILE_BEGIN(start);
+        while (elapsed >= TICK_NSEC && ticksUntilGravity(&game) >= 0) {
+            tick(&game);
+            streamObserve(&stream, &game);
+            tickCount++;
+            elapsed -= TICK_NSEC;
+        }
+        PROFILE_END(ProfileWork, start);
     }
 
-    figure = nextFigure;
-    nextFigure = randomTetromino();
-
-    moveFigureToDefaultPosition();
-    updateShadowPosition();
-    fieldRedrawNeeded = 1;
-
-    if (!canBeMovedDown()) {
-        isGameOver = 1;
+    if (ticksUntilGravity(&game) >= 0) {
+        clockRemainder = (long)elapsed;
     }
 }
 
-Tetromino randomTetromino(void)
+/* Wakes the loop exactly when gravity is next due. Nothing is armed while
+ * the game is paused or over, so an idle game sleeps in poll(). */
+void updateTimer(void)
 {
-    Tetromino tetramino = TetrominoNone;
-
-    int total = 0;
-
-    do {
-        total = chanceI + chanceO + chanceT +
-                chanceJ + chanceL + chanceS + chanceZ;
-        if (total == 0) {
-            chanceI = 15;
-            chanceO = 15;
-            chanceT = 15;
-            chanceJ = 15;
-            chanceL = 15;
-            chanceS = 15;
-            chanceZ = 15;
-
-        }
-    } while (total == 0);
-
-    int value = rand()%total;
-
-    chanceI += 2;
-    chanceO += 2;
-    chanceT += 2;
-    chanceJ += 2;
-    chanceL += 2;
-    chanceS += 2;
-    chanceZ += 2;
-
-    int dChance = 0;
-    int *pChance = NULL;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
 
-    if (value < chanceI) {
-        tetramino = TetrominoI;
-        pChance = &chanceI;
-    }
-    else if (value < (chanceI + chanceO)) {
-        tetramino = TetrominoO;
-        pChance = &chanceO;
-    }
-    else if (value < (chanceI + chanceO + chanceT)) {
-        tetramino = TetrominoT;
-        pChance = &chanceT;
-    }
-    else if (value < (chanceI + chanceO + chanceT + chanceJ)) {
-        tetramino = TetrominoJ;
-        pChance = &chanceJ;
-    }
-    else if (value < (chanceI + chanceO + chanceT + chanceJ + chanceL)) {
-        tetramino = TetrominoL;
-        pChance = &chanceL;
+    long long wait = -1;
+    int ticks = ticksUntilGravity(&game);
+    if (ticks >= 0) {
+        wait = (long long)ticks*TICK_NSEC - clockRemainder;
     }
-    else if (value < (chanceI + chanceO + chanceT + chanceJ + chanceL +
-                      chanceS)) {
-        tetramino = TetrominoS;
-        pChance = &chanceS;
+    long long repeat = repeatWait();
+    if (repeat >= 0 && (wait < 0 || repeat < wait)) {
+        wait = repeat;
     }
-    else if (value < (chanceI + chanceO + chanceT + chanceJ + chanceL +
-                      chanceS + chanceZ)) {
-        tetramino = TetrominoZ;
-        pChance = &chanceZ;
+    if (wait >= 0) {
+        if (wait < 1) {
+            wait = 1;
+        }
+        spec.it_value.tv_sec = (time_t)(wait/1000000000LL);
+        spec.it_value.tv_nsec = (long)(wait%1000000000LL);
     }
 
-    if (pChance != NULL) {
-        *pChance -= 14;
-        if (*pChance < 0)  {
-            dChance = -*pChance;
-            *pChance = 0;
-        }
+    timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+/* Live min/avg/p99 per section, from the frames that carry them. */
+void drawProfile(const Frame *frame)
+{
+    if (wProfile == NULL || !frame->profiled) {
+        return;
     }
 
-    while (dChance) {
-        int i = rand()%7;
+    werase(wProfile);
+    box(wProfile, ACS_VLINE, ACS_HLINE);
+    mvwprintw(wProfile, 0, 2, "PROFILE");
+    mvwprintw(wProfile, 1, 1, "%-6s%5s%5s%5s", "", "min", "avg", "p99");
 
-        if (*chances[i] > 0) {
-            (*chances[i])--;
-            dChance--;
-        }
+    int i;
+    for (i = 0; i < PROFILE_SECTION_COUNT; i++) {
+        char line[32];
+        formatProfileLine(line, sizeof(line), i, &frame->profile[i]);
+        mvwprintw(wProfile, 2+i, 1, "%s", line);
     }
 
-    return tetramino;
+    wnoutrefresh(wProfile);
 }
 
-void checkForFilledLines(void)
+void formatProfileLine(char *buffer, size_t size, int section,
+                       const ProfileStats *stats)
 {
-    int filledCount = 0;
-    int x;
-    int y;
-    for (y = FIELD_HEIGHT-2; y > 0; y--) {
-        int filled = 1;
-        for (x = 1; x < FIELD_WIDTH-1; x++) {
-            if (!isCellFilled(x, y)) {
-                filled = 0;
-                break;
-            }
-        }
-        if (filled) {
-            filledCount++;
-            int xx;
-            int yy;
-            for (yy = y; yy > 0; yy--) {
-                for (xx = 1; xx < FIELD_WIDTH-1; xx++) {
-                    setCellFilling(xx, yy, isCellFilled(xx, yy-1));
-                }
-            }
-            y++;
-        }
-    }
-    switch (filledCount) {
-        case 1:
-            score += 1;
-            updateSpeed();
-            break;
-        case 2:
-            score += 3;
-            updateSpeed();
-            break;
-        case 3:
-            score += 7;
-            updateSpeed();
-            break;
-        case 4:
-            score += 15;
-            updateSpeed();
-            break;
-        default:
-            break;
-    }
-
-    fieldRedrawNeeded = 1;
+    char min[8];
+    char avg[8];
+    char p99[8];
+
+    formatNsec(min, sizeof(min), stats->min);
+    formatNsec(avg, sizeof(avg), stats->avg);
+    formatNsec(p99, sizeof(p99), stats->p99);
+    snprintf(buffer, size, "%-6s%5s%5s%5s",
+             profileSectionName((ProfileSection)section), min, avg, p99);
 }
 
-void updateSpeed(void)
+/* The same screen as the curses windows, put together whole each frame;
+ * ansiFlush() works out what changed. */
+void drawAnsi(const Frame *frame)
 {
+    char text[32];
+    int x;
+    int y;
     int i;
-    for (i = 0; i < SPEEDS_COUNT; i++) {
-        if (score > scoreList[i]) {
-            speed = speedList[i];
-        }
-        else {
-            break;
+
+    ansiBox(&screen, fieldArea.y, fieldArea.x, fieldArea.height,
+            fieldArea.width);
+    for (y = 0; y < shown->height-1; y++) {
+        for (x = 1; x < shown->width-1; x++) {
+            drawAnsiLook(fieldArea.y + y, fieldArea.x + x, fieldLooks[y][x]);
         }
     }
-}
 
-int isCellFilled(int x, int y)
-{
-    if (x < 0 || y < 0 || x >= FIELD_WIDTH || y >= FIELD_HEIGHT) {
-        return 0;
+    ansiBox(&screen, scoreArea.y, scoreArea.x, scoreArea.height,
+            scoreArea.width);
+    snprintf(text, sizeof(text), "%6d", shown->score);
+    ansiText(&screen, scoreArea.y + 1, scoreArea.x + 1, text, 0);
+    ansiText(&screen, scoreArea.y, scoreArea.x + 2, "SCORE", 0);
+
+    ansiBox(&screen, speedArea.y, speedArea.x, speedArea.height,
+            speedArea.width);
+    int bars = speedBars();
+    for (i = 0; i < bars; i++) {
+        drawAnsiLook(speedArea.y + 1, speedArea.x + 1 + i,
+                     blockLook(COLOR_PAIR_SPEED));
+    }
+    ansiText(&screen, speedArea.y, speedArea.x + 2, "SPEED", 0);
+
+    drawAnsiPreview(&nextFigureArea, shown->nextFigure, "NEXT", 2);
+    drawAnsiPreview(&storedFigureArea, shown->storedFigure, "STORED", 1);
+
+    snprintf(text, sizeof(text), "SEED %-11u", shown->seed);
+    ansiText(&screen, seedArea.y, seedArea.x, text, 0);
+
+    if (frame->profiled) {
+        ansiBox(&screen, profileArea.y, profileArea.x, profileArea.height,
+                profileArea.width);
+        ansiText(&screen, profileArea.y, profileArea.x + 2, "PROFILE", 0);
+        snprintf(text, sizeof(text), "%-6s%5s%5s%5s", "", "min", "avg",
+                 "p99");
+        ansiText(&screen, profileArea.y + 1, profileArea.x + 1, text, 0);
+        for (i = 0; i < PROFILE_SECTION_COUNT; i++) {
+            formatProfileLine(text, sizeof(text), i, &frame->profile[i]);
+            ansiText(&screen, profileArea.y + 2 + i, profileArea.x + 1, text,
+                     0);
+        }
     }
 
-    return filledCells[x][y];
+    ansiFlush(&screen);
 }
 
-void setCellFilling(int x, int y, int filling)
+/* Blocks are spaces on their colour, or in reverse video with none. */
+void drawAnsiLook(int y, int x, int look)
 {
-    if (x < 0 || y < 0 || x >= FIELD_WIDTH || y >= FIELD_HEIGHT) {
+    if (!(look & LOOK_BLOCK)) {
+        ansiPut(&screen, y, x, (unsigned char)look, 0);
         return;
     }
 
-    filledCells[x][y] = filling;
+    int colorPair = look & ~LOOK_BLOCK;
+    ansiPut(&screen, y, x, ' ', colorPair ?
+            ANSI_BACKGROUND(pairColors[colorPair]) : ANSI_REVERSE);
 }
 
-void newGame(void)
+void drawAnsiPreview(const Area *area, Tetromino figure, const char *title,
+                     int titleX)
 {
-    memset(filledCells, 0, sizeof(**filledCells)*(FIELD_WIDTH*FIELD_HEIGHT));
+    ansiBox(&screen, area->y, area->x, area->height, area->width);
+    ansiText(&screen, area->y, area->x + titleX, title, 0);
 
-    int x;
-    int y;
-    for (x = 0; x < FIELD_WIDTH; x++) {
-        setCellFilling(x, FIELD_HEIGHT-1, -1);
-    }
-    for (y = 0; y < FIELD_HEIGHT; y++) {
-        setCellFilling(0, y, -1);
-        setCellFilling(FIELD_WIDTH-1, y, -1);
+    int colorPair = figureColorPair(figure);
+    if (colorPair < 0) {
+        return;
     }
 
-    figure = TetrominoInit;
-    nextFigure = TetrominoInit;
-    storedFigure = TetrominoInit;
-
-    isGameOver = 0;
-    isPaused = 0;
-
-    speed = 25;
-    score = 0;
+    const Point *shape = figureShape(figure, 0);
+    Point pivot = previewPivot(figure);
 
-    fieldRedrawNeeded = 1;
-
-    isMoving = 0;
-
-    workCount = 0;
-
-    chanceI = 0;
-    chanceO = 0;
-    chanceT = 0;
-    chanceJ = 0;
-    chanceL = 0;
-    chanceS = 0;
-    chanceZ = 0;
-
-    storageUsed = 0;
-
-    newFigure();
+    int i;
+    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
+        drawAnsiLook(area->y + pivot.y + shape[i].y,
+                     area->x + pivot.x + shape[i].x, blockLook(colorPair));
+    }
 }
 
-void storageFigure(void)
+/* Fits any duration into five columns. */
+void formatNsec(char *buffer, size_t size, uint64_t nsec)
 {
-    if (!storageUsed) {
-        Tetromino tmp = figure;
-        figure = storedFigure;
-        storedFigure = tmp;
-
-        if (figure == TetrominoInit || figure == TetrominoNone) {
-            figure = randomTetromino();
-        }
-
-        moveFigureToDefaultPosition();
-        updateShadowPosition();
-        fieldRedrawNeeded = 1;
-
-        storageUsed = 1;
-        workCount = 0;
+    if (nsec < 1000) {
+        snprintf(buffer, size, "%un", (unsigned)nsec);
+    }
+    else if (nsec < 10000) {
+        snprintf(buffer, size, "%.1fu", (double)nsec/1e3);
+    }
+    else if (nsec < 1000000) {
+        snprintf(buffer, size, "%uu", (unsigned)(nsec/1000));
+    }
+    else if (nsec < 10000000) {
+        snprintf(buffer, size, "%.1fm", (double)nsec/1e6);
+    }
+    else if (nsec < 1000000000) {
+        snprintf(buffer, size, "%um", (unsigned)(nsec/1000000));
+    }
+    else {
+        snprintf(buffer, size, "%.1fs", (double)nsec/1e9);
     }
 }
 
-int moveFigureToDefaultPosition(void)
-{
-    switch (figure) {
-        case TetrominoI:
-            figureCellsPos[0].x = 5;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 4;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 6;
-            figureCellsPos[2].y = 0;
-            figureCellsPos[3].x = 7;
-            figureCellsPos[3].y = 0;
-            break;
-        case TetrominoO:
-            figureCellsPos[0].x = 5;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 6;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 5;
-            figureCellsPos[2].y = -1;
-            figureCellsPos[3].x = 6;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoT:
-            figureCellsPos[0].x = 6;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 5;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 7;
-            figureCellsPos[2].y = 0;
-            figureCellsPos[3].x = 6;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoJ:
-            figureCellsPos[0].x = 6;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 5;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 7;
-            figureCellsPos[2].y = 0;
-            figureCellsPos[3].x = 5;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoL:
-            figureCellsPos[0].x = 6;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 5;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 7;
-            figureCellsPos[2].y = 0;
-            figureCellsPos[3].x = 7;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoS:
-            figureCellsPos[0].x = 6;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 5;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 6;
-            figureCellsPos[2].y = -1;
-            figureCellsPos[3].x = 7;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoZ:
-            figureCellsPos[0].x = 6;
-            figureCellsPos[0].y = 0;
-            figureCellsPos[1].x = 7;
-            figureCellsPos[1].y = 0;
-            figureCellsPos[2].x = 6;
-            figureCellsPos[2].y = -1;
-            figureCellsPos[3].x = 5;
-            figureCellsPos[3].y = -1;
-            break;
-        case TetrominoNone:
-        case TetrominoInit:
-            break;
-    }
 
-    int i;
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        if (isCellFilled(figureCellsPos[i].x, figureCellsPos[i].y)) {
-            return 0;
-        }
+/* Quitting on purpose drops the saved game, so --resume does not bring
+ * back one that was already given up. */
+void exitGame(void)
+{
+    if (snapshot.file != NULL) {
+        snapshotDiscard(&snapshot);
     }
-
-    return 1;
+    closeGame();
 }
 
-void updateShadowPosition(void)
+/* The session is going away under the player: keep the game for
+ * --resume. */
+void suspendGame(void)
 {
-    int i;
-
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        shadowCellsPos[i] = figureCellsPos[i];
+    if (snapshot.file != NULL && !snapshotSave(&snapshot, &game)) {
+        perror(snapshotPath);
     }
+    closeGame();
+}
 
-    while (shadowCellsPos[0].y < FIELD_HEIGHT) {
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            shadowCellsPos[i].y++;
-        }
-        int isFilled = 0;
-        for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-            if (isCellFilled(shadowCellsPos[i].x, shadowCellsPos[i].y)) {
-                isFilled = 1;
-            }
-        }
-        if (isFilled) {
-            break;
+void closeGame(void)
+{
+    stopRender();
+    closeScreen();
+
+    if (recording.file != NULL && !replayFinish(&recording, tickCount, &game)) {
+        perror(recordPath);
+    }
+
+    if (profileFile != NULL) {
+        profileWriteHistograms(profileFile);
+
+        /* Bytes are only counted by --ansi; for curses they can be taken
+         * from what the terminal received. A drawn frame that changed no
+         * cell sends nothing, so the mean is over those that sent bytes. */
+        fprintf(profileFile, "# Frames count=%llu",
+                (unsigned long long)renderedFrames);
+        if (ansiEnabled) {
+            fprintf(profileFile, " sent=%llu bytes=%llu max=%zu mean=%.1f",
+                    (unsigned long long)screen.frames,
+                    (unsigned long long)screen.bytes, screen.maxBytes,
+                    screen.frames ?
+                    (double)screen.bytes/(double)screen.frames : 0.0);
         }
+        fprintf(profileFile, "\n");
+        fclose(profileFile);
     }
+    plannerDestroy(planner);
+    snapshotClose(&snapshot);
+    streamFlush(&stream);
+    streamClose(&stream);
 
-    for (i = 0; i < FIGURE_CELL_COUNT; i++) {
-        shadowCellsPos[i].y--;
-    }
+    exit(0);
 }
 
-void pauseGame(void)
+/* Puts the terminal back the way the game found it. */
+void closeScreen(void)
 {
-    isPaused = !isPaused;
-    fieldRedrawNeeded = 1;
-}
+    if (ansiEnabled) {
+        ansiClose(&screen);
+        tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+        return;
+    }
 
-void exitGame(void)
-{
     wclear(wField);
     wrefresh(wField);
 
@@ -1470,6 +1826,8 @@ void exitGame(void)
     wclear(wStoredFigure);
     wrefresh(wStoredFigure);
 
+    wclear(wSeed);
+    wrefresh(wSeed);
+
     endwin();
-    exit(0);
 }
@@ -0,0 +1,126 @@
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+
+static void unlinkTimer(WheelTimer *timer);
+
+
+void wheelInit(TimerWheel *wheel, long long now)
+{
+    int i;
+    for (i = 0; i < WHEEL_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+void timerInit(WheelTimer *timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->due = 0;
+}
+
+int timerScheduled(const WheelTimer *timer)
+{
+    return timer->next != NULL;
+}
+
+void wheelSchedule(TimerWheel *wheel, WheelTimer *timer, long long due)
+{
+    if (timerScheduled(timer)) {
+        wheelCancel(wheel, timer);
+    }
+    if (due < wheel->now) {
+        due = wheel->now;
+    }
+
+    WheelTimer *slot = &wheel->slots[due % WHEEL_SLOTS];
+    timer->due = due;
+    timer->next = slot;
+    timer->prev = slot->prev;
+    slot->prev->next = timer;
+    slot->prev = timer;
+    wheel->count++;
+}
+
+void wheelCancel(TimerWheel *wheel, WheelTimer *timer)
+{
+    if (timerScheduled(timer)) {
+        unlinkTimer(timer);
+        wheel->count--;
+    }
+}
+
+/* Every tick from the last one run up to now gets its slot visited once;
+ * a gap longer than a turn visits each slot once. */
+void wheelAdvance(TimerWheel *wheel, long long now, WheelExpire expire,
+                  void *context)
+{
+    long long last = now;
+    if (last - wheel->now >= WHEEL_SLOTS) {
+        last = wheel->now + WHEEL_SLOTS - 1;
+    }
+
+    long long tick;
+    for (tick = wheel->now; tick <= last && wheel->count; tick++) {
+        WheelTimer *slot = &wheel->slots[tick % WHEEL_SLOTS];
+        /* Timers expired here may land back in this very slot a turn
+         * later, so the ones to look at are cut off first. */
+        WheelTimer pending;
+        if (slot->next == slot) {
+            continue;
+        }
+        pending.next = slot->next;
+        pending.prev = slot->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        slot->next = slot;
+        slot->prev = slot;
+
+        while (pending.next != &pending) {
+            WheelTimer *timer = pending.next;
+            unlinkTimer(timer);
+            if (timer->due > now) {
+                timer->next = slot;
+                timer->prev = slot->prev;
+                slot->prev->next = timer;
+                slot->prev = timer;
+                continue;
+            }
+            wheel->count--;
+            expire(context, timer);
+        }
+    }
+
+    wheel->now = now + 1;
+}
+
+int wheelTimeout(const TimerWheel *wheel)
+{
+    if (!wheel->count) {
+        return -1;
+    }
+
+    int ticks;
+    for (ticks = 0; ticks < WHEEL_SLOTS; ticks++) {
+        const WheelTimer *slot =
+            &wheel->slots[(wheel->now + ticks) % WHEEL_SLOTS];
+        if (slot->next != slot) {
+            break;
+        }
+    }
+
+    return ticks;
+}
+
+static void unlinkTimer(WheelTimer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
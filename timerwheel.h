@@ -0,0 +1,43 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+
+/* One slot per tick; timers further out than a turn of the wheel wait in
+ * their slot for the turns in between. */
+#define WHEEL_SLOTS 1024
+
+
+/* Embedded in whatever it times; unlinked while not scheduled. */
+typedef struct WheelTimer {
+    struct WheelTimer *next;
+    struct WheelTimer *prev;
+    long long due;
+} WheelTimer;
+
+typedef struct {
+    WheelTimer slots[WHEEL_SLOTS];
+    long long now;
+    int count;
+} TimerWheel;
+
+/* Called for every timer that falls due, already unlinked, so it may be
+ * scheduled again from the callback. */
+typedef void (*WheelExpire)(void *context, WheelTimer *timer);
+
+
+void wheelInit(TimerWheel *wheel, long long now);
+void timerInit(WheelTimer *timer);
+int timerScheduled(const WheelTimer *timer);
+
+/* Ticks in the past count as the current one. */
+void wheelSchedule(TimerWheel *wheel, WheelTimer *timer, long long due);
+void wheelCancel(TimerWheel *wheel, WheelTimer *timer);
+/* Moves the wheel on to now, expiring every timer due by then. */
+void wheelAdvance(TimerWheel *wheel, long long now, WheelExpire expire,
+                  void *context);
+/* Ticks until the first slot with a timer in it, at most a turn, or -1
+ * when nothing is scheduled. Timers turns away make it early, never
+ * late. */
+int wheelTimeout(const TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "transposition.h"
+
+
+/* The empty board's key is 0, which an all-zero entry would match. */
+#define TABLE_SALT  0x9e3779b97f4a7c15ull
+
+
+static uint64_t scoreBits(double score);
+static double bitsScore(uint64_t bits);
+
+
+int tableCreate(TranspositionTable *table, int bits)
+{
+    size_t count = (size_t)1 << bits;
+    void *buckets;
+
+    if (posix_memalign(&buckets, sizeof(TableBucket),
+                       count*sizeof(TableBucket)) != 0) {
+        table->buckets = NULL;
+        return 0;
+    }
+    table->buckets = buckets;
+    table->mask = count - 1;
+    tableClear(table);
+
+    return 1;
+}
+
+void tableDestroy(TranspositionTable *table)
+{
+    free(table->buckets);
+    table->buckets = NULL;
+}
+
+void tableClear(TranspositionTable *table)
+{
+    memset(table->buckets, 0, (table->mask + 1)*sizeof(TableBucket));
+}
+
+int tableProbe(const TranspositionTable *table, uint64_t key, double *score,
+               TableStats *stats)
+{
+    const TableBucket *bucket = &table->buckets[key & table->mask];
+    stats->probes++;
+
+    int i;
+    for (i = 0; i < TABLE_BUCKET_ENTRIES; i++) {
+        uint64_t check = __atomic_load_n(&bucket->entries[i].check,
+                                         __ATOMIC_RELAXED);
+        uint64_t data = __atomic_load_n(&bucket->entries[i].data,
+                                        __ATOMIC_RELAXED);
+        if ((check ^ data ^ TABLE_SALT) == key) {
+            *score = bitsScore(data);
+            stats->hits++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Takes the entry already holding key, else an empty one, else one picked
+ * by bits of the key the bucket index does not use. */
+void tableStore(TranspositionTable *table, uint64_t key, double score,
+                TableStats *stats)
+{
+    TableBucket *bucket = &table->buckets[key & table->mask];
+    int slot = -1;
+
+    int i;
+    for (i = 0; i < TABLE_BUCKET_ENTRIES; i++) {
+        uint64_t check = __atomic_load_n(&bucket->entries[i].check,
+                                         __ATOMIC_RELAXED);
+        uint64_t data = __atomic_load_n(&bucket->entries[i].data,
+                                        __ATOMIC_RELAXED);
+        if ((check ^ data ^ TABLE_SALT) == key) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 && !check && !data) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        slot = (int)((key >> 32) % TABLE_BUCKET_ENTRIES);
+    }
+
+    uint64_t data = scoreBits(score);
+    __atomic_store_n(&bucket->entries[slot].check, key ^ data ^ TABLE_SALT,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->entries[slot].data, data, __ATOMIC_RELAXED);
+    stats->stores++;
+}
+
+static uint64_t scoreBits(double score)
+{
+    uint64_t bits;
+    memcpy(&bits, &score, sizeof(bits));
+
+    return bits;
+}
+
+static double bitsScore(uint64_t bits)
+{
+    double score;
+    memcpy(&score, &bits, sizeof(score));
+
+    return score;
+}
@@ -0,0 +1,47 @@
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+#include <stdint.h>
+
+
+#define TABLE_BUCKET_ENTRIES 4
+
+
+/* Each word is read and written atomically, but not the pair; check is
+ * the key xor data xor a salt, so an entry torn by two writers simply
+ * misses, and so does an empty one when the key is 0. */
+typedef struct {
+    uint64_t check;
+    uint64_t data;
+} TableEntry;
+
+/* One cache line, so a probe touches one line. */
+typedef struct {
+    TableEntry entries[TABLE_BUCKET_ENTRIES];
+} __attribute__((aligned(64))) TableBucket;
+
+/* Fixed size and shared by every thread without locks. */
+typedef struct {
+    TableBucket *buckets;
+    uint64_t mask;
+} TranspositionTable;
+
+/* Kept per thread by the caller and added up when asked for. */
+typedef struct {
+    uint64_t probes;
+    uint64_t hits;
+    uint64_t stores;
+} TableStats;
+
+
+/* 1 << bits buckets. Returns 0 when out of memory. */
+int tableCreate(TranspositionTable *table, int bits);
+void tableDestroy(TranspositionTable *table);
+void tableClear(TranspositionTable *table);
+
+int tableProbe(const TranspositionTable *table, uint64_t key, double *score,
+               TableStats *stats);
+void tableStore(TranspositionTable *table, uint64_t key, double score,
+                TableStats *stats);
+
+#endif
@@ -0,0 +1,35 @@
+#include "zobrist.h"
+
+
+uint64_t zobristBoardKey(const GameState *state)
+{
+    uint64_t key = 0;
+
+    int y;
+    for (y = 0; y < state->height-1; y++) {
+        key ^= zobristRow(y, state->rows[y], state->width);
+    }
+
+    return key;
+}
+
+uint64_t zobristRow(int y, Row row, int width)
+{
+    uint64_t key = 0;
+    Row cells = row & FULL_ROW(width) & ~WALL_ROW(width);
+
+    while (cells) {
+        key ^= zobristCell(__builtin_ctz(cells), y);
+        cells &= (Row)(cells - 1);
+    }
+
+    return key;
+}
+
+uint64_t zobristKey(const GameState *state)
+{
+    return state->boardKey ^
+           zobristFigure(ZobristFigure, state->figure) ^
+           zobristFigure(ZobristNextFigure, state->nextFigure) ^
+           zobristFigure(ZobristStoredFigure, state->storedFigure);
+}
@@ -0,0 +1,50 @@
+#ifndef ZOBRIST_H
+#define ZOBRIST_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+
+/* Figure slots hashed next to the board. */
+typedef enum {
+    ZobristFigure,
+    ZobristNextFigure,
+    ZobristStoredFigure,
+} ZobristSlot;
+
+/* Cheap enough to work out every time, so there is no table to fill or
+ * share: every cell and every figure in every slot gets the SplitMix64
+ * output for its own index. */
+static inline uint64_t zobristMix(uint64_t index)
+{
+    uint64_t z = index*0x9e3779b97f4a7c15ull + 0x2545f4914f6cdd1dull;
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t zobristCell(int x, int y)
+{
+    return zobristMix((uint64_t)(y*MAX_FIELD_WIDTH + x));
+}
+
+static inline uint64_t zobristFigure(ZobristSlot slot, Tetromino figure)
+{
+    return zobristMix((uint64_t)(MAX_FIELD_WIDTH*MAX_FIELD_HEIGHT +
+                                 (int)slot*(TETROMINO_COUNT + 2) +
+                                 (int)figure - TetrominoInit));
+}
+
+
+/* Only the cells inside the walls count; state->boardKey is kept equal to
+ * this by setCellFilling() and the line clears. */
+uint64_t zobristBoardKey(const GameState *state);
+/* Key of the cells of board row y, which must be above the floor, in a
+ * field this wide. */
+uint64_t zobristRow(int y, Row row, int width);
+/* The board with the current, next and stored figures. */
+uint64_t zobristKey(const GameState *state);
+
+#endif